@@ -6,30 +6,185 @@
 #include <stdlib.h>
 #include "error.h"
 
+// initial allocation and read size for inputs of unknown length
+#define BUFFER_READ_CHUNK 0x100000
+
+// bytes kept free in front of data that was read
+// so a rom header can be prepended without moving the data
+#define BUFFER_FRONT_SLACK 0x40
+
+// the most dirty ranges a buffer tracks before
+// they are collapsed into a single range
+#define BUFFER_DIRTY_MAX 64
+
+// padding at least this long is recorded as fill
+// instead of being written into data
+#define BUFFER_SPARSE_MIN 0x10000
+
+// bytes per chunk when an array is formatted on multiple threads
+#define BUFFER_ARRAY_CHUNK 0x40000
+
+// the longest formatted array element "0xff, " and a line break
+#define BUFFER_ARRAY_ELEMENT_MAX 7
+
+// A modified range of the buffer [start, end).
+// version is the buffer version of the latest write to it
+typedef struct BufferRange { // NOLINT
+  usize start;
+  usize end;
+  u64 version;
+} BufferRange;
+
 typedef struct Buffer { // NOLINT
   usize len;
   u8 *data;
+
+  // the allocation data points into.
+  // data may start past base when there is slack in front of it
+  // cap is the size of the allocation starting at base
+  u8 *base;
+  usize cap;
+
+  // when set base is a private copy-on-write mapping
+  // of cap bytes instead of a heap allocation
+  bool mapped;
+
+  // sorted, non-overlapping ranges modified since the buffer was loaded.
+  // version is incremented by every modification so consumers
+  // can ask what changed since they last looked at the buffer
+  BufferRange *dirty;
+  usize dirty_len;
+  u64 version;
+
+  // fill_len bytes of fill_val that follow data without being stored.
+  // Long paddings are kept here until something needs their bytes,
+  // call buffer_materialize before accessing them through data
+  usize fill_len;
+  u8 fill_val;
+
+  // the file the buffer was mapped from or -1.
+  // Bytes outside of the dirty ranges still match it at the same offset
+  // and are copied from it by the kernel when the buffer is written
+  int src_fd;
 } Buffer;
 
+typedef struct BufferArrayFmt { // NOLINT
+  // elements per line. 0 puts every element on the same line
+  usize per_line;
+
+  // worker threads formatting large arrays. 0 uses every core
+  usize threads;
+} BufferArrayFmt;
+
 void buffer_init(Buffer *buffer);
 Error buffer_read(Buffer *buffer, FILE *file);
+// Reads at most max bytes of the file
+Error buffer_read_max(Buffer *buffer, FILE *file, const usize max);
+
+// Maps a regular file into the buffer instead of reading it.
+// Pages are only copied when they are written to and the mapping
+// is promoted to a heap allocation once the buffer grows past the file.
+// Returns ERR_READ if the file cannot be mapped (e.g. a pipe),
+// in which case buffer_read should be used instead.
+Error buffer_map(Buffer *buffer, FILE *file);
+
+// Writes the buffer including its fill.
+// Unmodified ranges of a mapped buffer are copied from the input
+// with copy_file_range or sendfile instead of from memory.
+// Zero fill becomes a hole in regular files
 Error buffer_write(const Buffer *buffer, FILE *file);
-Error buffer_write_array(const Buffer *buffer, FILE *file, char *name,
-                         char *type);
+
+// Writes the buffer as a c array. Large buffers are formatted
+// in chunks on multiple threads, the output does not depend on
+// the amount of threads. fmt may be NULL for one line on one thread
+Error buffer_write_array(const Buffer *buffer, FILE *file, const char *name,
+                         const char *type, const BufferArrayFmt *fmt);
+// Writes the bytes [start, end) of the buffer as a c array
+Error buffer_write_array_range(const Buffer *buffer, FILE *file,
+                               const char *name, const char *type,
+                               const BufferArrayFmt *fmt, const usize start,
+                               const usize end);
 Error buffer_write_text_array(const Buffer *buffer, FILE *file, char *name,
                               char *type);
 
-void buffer_pad_to(Buffer *buffer, const usize len, const u8 val);
-void buffer_pad_by(Buffer *buffer, const usize len, const u8 val);
+// Parses c array text back into bytes, replacing the text.
+// Elements may be hex (0x), octal (0) or decimal literals
+// separated by commas and whitespace. If the text contains a declaration
+// only its initializer is parsed. Returns ERR_PARSE for invalid text
+Error buffer_parse_array(Buffer *buffer);
+
+// Pads the buffer to len bytes. Long paddings are recorded as fill.
+// Functions that grow the buffer return ERR_ALLOC and leave it
+// unchanged if it cannot grow
+Error buffer_pad_to(Buffer *buffer, const usize len, const u8 val);
+Error buffer_pad_by(Buffer *buffer, const usize len, const u8 val);
 
-void buffer_inject(Buffer *buffer, const usize loc, const u8 *data,
-                   const usize len);
+Error buffer_inject(Buffer *buffer, const usize loc, const u8 *data,
+                    const usize len);
 Error buffer_inject_file(Buffer *buffer, usize loc, FILE *file);
 
-void buffer_set(Buffer *buffer, const usize loc, const u8 val, const u8 len);
+Error buffer_set(Buffer *buffer, const usize loc, const u8 val,
+                 const u8 len);
+
+// Inserts len bytes of val in front of the buffer.
+// Slack in front of data is used if there is enough of it,
+// otherwise the data is moved back inside the allocation.
+Error buffer_prepend(Buffer *buffer, const usize len, const u8 val);
+
+// Shortens the buffer to len bytes. Does nothing if it is already shorter
+void buffer_trim(Buffer *buffer, const usize len);
+
+// Length of the buffer including fill
+usize buffer_len(const Buffer *buffer);
+
+// Stores the fill in front of end in data so the first end bytes
+// (or all of them if the buffer is shorter) can be accessed directly
+void buffer_materialize(Buffer *buffer, const usize end);
+
+// Grows the buffer to new_len. Fill keeps its value, new bytes are zeroed.
+// The allocation grows geometrically so repeated calls are amortized.
+Error buffer_resize(Buffer *buffer, const usize new_len);
+
+// Records that len bytes starting at loc were modified.
+// Every function that writes to the buffer calls this,
+// code that writes to data directly has to call it as well
+void buffer_mark_dirty(Buffer *buffer, const usize loc, const usize len);
 
-void buffer_resize(Buffer *buffer, const usize new_len);
+// Finds the lowest offset at or past from that was modified after version.
+// Returns FALSE if nothing there was modified since then
+bool buffer_dirty_since(const Buffer *buffer, const u64 version,
+                        const usize from, usize *start);
+
+// Writes the dirty ranges back to the file the buffer was mapped from
+// and truncates or extends it to the length of the buffer.
+// written is set to the amount of bytes written.
+// The file has to be opened for writing
+Error buffer_sync(Buffer *buffer, usize *written);
+
+// Forgets every dirty range. Only valid once the source file
+// matches the buffer again, unmodified ranges are copied from it
+void buffer_dirty_clear(Buffer *buffer);
 
 void buffer_free(Buffer *buffer);
 
+#ifdef TEST
+
+#include "macros.h"
+
+// Reads in to the end with buffer_read or the bytewise reference reader
+// and prints the throughput to out. Used by make benchread
+int buffer_bench_read(FILE *in, FILE *out, bool bytewise);
+
+void test_buffer_read(void **state);
+void test_buffer_map(void **state);
+void test_buffer_grow(void **state);
+void test_buffer_dirty(void **state);
+void test_buffer_sparse(void **state);
+void test_buffer_write_src(void **state);
+void test_buffer_sync(void **state);
+void test_buffer_array(void **state);
+void test_buffer_parse_array(void **state);
+
+#endif
+
 #endif
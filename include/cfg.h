@@ -5,4 +5,13 @@
 
 extern u32 nuss_verbose;
 
+// socket of the session daemon usb operations are sent to, or NULL
+extern const char *nuss_session;
+
+// backend of the usb operations, see nustransport.h. NULL is ftdi
+extern const char *nuss_transport;
+
+// NusStatsFormat the usb statistics are printed in, 0 is off
+extern u32 nuss_stats;
+
 #endif
@@ -12,7 +12,13 @@ typedef enum Error {
   ERR_NUS_USB,
   ERR_BMP_BAD_COLOR,
   ERR_BMP_HEADER,
-  ERR_BMP_UNSUPPORTED_BPP
+  ERR_BMP_UNSUPPORTED_BPP,
+  ERR_CRC_MISMATCH,
+  ERR_THREAD,
+  ERR_EXPORT_ARCH,
+  ERR_PARSE,
+  ERR_TRANSPORT,
+  ERR_ALLOC
 } Error;
 
 void error_fprint(FILE *file, Error error);
@@ -0,0 +1,57 @@
+#ifndef EXPORT_H_
+#define EXPORT_H_
+
+#include "buffer.h"
+#include "error.h"
+#include "types.h"
+#include <stdio.h>
+
+/**
+ * Alternatives to buffer_write_array that do not
+ * have to go through the c front end of the compiler.
+ *
+ * Every export provides the data as NAME and its length as NAME_LEN.
+ * Object files and assembler stubs define NAME_LEN as a 32 bit
+ * integer (extern const u32 NAME_LEN), embed headers as a define.
+ */
+
+typedef enum ExportArch {
+  // elf32 big endian for the vr4300 with the o64 abi
+  EXPORT_ARCH_MIPS,
+  // elf64 little endian for tools running on the host
+  EXPORT_ARCH_X86_64
+} ExportArch;
+
+// Parses mips or x86_64. Returns ERR_EXPORT_ARCH for anything else
+Error export_arch_from_name(const char *name, ExportArch *arch);
+
+// Writes a relocatable elf object with the buffer in .rodata
+Error export_elf(const Buffer *buffer, FILE *file, const char *name,
+                 ExportArch arch);
+
+// Writes a GNU as stub that includes the binary at path with .incbin
+Error export_incbin(const Buffer *buffer, FILE *file, const char *name,
+                    const char *path);
+
+// Writes a header that includes the binary at path with C23 #embed
+Error export_embed(const Buffer *buffer, FILE *file, const char *name,
+                   const char *type, const char *path);
+
+// Writes the buffer as c arrays of at most shard_len bytes
+// so they can be compiled in parallel. Array NAME_i goes to prefix_i.c.
+// shard_len is rounded down to a multiple of align (but at least align).
+// header gets their declarations, an index array NAME of the shards,
+// NAME_SHARDS, NAME_SHARD_LEN and the total NAME_LEN
+Error export_shards(const Buffer *buffer, FILE *header, const char *prefix,
+                    const char *name, const char *type,
+                    const BufferArrayFmt *fmt, usize shard_len, usize align);
+
+#ifdef TEST
+
+void test_export_elf(void **state);
+void test_export_shards(void **state);
+void test_export_text(void **state);
+
+#endif
+
+#endif
@@ -1,8 +1,8 @@
 #ifndef MACROS_H_
 #define MACROS_H_
 
-#define MIN(a, b) a < b ? a : b
-#define MAX(a, b) a > b ? a : b
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #ifdef TEST
 #include <stdarg.h>
@@ -0,0 +1,86 @@
+#ifndef NUSCRC_H_
+#define NUSCRC_H_
+
+#include "types.h"
+
+/**
+ * Kernels for the n64 rom checksum.
+ * The checksum is a fold over the big endian 32 bit words
+ * of the crc area. Most of its state is associative
+ * (sums and xors) and can be computed in vector registers,
+ * only a2 has to be computed one word after another.
+ */
+
+// the boot code (ipl3) follows the header.
+// the cic chip that belongs to it decides how the crc is calculated
+#define NUS_IPL3_START 0x40
+#define NUS_IPL3_END 0x1000
+
+// 6105 boot code mixes this part of itself into the crc
+#define NUS_CIC_6105_KEY 0x750
+#define NUS_CIC_6105_KEY_LEN 0x100
+
+typedef enum NusCic {
+  NUS_CIC_UNKNOWN = 0,
+  NUS_CIC_6101 = 6101,
+  NUS_CIC_6102 = 6102,
+  NUS_CIC_6103 = 6103,
+  NUS_CIC_6105 = 6105,
+  NUS_CIC_6106 = 6106
+} NusCic;
+
+typedef struct NusCrcState { // NOLINT
+  u32 t2;
+  u32 t3;
+  u32 a2;
+  u32 t4;
+  u32 crc1;
+  u32 crc2;
+} NusCrcState;
+
+// Folds len bytes of data into the state.
+// len has to be a multiple of 4
+typedef void (*NusCrcKernel)(NusCrcState *state, const u8 *data, usize len);
+
+void nus_crc_state_init(NusCrcState *state, u32 seed);
+
+// The reference implementation
+void nus_crc_kernel_scalar(NusCrcState *state, const u8 *data, usize len);
+
+// These are only available on x86 and must only be called
+// if the cpu supports the instruction set. Use nus_crc_kernel.
+void nus_crc_kernel_sse41(NusCrcState *state, const u8 *data, usize len);
+void nus_crc_kernel_avx2(NusCrcState *state, const u8 *data, usize len);
+
+// The fastest kernel the cpu supports: avx2 or scalar
+NusCrcKernel nus_crc_kernel(void);
+
+// The 6105 variant. key points to the NUS_CIC_6105_KEY_LEN key bytes
+// of the boot code and offset is the rom offset of data
+void nus_crc_kernel_6105(NusCrcState *state, const u8 *data, usize len,
+                         const u8 *key, usize offset);
+
+// CRC-32 (IEEE). Start with crc 0 and pass the result of the previous
+// call to continue with the next chunk
+u32 nus_crc32(u32 crc, const u8 *data, usize len);
+
+// Looks up the cic by the CRC-32 of the boot code
+NusCic nus_cic_from_hash(u32 hash);
+
+// Identifies the cic by hashing the boot code of the rom.
+// Returns NUS_CIC_UNKNOWN for unknown boot code or a too short rom
+NusCic nus_cic_identify(const u8 *data, usize len);
+
+// The initial crc state for the cic. Unknown boot code uses 6102
+u32 nus_cic_seed(NusCic cic);
+
+#ifdef TEST
+
+#include "macros.h"
+
+void test_crc_kernels(void **state);
+void test_cic(void **state);
+
+#endif
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef NUSEMU_H_
+#define NUSEMU_H_
+
+#include "types.h"
+
+/**
+ * An emulated cart behind the emu transport.
+ *
+ * It answers the commands nususb sends (t, W, R, w, r, c and s).
+ * Its rom and ram live as long as the process, like a cart that stays
+ * powered between connections. Every transfer takes the latency
+ * of the transport plus its size over the bandwidth, so loads and dumps
+ * can be tested and benchmarked without hardware.
+ */
+
+#define NUS_EMU_ROM_ADDR 0x10000000
+#define NUS_EMU_ROM_LEN 0x4000000
+#define NUS_EMU_RAM_ADDR 0x80000000
+#define NUS_EMU_RAM_LEN 0x800000
+
+typedef struct NusEmuStats { // NOLINT
+  // bytes sent by the host, including commands
+  u64 written;
+  // bytes sent to the host
+  u64 read;
+  u64 commands;
+  u64 boots;
+} NusEmuStats;
+
+const NusEmuStats *nus_emu_stats(void);
+
+// The emulated memory at addr if len bytes fit in rom or ram, else NULL
+u8 *nus_emu_memory(u32 addr, usize len);
+
+// Power cycles the cart. Its memory is cleared and so are the stats
+void nus_emu_reset(void);
+
+#ifdef TEST
+
+void test_nus_emu(void **state);
+
+#endif
+
+#endif
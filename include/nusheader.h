@@ -3,6 +3,7 @@
 
 #include "buffer.h"
 #include "error.h"
+#include "nuscrc.h"
 #include "types.h"
 #include <stdio.h>
 
@@ -17,6 +18,45 @@ typedef struct NusCrc { // NOLINT
   u32 crc2;
 } NusCrc;
 
+// Incremental crc calculation.
+// The rom is fed from offset 0 in chunks of any size.
+// The boot code is hashed on the way to identify the cic,
+// other bytes outside of the crc area are skipped.
+typedef struct NusCrcCtx { // NOLINT
+  NusCrcState state;
+  // the amount of rom bytes seen so far
+  usize offset;
+  u8 partial[4];
+  usize partial_len;
+
+  NusCic cic;
+  bool forced;
+  u32 ipl3_hash;
+  u8 key[NUS_CIC_6105_KEY_LEN];
+} NusCrcCtx;
+
+#define NUS_CRC_CACHE_MAGIC 0x4E555343 // NUSC
+
+// distance between two crc state snapshots
+#define NUS_CRC_CHECKPOINT 0x10000
+#define NUS_CRC_CHECKPOINTS (NUS_CRC_LEN / NUS_CRC_CHECKPOINT)
+
+// Keeps snapshots of the crc state of a buffer
+// so it can be recalculated starting at the first modified byte.
+// A cache belongs to exactly one buffer, init it again
+// when the buffer is replaced
+typedef struct NusCrcCache { // NOLINT
+  // the buffer version the snapshots were taken at
+  u64 version;
+  // checkpoints[i] is the state before checkpoint block i
+  usize valid;
+  NusCrcState checkpoints[NUS_CRC_CHECKPOINTS];
+  NusCrcState final;
+  NusCic cic;
+  // the amount of bytes the last call had to hash
+  usize hashed;
+} NusCrcCache;
+
 typedef struct NusHeader { // NOLINT
   u32 cfg_flags;
   u32 clck_rate;
@@ -32,6 +72,9 @@ typedef struct NusHeader { // NOLINT
   char unique[2];
   char destination;
   u8 version;
+
+  // identified from the boot code, not part of the header bytes
+  NusCic cic;
 } NusHeader;
 
 // Creates enough space in the buffer for a header
@@ -42,6 +85,11 @@ void nus_add_header(Buffer *buffer);
 // This function assumes the buffer already has enough room for a header
 void nus_set_header(Buffer *buffer, NusHeader *header);
 
+// Same as nus_set_header but only hashes what changed since
+// the crc was last calculated with this cache
+void nus_set_header_cached(Buffer *buffer, NusHeader *header,
+                           NusCrcCache *cache);
+
 /**
  * Format print the nus header
  */
@@ -49,11 +97,50 @@ void nus_fprint(FILE *file, const NusHeader *header);
 
 void nus_init(NusHeader *header);
 
+// Decodes the header. The crc is the one stored in the header,
+// use nus_crc or nus_crc_verify to calculate it.
+// The cic is identified if data contains the boot code
 Error nus_from_bytes(NusHeader *header, const u8 *data, const usize len);
 void nus_to_bytes(NusHeader *header, u8 *result);
 
 Error nus_crc(NusHeader *header, const u8 *data, const usize len);
 
+void nus_crc_init(NusCrcCtx *ctx);
+// Skips identification and calculates the crc for the given cic
+void nus_crc_init_cic(NusCrcCtx *ctx, NusCic cic);
+void nus_crc_update(NusCrcCtx *ctx, const u8 *data, usize len);
+// Returns ERR_CRC_NOT_ENOUGH_DATA if the rom ended before the crc area did
+Error nus_crc_final(NusCrcCtx *ctx, NusCrc *crc);
+
+void nus_crc_cache_init(NusCrcCache *cache);
+
+// Calculates the crc of the buffer. Resumes from the last checkpoint
+// in front of the first byte modified since the previous call
+// and does not hash anything if the crc area was not modified
+Error nus_crc_cached(NusCrcCache *cache, Buffer *buffer, NusCrc *crc);
+
+// Compares the crc stored in the header with the crc of the data.
+// Returns ERR_CRC_MISMATCH if they differ
+Error nus_crc_verify(const u8 *data, const usize len, NusCrc *stored,
+                     NusCrc *computed);
+Error nus_crc_verify_cached(NusCrcCache *cache, Buffer *buffer,
+                            NusCrc *stored, NusCrc *computed);
+
+// Checkpoints of a file that outlive the process, so the next run
+// on the same file only hashes what it changes. They are kept next
+// to the manifests (see nusmanifest.h), keyed by the identity of the
+// file, and only loaded while its size and modification time are
+// unchanged and its header holds the crc they end in.
+// buffer has to be mapped from the file
+Error nus_crc_cache_load(NusCrcCache *cache, const Buffer *buffer);
+// Saves a cache that was used. It has to be up to date with the buffer
+// and the buffer synced to its file, see nus_crc_cache_sync
+Error nus_crc_cache_save(NusCrcCache *cache, const Buffer *buffer);
+// Brings a cache that was used up to date while the buffer still knows
+// what was modified, syncs the buffer to its file and saves the cache
+Error nus_crc_cache_sync(NusCrcCache *cache, Buffer *buffer,
+                         usize *written);
+
 #ifdef TEST
 
 #include "macros.h"
@@ -62,6 +149,14 @@ void test_crc_fail(void **state);
 
 void test_crc(void **state);
 
+void test_crc_stream(void **state);
+
+void test_crc_cache(void **state);
+
+void test_crc_cache_file(void **state);
+
+void test_crc_cic(void **state);
+
 #endif
 
 #endif
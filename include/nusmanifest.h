@@ -0,0 +1,73 @@
+#ifndef NUSMANIFEST_H_
+#define NUSMANIFEST_H_
+
+#include "error.h"
+#include "types.h"
+
+/**
+ * Remembers what was last loaded into a cart as hashes of
+ * NUS_MANIFEST_BLOCK byte blocks, so a load only has to send
+ * the blocks that changed.
+ *
+ * There is one manifest per device serial in NUSS_MANIFEST_DIR,
+ * $XDG_CACHE_HOME/nusstool or ~/.cache/nusstool.
+ * Setting NUSS_MANIFEST_DIR to an empty string turns manifests off.
+ */
+
+#define NUS_MANIFEST_MAGIC 0x4E55534D // NUSM
+#define NUS_MANIFEST_BLOCK 0x10000
+// bytes at the start of the rom that are read back
+// to check that the cart still holds it
+#define NUS_MANIFEST_PROBE 512
+#define NUS_MANIFEST_PATH_MAX 512
+
+typedef struct NusManifest { // NOLINT
+  u32 addr;
+  u64 len;
+  // hash of the first NUS_MANIFEST_PROBE bytes
+  u64 probe;
+  // one hash per block, the last block may be short
+  u64 *hashes;
+  usize count;
+} NusManifest;
+
+void nus_manifest_init(NusManifest *manifest);
+void nus_manifest_free(NusManifest *manifest);
+
+u64 nus_manifest_hash(const u8 *data, usize len);
+
+// Hashes the len bytes at data that are loaded to addr
+Error nus_manifest_build(NusManifest *manifest, u32 addr, const u8 *data,
+                         usize len);
+
+// True if block i of next has to be sent to a cart holding prev
+bool nus_manifest_dirty(const NusManifest *prev, const NusManifest *next,
+                        usize i);
+
+// Counts the blocks of the manifest that are fully covered by the
+// len bytes dumped from addr and do not match them
+usize nus_manifest_mismatches(const NusManifest *manifest, u32 addr,
+                              const u8 *data, usize len);
+
+// The manifest file of serial. Fails if manifests are turned off
+Error nus_manifest_path(char *path, usize len, const char *serial);
+
+// The file name.ext next to the manifests, for other state that is
+// kept between runs. create makes the directory if it is missing
+Error nus_manifest_cache_path(char *path, usize len, const char *name,
+                              const char *ext, bool create);
+
+Error nus_manifest_load(NusManifest *manifest, const char *serial);
+Error nus_manifest_save(const NusManifest *manifest, const char *serial);
+
+// Removes the manifest of serial, the next load sends everything
+void nus_manifest_forget(const char *serial);
+
+#ifdef TEST
+
+void test_nus_manifest(void **state);
+void test_nus_manifest_file(void **state);
+
+#endif
+
+#endif
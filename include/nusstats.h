@@ -0,0 +1,65 @@
+#ifndef NUSSTATS_H_
+#define NUSSTATS_H_
+
+#include "types.h"
+#include <stdio.h>
+
+/**
+ * Counters of the usb transfers, printed by --stats.
+ *
+ * Blocks are the units the link moves at once: the usb transfers
+ * of an upload and the regions of a dump. Their latencies go into
+ * log2 buckets, bucket i counts latencies below 2^i microseconds.
+ */
+
+#define NUS_STATS_BUCKETS 28
+
+typedef enum NusStatsFormat {
+  NUS_STATS_OFF,
+  NUS_STATS_TABLE,
+  NUS_STATS_JSON
+} NusStatsFormat;
+
+typedef struct NusStatsDir { // NOLINT
+  u64 bytes;
+  // wall time of the operations moving the bytes
+  f64 seconds;
+  u64 blocks;
+  f64 latency_max;
+  u64 buckets[NUS_STATS_BUCKETS];
+} NusStatsDir;
+
+typedef struct NusStats { // NOLINT
+  NusStatsDir write;
+  NusStatsDir read;
+  u64 handshakes;
+  f64 handshake_seconds;
+  // handshake attempts that had to be repeated
+  u64 retries;
+  // reads that came back empty while waiting for the cart
+  u64 stalls;
+} NusStats;
+
+void nus_stats_init(NusStats *stats);
+
+f64 nus_stats_now(void);
+
+// Records a block that took latency seconds
+void nus_stats_block(NusStatsDir *dir, f64 latency);
+
+// The upper bound of the bucket holding the p-th fraction of the blocks,
+// in seconds
+f64 nus_stats_percentile(const NusStatsDir *dir, f64 p);
+
+// Parses table or json
+NusStatsFormat nus_stats_format_from_name(const char *name);
+
+void nus_stats_print(const NusStats *stats, FILE *file, NusStatsFormat format);
+
+#ifdef TEST
+
+void test_nus_stats(void **state);
+
+#endif
+
+#endif
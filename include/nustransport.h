@@ -0,0 +1,66 @@
+#ifndef NUSTRANSPORT_H_
+#define NUSTRANSPORT_H_
+
+#include "error.h"
+#include "nusstats.h"
+#include "types.h"
+
+/**
+ * The link between the host and the cart.
+ *
+ * nususb speaks the cart protocol on top of a transport,
+ * the backend decides where the bytes go:
+ *   ftdi                  the cart on the ftdi usb chip
+ *   emu[:BYTES_PER_S[:LATENCY_US]]
+ *                         an in-process emulated cart, see nusemu.h
+ */
+
+#define NUS_TRANSPORT_SERIAL_MAX 64
+// the serial of carts whose serial cannot be read
+#define NUS_TRANSPORT_SERIAL_UNKNOWN "default"
+
+typedef struct NusTransport NusTransport;
+
+typedef struct NusTransportOps { // NOLINT
+  const char *name;
+  // connects and fills in the serial of the cart
+  Error (*open)(NusTransport *transport);
+  // sends all len bytes
+  Error (*write)(NusTransport *transport, const u8 *data, usize len);
+  // receives up to len bytes. Returns 0 if nothing arrived in time
+  // and a negative value on errors
+  i64 (*read)(NusTransport *transport, u8 *data, usize len);
+  Error (*close)(NusTransport *transport);
+} NusTransportOps;
+
+struct NusTransport {
+  const NusTransportOps *ops;
+  // state of the open backend
+  void *ctx;
+  // emulated link speed, 0 is unlimited
+  u64 bandwidth;
+  u64 latency_us;
+  // the backend records the usb transfers of writes here while set
+  NusStats *stats;
+  char serial[NUS_TRANSPORT_SERIAL_MAX];
+};
+
+extern const NusTransportOps nus_transport_ftdi;
+extern const NusTransportOps nus_transport_emu;
+
+// Picks the backend described by spec, NULL is ftdi.
+// Returns ERR_TRANSPORT for unknown backends
+Error nus_transport_init(NusTransport *transport, const char *spec);
+
+Error nus_transport_open(NusTransport *transport);
+Error nus_transport_write(NusTransport *transport, const u8 *data, usize len);
+i64 nus_transport_read(NusTransport *transport, u8 *data, usize len);
+Error nus_transport_close(NusTransport *transport);
+
+#ifdef TEST
+
+void test_nus_transport_init(void **state);
+
+#endif
+
+#endif
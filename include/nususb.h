@@ -3,16 +3,102 @@
 
 #include "buffer.h"
 #include "error.h"
+#include "nusheader.h"
+#include "nustransport.h"
 #include <stdio.h>
 #include <stdlib.h>
 
-// undef to remove this feature
+// undef to remove the ftdi transport
 // #define NO_NUSUSB
 
+typedef enum NusUsbOp {
+  NUS_USB_BOOT,
+  NUS_USB_LOAD,
+  NUS_USB_DUMP,
+  NUS_USB_RAM_WR,
+  NUS_USB_RAM_RD,
+  // a rom load followed by a boot as soon as the cart is ready
+  NUS_USB_LOAD_BOOT
+} NusUsbOp;
+
+#define NUS_USB_BUF_LEN 512
+
+// What a streaming read computed while the bytes went by
+typedef struct NusUsbDigest { // NOLINT
+  // CRC-32 of every byte read
+  u32 crc32;
+  // the rom checksum of the bytes and the one stored in their header.
+  // crc_err is ERR_CRC_NOT_ENOUGH_DATA if the dump ended
+  // before the crc area did
+  NusCrc crc;
+  NusCrc stored;
+  Error crc_err;
+} NusUsbDigest;
+
+// What a rom load sent. delta is set if it only sent
+// the blocks that changed since the last load, see nusmanifest.h
+typedef struct NusUsbLoad { // NOLINT
+  bool delta;
+  usize sent;
+  usize len;
+} NusUsbLoad;
+
+// An open connection to the cart.
+// Operations run on it do not pay for opening the device
+// and the connection handshake again
+typedef struct NusUsb { // NOLINT
+  NusTransport transport;
+  u8 cmd[NUS_USB_BUF_LEN];
+  u8 reply[NUS_USB_BUF_LEN];
+  // the rom load of the last operation
+  NusUsbLoad load;
+} NusUsb;
+
+// Transfer statistics of every connection this process opened
+NusStats *nus_usb_stats(void);
+
+// Reports the bytes a delta load saved. Prints nothing for other loads
+void nus_usb_load_fprint(FILE *file, const NusUsbLoad *load);
+
+// Connects with the transport in nuss_transport and waits until
+// the cart answers
+Error nus_usb_open(NusUsb *usb);
+Error nus_usb_close(NusUsb *usb);
+
+// Runs op on an open connection. addr 0 uses the default
+// rom or ram address. buffer is unused for NUS_USB_BOOT
+Error nus_usb_run(NusUsb *usb, NusUsbOp op, Buffer *buffer, u32 addr);
+
+// Runs a NUS_USB_DUMP or NUS_USB_RAM_RD of len bytes on an open connection
+// and writes it to file as it arrives, see nus_usb_dump_file
+Error nus_usb_run_file(NusUsb *usb, NusUsbOp op, FILE *file, usize len,
+                       u32 addr, NusUsbDigest *digest);
+
+// Rom loads only send the blocks that changed since the last load
+// into the same cart, see nusmanifest.h.
+// Every operation below opens and closes the device,
+// or is sent to the session daemon if nuss_session is set
 Error nus_usb_boot();
 Error nus_usb_load(Buffer *buffer, u32 addr);
 Error nus_usb_dump(Buffer *buffer, u32 addr);
 Error nus_usb_ram_wr(Buffer *buffer, u32 addr);
 Error nus_usb_ram_rd(Buffer *buffer, u32 addr);
+Error nus_usb_load_boot(Buffer *buffer, u32 addr);
+
+// Dumps and ram reads of len bytes that are written to file as they
+// arrive instead of into a buffer. A writer thread writes and hashes
+// each region while the next ones are read, only a few MB are held
+// at once. A session daemon streams the regions over its socket the same
+// way. digest may be NULL
+Error nus_usb_dump_file(FILE *file, usize len, u32 addr,
+                        NusUsbDigest *digest);
+Error nus_usb_ram_rd_file(FILE *file, usize len, u32 addr,
+                          NusUsbDigest *digest);
+
+#ifdef TEST
+
+void test_nus_usb_emu(void **state);
+
+#endif
 
 #endif
@@ -0,0 +1,38 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include "error.h"
+#include "types.h"
+
+/**
+ * A minimal worker pool.
+ * Jobs are identified by their index and picked up by
+ * the workers in order. Results are handed back to
+ * the calling thread in index order as soon as they are ready.
+ */
+
+typedef void (*PoolFn)(usize index, void *ctx);
+
+// Jobs may run at most this many times threads ahead of the last done
+#define POOL_WINDOW 2
+
+// The number of threads to use when none was requested
+usize pool_default_threads(void);
+
+// Runs job(i, ctx) for every i in [0, len) on up to threads worker threads.
+// done(i, ctx) is called on the calling thread in ascending order of i
+// once job i and all jobs before it have finished. done may be NULL.
+// Job i does not start before done has returned for i - threads * POOL_WINDOW
+// so results that are waiting for done stay bounded.
+// With threads <= 1 everything runs on the calling thread.
+Error pool_run(usize len, usize threads, PoolFn job, PoolFn done, void *ctx);
+
+#ifdef TEST
+
+#include "macros.h"
+
+void test_pool(void **state);
+
+#endif
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef RECIPE_H_
+#define RECIPE_H_
+
+#include "types.h"
+
+// recipes may include other recipes this deep
+#define RECIPE_DEPTH_MAX 16
+
+// Splits recipe text into an argv in place.
+// Tokens are separated by whitespace, "quoted tokens" may contain spaces
+// and everything after a # until the end of the line is ignored.
+// With argv NULL the tokens are only counted and text is not modified
+usize recipe_split(char *text, char **argv);
+
+#ifdef TEST
+
+#include "macros.h"
+
+void test_recipe_split(void **state);
+
+#endif
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include "buffer.h"
+#include "error.h"
+#include "nususb.h"
+#include "types.h"
+
+/**
+ * A daemon that keeps the cart connection open
+ * and runs usb operations for short-lived clients.
+ *
+ * Clients connect to a unix socket and send requests.
+ * Every request is a NusSessionRequest followed by the stored bytes
+ * of the buffer for operations that write to the cart.
+ * The daemon replies with a NusSessionReply, which also tells
+ * the client what a rom load sent.
+ * For operations that read from the cart its len is followed by the bytes
+ * as they arrive from the cart and a second NusSessionReply with the result
+ * of the read. The daemon hangs up if the read fails midway.
+ * Both sides run on the same machine so everything is in host byte order.
+ */
+
+#define NUS_SESSION_MAGIC 0x4E555353 // NUSS
+
+typedef struct NusSessionRequest { // NOLINT
+  u32 magic;
+  u32 op;
+  u32 addr;
+  u32 fill_val;
+  u64 len;
+  u64 fill_len;
+} NusSessionRequest;
+
+typedef struct NusSessionReply { // NOLINT
+  u32 err;
+  // set if the rom load only sent what changed.
+  // It sent sent of len bytes then
+  u32 delta;
+  u64 len;
+  u64 sent;
+} NusSessionReply;
+
+// Opens the device and serves requests on the socket at path
+// until the daemon is interrupted. The device is reopened
+// after an operation failed
+Error nus_session_serve(const char *path);
+
+// Runs op on the daemon listening at path
+Error nus_session_request(const char *path, NusUsbOp op, Buffer *buffer,
+                          u32 addr);
+
+// Takes the bytes of a streamed read piece by piece
+typedef Error (*NusSessionConsume)(void *ctx, const u8 *data, usize size);
+
+// Runs a NUS_USB_DUMP or NUS_USB_RAM_RD of len bytes on the daemon
+// listening at path and hands the bytes to consume as they arrive
+Error nus_session_request_stream(const char *path, NusUsbOp op, usize len,
+                                 u32 addr, NusSessionConsume consume,
+                                 void *ctx);
+
+#ifdef TEST
+
+void test_nus_session_path(void **state);
+void test_nus_session_stream(void **state);
+
+#endif
+
+#endif
@@ -25,10 +25,7 @@ Error bitmap_image_header_from_bytes(BitmapImageHeader *b, const u8 *data,
 }
 
 Error bitmap_to_1bpp(Buffer *buffer) {
-  Buffer src;
-  buffer_init(&src);
-  src.data = buffer->data;
-  src.len = buffer->len;
+  Buffer src = *buffer;
 
   buffer_init(buffer);
 
@@ -41,9 +38,12 @@ Error bitmap_to_1bpp(Buffer *buffer) {
   }
 
   const usize img_len = (usize)img_header.w * (usize)img_header.h;
-  buffer->len = ((usize)img_header.w / 8 + ((usize)img_header.w % 8 ? 1 : 0)) *
-                img_header.h;
-  buffer->data = malloc(buffer->len);
+  Error err = buffer_resize(
+      buffer, ((usize)img_header.w / 8 + ((usize)img_header.w % 8 ? 1 : 0)) *
+                  img_header.h);
+  if (err) {
+    return err;
+  }
 
   // length of a row of converted bmp1 data
   const usize buffer_row_len = MAX(1, buffer->len / img_header.h);
@@ -124,9 +124,8 @@ void test_bmp1_converter(void **state) {
       0x81, 0x42, 0x24, 0x18, 0x18, 0x24, 0x42, 0x81,
   };
   Buffer b;
-  b.len = 246;
-  b.data = malloc(b.len);
-  memcpy(b.data, input, b.len);
+  buffer_init(&b);
+  buffer_inject(&b, 0, input, 246);
 
   assert_int_equal(OK, bitmap_to_1bpp(&b));
   assert_memory_equal(expected, b.data, b.len);
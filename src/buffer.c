@@ -1,20 +1,101 @@
 #include "buffer.h"
 #include "error.h"
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "macros.h"
+#include "pool.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 void buffer_init(Buffer *buffer) {
   buffer->data = NULL;
   buffer->len = 0;
+  buffer->base = NULL;
+  buffer->cap = 0;
+  buffer->mapped = FALSE;
+  buffer->dirty = NULL;
+  buffer->dirty_len = 0;
+  buffer->version = 0;
+  buffer->fill_len = 0;
+  buffer->fill_val = 0;
+  buffer->src_fd = -1;
 }
 
+// returns the amount of bytes left between the current position
+// and the end of a regular file.
+// Pipes, ttys and other streams have no known length and report
+// ERR_READ so the caller can fall back to chunked reads
 Error file_len(FILE *file, usize *len) {
-  if (!fseek(file, 0, SEEK_END)) {
+  struct stat st;
+  if (fstat(fileno(file), &st) || !S_ISREG(st.st_mode)) {
     return ERR_READ;
   }
-  *len = ftell(file);
 
-  if (!fseek(file, 0, SEEK_SET)) {
+  long pos = ftell(file);
+  if (pos < 0 || pos > st.st_size) {
+    pos = 0;
+  }
+  *len = st.st_size - pos;
+
+  return OK;
+}
+
+// reads the stream into buffer->data starting with an allocation of cap bytes.
+// Data is read in large blocks and the allocation is doubled
+// whenever it fills up. Reading stops after max bytes.
+// If cap is the exact remaining length of the input
+// the whole input is read with a single allocation.
+Error buffer_read_chunked_(Buffer *buffer, FILE *file, usize cap, usize max) {
+  usize total_read = 0;
+  cap = MIN(cap, max);
+
+  buffer_init(buffer);
+  buffer->base = malloc(BUFFER_FRONT_SLACK + cap);
+  if (buffer->base == NULL) {
+    return ERR_READ;
+  }
+  buffer->data = buffer->base + BUFFER_FRONT_SLACK;
+
+  while (TRUE) {
+    if (total_read == cap) {
+      // the buffer is full. probe for one more byte before growing
+      // so that exact-size reads of regular files never reallocate
+      int c = total_read < max ? fgetc(file) : EOF;
+      if (c == EOF) {
+        break;
+      }
+
+      usize new_cap = MAX(cap * 2, BUFFER_READ_CHUNK);
+      new_cap = MIN(new_cap, max);
+      u8 *new_base = realloc(buffer->base, BUFFER_FRONT_SLACK + new_cap);
+      if (new_base == NULL) {
+        buffer->len = total_read;
+        buffer->cap = BUFFER_FRONT_SLACK + cap;
+        return ERR_READ;
+      }
+      buffer->base = new_base;
+      buffer->data = new_base + BUFFER_FRONT_SLACK;
+      cap = new_cap;
+      buffer->data[total_read++] = (u8)c;
+    }
+
+    usize read = fread(buffer->data + total_read, 1, cap - total_read, file);
+    total_read += read;
+    if (read == 0) {
+      break;
+    }
+  }
+
+  buffer->len = total_read;
+  buffer->cap = BUFFER_FRONT_SLACK + cap;
+
+  if (ferror(file)) {
     return ERR_READ;
   }
 
@@ -22,49 +103,288 @@ Error file_len(FILE *file, usize *len) {
 }
 
 Error buffer_read(Buffer *buffer, FILE *file) {
-  usize flen = 524288; // start at 0.5mb
-  usize total_read = 0;
+  return buffer_read_max(buffer, file, (usize)-1);
+}
+
+Error buffer_read_max(Buffer *buffer, FILE *file, const usize max) {
+  usize flen = 0;
 
-  buffer->data = malloc(flen + 1);
+  // regular files are read with one exact-size allocation,
+  // everything else starts with a single chunk and grows from there
+  if (file_len(file, &flen)) {
+    flen = BUFFER_READ_CHUNK;
+  }
+
+  return buffer_read_chunked_(buffer, file, flen, max);
+}
+
+Error buffer_map(Buffer *buffer, FILE *file) {
+  usize flen = 0;
+  if (file_len(file, &flen) || flen == 0 || ftell(file) != 0) {
+    return ERR_READ;
+  }
+
+  // MAP_PRIVATE gives every write its own private page,
+  // the file itself is never modified
+  void *data = mmap(NULL, flen, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fileno(file), 0);
+  if (data == MAP_FAILED) {
+    return ERR_READ;
+  }
+
+  buffer->data = data;
   buffer->len = flen;
+  buffer->base = data;
+  buffer->cap = flen;
+  buffer->mapped = TRUE;
 
-  char buf = '\0';
-  // read 1 byte until no more bytes are left to read
-  // TODO this is likely slow, but ok for now
-  while (fread(&buf, 1, 1, file) > 0) {
-    // the resize call will not have any effect
-    // unless the requested size is larger than the new size!
-    if (total_read >= buffer->len) {
-      buffer_resize(buffer, buffer->len * 2);
+  // keep the file around so unmodified ranges can be copied from it.
+  // The caller may close its stream as soon as this returns
+  buffer->src_fd = fcntl(fileno(file), F_DUPFD_CLOEXEC, 0);
+
+  return OK;
+}
+
+// writes len bytes of val.
+// Zeroes past the end of a regular file are skipped by extending it,
+// which leaves a hole the file system reads back as zeroes
+static Error buffer_write_fill_(FILE *file, usize len, const u8 val) {
+  if (len == 0) {
+    return OK;
+  }
+
+  struct stat st;
+  if (val == 0 && !fflush(file) && !fstat(fileno(file), &st) &&
+      S_ISREG(st.st_mode)) {
+    off_t pos = ftello(file);
+    if (pos >= 0 && pos >= st.st_size &&
+        !ftruncate(fileno(file), pos + (off_t)len) &&
+        !fseeko(file, pos + (off_t)len, SEEK_SET)) {
+      return OK;
     }
+  }
 
-    // write to next byte
-    buffer->data[total_read++] = buf;
+  // pipes and existing data get the fill in large blocks
+  u8 block[0x10000];
+  memset(block, val, MIN(len, sizeof(block)));
+  while (len) {
+    usize n = MIN(len, sizeof(block));
+    if (!fwrite(block, n, 1, file)) {
+      return ERR_WRITE;
+    }
+    len -= n;
   }
+  return OK;
+}
 
-  // make sure we have the correct length in the end
-  // any additional data does not matter and can be ignored
-  // TODO maybe keep track of alloc lenght at some point
-  buffer->len = total_read;
+static Error buffer_write_fd_(int fd, const u8 *data, usize len) {
+  while (len) {
+    ssize_t n = write(fd, data, len);
+    if (n <= 0) {
+      return ERR_WRITE;
+    }
+    data += n;
+    len -= n;
+  }
+  return OK;
+}
+
+// copies len bytes at off of the source file to fd without
+// passing them through user memory. copy_file_range handles file to file
+// copies, sendfile splices into pipes and everything else.
+// Falls back to pread and write when neither is supported
+static Error buffer_copy_src_(int src_fd, off_t off, int fd, usize len) {
+  bool copy_range = TRUE;
+  bool send = TRUE;
+  while (len) {
+    ssize_t n = -1;
+    if (copy_range) {
+      n = copy_file_range(src_fd, &off, fd, NULL, len, 0);
+      copy_range = n > 0;
+    }
+    if (n <= 0 && send) {
+      n = sendfile(fd, src_fd, &off, len);
+      send = n > 0;
+    }
+    if (n <= 0) {
+      u8 block[0x10000];
+      n = pread(src_fd, block, MIN(len, sizeof(block)), off);
+      if (n <= 0 || buffer_write_fd_(fd, block, n)) {
+        return ERR_WRITE;
+      }
+      off += n;
+    }
+    len -= n;
+  }
+  return OK;
+}
 
+// writes the stored data of a buffer that has a source file.
+// Ranges that were not modified still match the source
+// and are copied from it, dirty ranges are written from memory
+static Error buffer_write_src_(const Buffer *buffer, int fd) {
+  usize pos = 0;
+  for (usize i = 0; i <= buffer->dirty_len && pos < buffer->len; i++) {
+    usize start = buffer->len;
+    usize end = buffer->len;
+    if (i < buffer->dirty_len) {
+      start = buffer->dirty[i].start < end ? buffer->dirty[i].start : end;
+      end = buffer->dirty[i].end < end ? buffer->dirty[i].end : end;
+    }
+
+    if (start > pos && buffer_copy_src_(buffer->src_fd, (off_t)pos, fd,
+                                        start - pos)) {
+      return ERR_WRITE;
+    }
+    if (end > start &&
+        buffer_write_fd_(fd, buffer->data + start, end - start)) {
+      return ERR_WRITE;
+    }
+    pos = end;
+  }
   return OK;
 }
 
 Error buffer_write(const Buffer *buffer, FILE *file) {
-  if (!fwrite(buffer->data, buffer->len, 1, file)) {
+  int fd = fileno(file);
+  if (buffer->src_fd >= 0 && fd >= 0 && !fflush(file)) {
+    Error err = buffer_write_src_(buffer, fd);
+
+    // the stream did not see the writes to its descriptor
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos >= 0) {
+      fseeko(file, pos, SEEK_SET);
+    }
+    if (err) {
+      return err;
+    }
+  } else if (buffer->len && !fwrite(buffer->data, buffer->len, 1, file)) {
     return ERR_WRITE;
   }
-  return OK;
+  return buffer_write_fill_(file, buffer->fill_len, buffer->fill_val);
+}
+
+// "0x%x, " for every byte value, padded to 8 bytes
+// so every element can be copied with a fixed size
+static char array_table_[256][8];
+static u8 array_table_len_[256];
+
+static void buffer_array_table_init_(void) {
+  if (array_table_len_[0]) {
+    return;
+  }
+  for (usize i = 0; i < 256; i++) {
+    array_table_len_[i] =
+        (u8)snprintf(array_table_[i], sizeof(array_table_[i]), "0x%x, ",
+                     (unsigned)i);
+  }
+}
+
+// formats the elements [start, end) of an array beginning at first into out.
+// out needs room for BUFFER_ARRAY_ELEMENT_MAX bytes per element
+static usize buffer_format_array_(const Buffer *buffer,
+                                  const BufferArrayFmt *fmt, usize first,
+                                  usize start, usize end, char *out) {
+  char *o = out;
+  usize col = fmt->per_line ? (start - first) % fmt->per_line : 0;
+  for (usize i = start; i < end; i++) {
+    u8 b = i < buffer->len ? buffer->data[i] : buffer->fill_val;
+    memcpy(o, array_table_[b], sizeof(array_table_[b]));
+    o += array_table_len_[b];
+
+    if (fmt->per_line && ++col == fmt->per_line) {
+      *o++ = '\n';
+      col = 0;
+    }
+  }
+  return o - out;
+}
+
+struct BufferArrayJob {
+  const Buffer *buffer;
+  const BufferArrayFmt *fmt;
+  usize start;
+  usize end;
+  char **chunks;
+  usize *chunk_lens;
+  FILE *file;
+  Error err;
+};
+
+static void buffer_array_job_(usize index, void *ctx) {
+  struct BufferArrayJob *job = ctx;
+  usize start = job->start + index * BUFFER_ARRAY_CHUNK;
+  usize end = MIN(start + BUFFER_ARRAY_CHUNK, job->end);
+
+  // the table is a little larger than an element so the
+  // fixed size copy of the last one stays in bounds
+  job->chunks[index] =
+      malloc((end - start) * BUFFER_ARRAY_ELEMENT_MAX + sizeof(array_table_[0]));
+  if (job->chunks[index]) {
+    job->chunk_lens[index] = buffer_format_array_(
+        job->buffer, job->fmt, job->start, start, end, job->chunks[index]);
+  }
+}
+
+static void buffer_array_done_(usize index, void *ctx) {
+  struct BufferArrayJob *job = ctx;
+  if (job->chunks[index] == NULL ||
+      (!job->err && job->chunk_lens[index] &&
+       !fwrite(job->chunks[index], job->chunk_lens[index], 1, job->file))) {
+    job->err = ERR_WRITE;
+  }
+  free(job->chunks[index]);
+  job->chunks[index] = NULL;
+}
+
+Error buffer_write_array(const Buffer *buffer, FILE *file, const char *name,
+                         const char *type, const BufferArrayFmt *fmt) {
+  return buffer_write_array_range(buffer, file, name, type, fmt, 0,
+                                  buffer_len(buffer));
 }
 
-Error buffer_write_array(const Buffer *buffer, FILE *file, char *name,
-                         char *type) {
+Error buffer_write_array_range(const Buffer *buffer, FILE *file,
+                               const char *name, const char *type,
+                               const BufferArrayFmt *fmt, const usize start,
+                               const usize end) {
+  BufferArrayFmt defaults = {0, 1};
+  if (fmt == NULL) {
+    fmt = &defaults;
+  }
+  buffer_array_table_init_();
+
+  struct BufferArrayJob job;
+  job.buffer = buffer;
+  job.fmt = fmt;
+  job.start = start;
+  job.end = end;
+  job.file = file;
+  job.err = OK;
+
+  // every chunk is formatted on its own
+  // and written in order once it and all chunks before it are done
+  usize chunks = (end - start + BUFFER_ARRAY_CHUNK - 1) / BUFFER_ARRAY_CHUNK;
+  job.chunks = calloc(chunks ? chunks : 1, sizeof(char *));
+  job.chunk_lens = calloc(chunks ? chunks : 1, sizeof(usize));
+  if (job.chunks == NULL || job.chunk_lens == NULL) {
+    free(job.chunks);
+    free(job.chunk_lens);
+    return ERR_WRITE;
+  }
+
   fprintf(file, "%s %s[] = {\n", type, name);
-  for (usize i = 0; i < buffer->len; i++) { // NOLINT
-    fprintf(file, "0x%x, ", buffer->data[i]);
+  usize threads = fmt->threads ? fmt->threads : pool_default_threads();
+  Error err = pool_run(chunks, threads, buffer_array_job_, buffer_array_done_,
+                       &job);
+  fprintf(file, "\n};\n#define %s_LEN %ld\n", name, end - start);
+
+  free(job.chunks);
+  free(job.chunk_lens);
+
+  if (err) {
+    return err;
   }
-  fprintf(file, "\n};\n#define %s_LEN %ld\n", name, buffer->len);
-  return OK;
+  return job.err;
 }
 
 Error buffer_write_text_array(const Buffer *buffer, FILE *file, char *name,
@@ -75,78 +395,1083 @@ Error buffer_write_text_array(const Buffer *buffer, FILE *file, char *name,
   return OK;
 }
 
-void buffer_pad_to(Buffer *buffer, const usize len, const u8 val) {
-  // if we already have the desired size dont do anything
-  if (len <= buffer->len) {
+// digit values of hex characters, 0xFF for everything else
+static u8 hex_table_[256];
+
+static void buffer_hex_table_init_(void) {
+  if (hex_table_['0'] == 0 && hex_table_['1'] == 1) {
     return;
   }
+  memset(hex_table_, 0xFF, sizeof(hex_table_));
+  for (u8 i = 0; i < 10; i++) {
+    hex_table_['0' + i] = i;
+  }
+  for (u8 i = 0; i < 6; i++) {
+    hex_table_['a' + i] = 10 + i;
+    hex_table_['A' + i] = 10 + i;
+  }
+}
+
+static bool is_separator_(u8 c) {
+  return c == ',' || c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+// skips separators. Runs of indentation and line breaks
+// are skipped 16 bytes at a time
+static const u8 *buffer_skip_separators_(const u8 *c, const u8 *end) {
+#ifdef __SSE2__
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i cr = _mm_set1_epi8('\r');
+  while (end - c >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)c);
+    __m128i sep = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, space)),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, tab)),
+                     _mm_cmpeq_epi8(v, cr)));
+    u32 mask = (u32)_mm_movemask_epi8(sep);
+    if (mask != 0xFFFF) {
+      return c + __builtin_ctz(~mask);
+    }
+    c += 16;
+  }
+#endif
+  while (c < end && is_separator_(*c)) {
+    c++;
+  }
+  return c;
+}
+
+// skips a /* */ or // comment starting at c
+static const u8 *buffer_skip_comment_(const u8 *c, const u8 *end) {
+  if (end - c < 2 || (c[1] != '*' && c[1] != '/')) {
+    return NULL;
+  }
+  if (c[1] == '/') {
+    const u8 *nl = memchr(c, '\n', end - c);
+    return nl ? nl : end;
+  }
+  for (c += 2; end - c >= 2; c++) {
+    if (c[0] == '*' && c[1] == '/') {
+      return c + 2;
+    }
+  }
+  return NULL;
+}
+
+Error buffer_parse_array(Buffer *buffer) {
+  buffer_materialize(buffer, (usize)-1);
+  buffer_hex_table_init_();
+  if (buffer->len == 0) {
+    return OK;
+  }
+
+  const u8 *c = buffer->data;
+  const u8 *end = buffer->data + buffer->len;
+
+  // a full declaration only has its initializer parsed
+  const u8 *open = memchr(c, '{', end - c);
+  if (open) {
+    c = open + 1;
+    end = memchr(c, '}', end - c);
+    if (end == NULL) {
+      return ERR_PARSE;
+    }
+  }
+
+  // every element is at least one character long
+  // so the bytes are written over the text that was already parsed
+  u8 *out = buffer->data;
+  while (TRUE) {
+    c = buffer_skip_separators_(c, end);
+    if (c == end) {
+      break;
+    }
+    if (*c == '/') {
+      if ((c = buffer_skip_comment_(c, end)) == NULL) {
+        return ERR_PARSE;
+      }
+      continue;
+    }
+
+    u32 val = 0;
+    const u8 *start = c;
+    if (c[0] == '0' && end - c > 2 && (c[1] | 0x20) == 'x') {
+      start = c += 2;
+      while (c < end && hex_table_[*c] < 16 && val <= 0xFF) {
+        val = val * 16 + hex_table_[*c++];
+      }
+    } else if (c[0] == '0') {
+      while (c < end && *c >= '0' && *c <= '7' && val <= 0xFF) {
+        val = val * 8 + (*c++ - '0');
+      }
+    } else {
+      while (c < end && *c >= '0' && *c <= '9' && val <= 0xFF) {
+        val = val * 10 + (*c++ - '0');
+      }
+    }
+
+    // integer suffixes are allowed
+    while (c < end && (*c == 'u' || *c == 'U' || *c == 'l' || *c == 'L')) {
+      c++;
+    }
+
+    if (c == start || val > 0xFF ||
+        (c < end && !is_separator_(*c) && *c != '/')) {
+      return ERR_PARSE;
+    }
+    *out++ = (u8)val;
+  }
 
-  usize old_len = buffer->len;
-  buffer_resize(buffer, len);
+  buffer->len = out - buffer->data;
+  buffer_mark_dirty(buffer, 0, buffer->len);
+  return OK;
+}
+
+Error buffer_pad_to(Buffer *buffer, const usize len, const u8 val) {
+  // if we already have the desired size dont do anything
+  usize old_len = buffer_len(buffer);
+  if (len <= old_len) {
+    return OK;
+  }
 
-  // memset the rest of the buffer to the desired value
-  memset(buffer->data + old_len, (int)(buffer->len - old_len), val);
+  return buffer_pad_by(buffer, len - old_len, val);
 }
 
-void buffer_pad_by(Buffer *buffer, const usize len, const u8 val) {
-  usize old_len = buffer->len;
-  buffer_resize(buffer, buffer->len + len);
+Error buffer_pad_by(Buffer *buffer, const usize len, const u8 val) {
+  if (len == 0) {
+    return OK;
+  }
+
+  // long paddings and anything extending the current fill
+  // are only recorded, the bytes are never stored
+  bool same_fill = buffer->fill_len && buffer->fill_val == val;
+  if (same_fill || len >= BUFFER_SPARSE_MIN) {
+    if (!same_fill) {
+      buffer_materialize(buffer, (usize)-1);
+    }
+    buffer_mark_dirty(buffer, buffer_len(buffer), len);
+    buffer->fill_len += len;
+    buffer->fill_val = val;
+    return OK;
+  }
+
+  usize old_len = buffer_len(buffer);
+  Error err = buffer_resize(buffer, old_len + len);
+  if (err) {
+    return err;
+  }
 
   // memset the rest of the buffer to the destired value
-  memset(buffer->data + old_len, (int)len, val);
+  // resize already zeroed it
+  if (val) {
+    memset(buffer->data + old_len, val, len);
+  }
+  return OK;
+}
+
+void buffer_trim(Buffer *buffer, const usize len) {
+  if (len < buffer->len) {
+    buffer->len = len;
+    buffer->fill_len = 0;
+  } else if (len < buffer_len(buffer)) {
+    buffer->fill_len = len - buffer->len;
+  }
 }
 
-void buffer_inject(Buffer *buffer, const usize loc, const u8 *data,
-                   const usize len) {
-  if (loc + len > buffer->len) {
-    buffer_resize(buffer, loc + len);
+Error buffer_inject(Buffer *buffer, const usize loc, const u8 *data,
+                    const usize len) {
+  Error err = buffer_resize(buffer, loc + len);
+  if (err) {
+    return err;
   }
 
-  // copy to destination
-  memcpy(buffer->data + loc, data, len);
+  // copy to destination. data may point into the buffer itself
+  memmove(buffer->data + loc, data, len);
+  buffer_mark_dirty(buffer, loc, len);
+  return OK;
 }
 
-void buffer_set(Buffer *buffer, const usize loc, const u8 val, const u8 len) {
-  if (loc + len > buffer->len) {
-    buffer_resize(buffer, loc + len);
+Error buffer_set(Buffer *buffer, const usize loc, const u8 val,
+                 const u8 len) {
+  Error err = buffer_resize(buffer, loc + len);
+  if (err) {
+    return err;
   }
 
   // copy to destination
   memset(buffer->data + loc, val, len);
+  buffer_mark_dirty(buffer, loc, len);
+  return OK;
 }
 
 Error buffer_inject_file(Buffer *buffer, const usize loc, FILE *file) {
   usize flen = 0;
-  file_len(file, &flen);
+  if (file_len(file, &flen)) {
+    // not a regular file, read it into a temporary buffer first
+    Buffer tmp;
+    buffer_init(&tmp);
+    Error err = buffer_read(&tmp, file);
+    if (!err) {
+      err = buffer_inject(buffer, loc, tmp.data, tmp.len);
+    }
+    buffer_free(&tmp);
+    return err;
+  }
+
+  if (flen == 0) {
+    return OK;
+  }
 
-  if (loc + flen > buffer->len) {
-    buffer_resize(buffer, loc + flen);
+  Error err = buffer_resize(buffer, loc + flen);
+  if (err) {
+    return err;
   }
 
   // we can read the file straight into the resized buffer!
+  buffer_mark_dirty(buffer, loc, flen);
   if (!fread(buffer->data + loc, flen, 1, file)) {
     return ERR_READ;
   }
   return OK;
 }
 
-void buffer_resize(Buffer *buffer, const usize new_len) {
-  if (new_len < buffer->len) {
-    return;
+// frees the storage of the buffer, its length and dirty ranges stay
+static void buffer_release_(Buffer *buffer) {
+  if (buffer->base != NULL) {
+    if (buffer->mapped) {
+      munmap(buffer->base, buffer->cap);
+    } else {
+      free(buffer->base);
+    }
+  }
+  buffer->base = NULL;
+  buffer->data = NULL;
+  buffer->cap = 0;
+  buffer->mapped = FALSE;
+}
+
+// makes sure there are at least front bytes of slack before data
+// and room for len bytes starting at data.
+// Growth at the back is amortized with realloc,
+// growth at the front or out of a mapping needs a new allocation
+static Error buffer_reserve_(Buffer *buffer, const usize front,
+                             const usize len) {
+  usize cur_front = buffer->data ? (usize)(buffer->data - buffer->base) : 0;
+  if (cur_front >= front && cur_front + len <= buffer->cap) {
+    return OK;
+  }
+
+  // realloc keeps the slack that is already in front of data
+  if (!buffer->mapped && cur_front >= front) {
+    usize new_cap = MAX(buffer->cap * 2, cur_front + len);
+    u8 *new_base = realloc(buffer->base, new_cap);
+    if (new_base == NULL) {
+      return ERR_ALLOC;
+    }
+    buffer->base = new_base;
+    buffer->data = new_base + cur_front;
+    buffer->cap = new_cap;
+    return OK;
+  }
+
+  usize new_cap = MAX(buffer->cap * 2, front + len);
+  u8 *new_base = malloc(new_cap);
+  if (new_base == NULL) {
+    return ERR_ALLOC;
+  }
+  if (buffer->len) {
+    memcpy(new_base + front, buffer->data, buffer->len);
   }
 
-  u8 *new_buffer = malloc(new_len);
-  memcpy(new_buffer, buffer->data, MIN(buffer->len, new_len));
+  buffer_release_(buffer);
+
+  buffer->base = new_base;
+  buffer->data = new_base + front;
+  buffer->cap = new_cap;
+  buffer->mapped = FALSE;
+  return OK;
+}
+
+Error buffer_prepend(Buffer *buffer, const usize len, const u8 val) {
+  usize cur_front = buffer->data ? (usize)(buffer->data - buffer->base) : 0;
+
+  if (!buffer->mapped && cur_front >= len) {
+    // enough slack, just move the start of the buffer
+    buffer->data -= len;
+  } else if (!buffer->mapped &&
+             buffer->cap - cur_front >= buffer->len + len) {
+    // enough room at the back, shift the data inside the allocation
+    memmove(buffer->data + len, buffer->data, buffer->len);
+  } else {
+    Error err = buffer_reserve_(buffer, len, buffer->len);
+    if (err) {
+      return err;
+    }
+    buffer->data -= len;
+  }
+
+  buffer->len += len;
+  memset(buffer->data, val, len);
+
+  // every byte moved
+  buffer_mark_dirty(buffer, 0, buffer_len(buffer));
+  return OK;
+}
+
+usize buffer_len(const Buffer *buffer) {
+  return buffer->len + buffer->fill_len;
+}
+
+void buffer_materialize(Buffer *buffer, const usize end) {
+  usize len = buffer_len(buffer);
+  buffer_resize(buffer, end < len ? end : len);
+}
 
-  free(buffer->data);
+Error buffer_resize(Buffer *buffer, const usize new_len) {
+  if (new_len <= buffer->len) {
+    return OK;
+  }
+
+  Error err = buffer_reserve_(buffer, 0, new_len);
+  if (err) {
+    return err;
+  }
 
+  // the fill is stored as far as it reaches, the rest is new
+  usize fill_end = buffer_len(buffer);
+  usize filled = new_len < fill_end ? new_len : fill_end;
+  memset(buffer->data + buffer->len, buffer->fill_val, filled - buffer->len);
+  if (new_len > filled) {
+    memset(buffer->data + filled, 0, new_len - filled);
+    buffer_mark_dirty(buffer, filled, new_len - filled);
+  }
+  buffer->fill_len = fill_end - filled;
   buffer->len = new_len;
-  buffer->data = new_buffer;
+  return OK;
+}
+
+void buffer_mark_dirty(Buffer *buffer, const usize loc, const usize len) {
+  if (len == 0) {
+    return;
+  }
+
+  if (buffer->dirty == NULL) {
+    buffer->dirty = malloc(BUFFER_DIRTY_MAX * sizeof(BufferRange));
+    if (buffer->dirty == NULL) {
+      return;
+    }
+  }
+
+  buffer->version++;
+  BufferRange range = {loc, loc + len, buffer->version};
+
+  // the new range replaces whatever it overlaps.
+  // parts of older ranges outside of it keep their version
+  // so consumers still see when those were written
+  BufferRange ranges[BUFFER_DIRTY_MAX + 2];
+  usize count = 0;
+  bool inserted = FALSE;
+  for (usize i = 0; i < buffer->dirty_len; i++) {
+    BufferRange r = buffer->dirty[i];
+    if (r.end <= range.start) {
+      ranges[count++] = r;
+      continue;
+    }
+
+    if (r.start < range.start) {
+      ranges[count++] = (BufferRange){r.start, range.start, r.version};
+    }
+    if (!inserted) {
+      ranges[count++] = range;
+      inserted = TRUE;
+    }
+    if (r.end > range.end) {
+      ranges[count++] =
+          (BufferRange){MAX(r.start, range.end), r.end, r.version};
+    }
+  }
+  if (!inserted) {
+    ranges[count++] = range;
+  }
+
+  if (count > BUFFER_DIRTY_MAX) {
+    // too many scattered writes, keep one range covering all of them
+    ranges[0] = (BufferRange){ranges[0].start, ranges[count - 1].end,
+                              buffer->version};
+    count = 1;
+  }
+
+  memcpy(buffer->dirty, ranges, count * sizeof(BufferRange));
+  buffer->dirty_len = count;
+}
+
+bool buffer_dirty_since(const Buffer *buffer, const u64 version,
+                        const usize from, usize *start) {
+  for (usize i = 0; i < buffer->dirty_len; i++) {
+    const BufferRange *r = &buffer->dirty[i];
+    if (r->version > version && r->end > from) {
+      *start = MAX(r->start, from);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+void buffer_dirty_clear(Buffer *buffer) { buffer->dirty_len = 0; }
+
+static Error buffer_pwrite_(int fd, const u8 *data, usize len, off_t off) {
+  while (len) {
+    ssize_t n = pwrite(fd, data, len, off);
+    if (n <= 0) {
+      return ERR_WRITE;
+    }
+    data += n;
+    len -= n;
+    off += n;
+  }
+  return OK;
+}
+
+Error buffer_sync(Buffer *buffer, usize *written) {
+  struct stat st;
+  if (buffer->src_fd < 0 || fstat(buffer->src_fd, &st)) {
+    return ERR_WRITE;
+  }
+
+  usize total = buffer_len(buffer);
+  u8 block[0x10000];
+  memset(block, buffer->fill_val, sizeof(block));
+  *written = 0;
+
+  for (usize i = 0; i < buffer->dirty_len; i++) {
+    usize start = buffer->dirty[i].start;
+    usize end = buffer->dirty[i].end < total ? buffer->dirty[i].end : total;
+
+    // stored bytes
+    usize stored = end < buffer->len ? end : buffer->len;
+    if (start < stored) {
+      if (buffer_pwrite_(buffer->src_fd, buffer->data + start, stored - start,
+                         (off_t)start)) {
+        return ERR_WRITE;
+      }
+      *written += stored - start;
+      start = stored;
+    }
+
+    // zero fill past the end of the file is left to the final truncate
+    if (buffer->fill_val == 0 && start >= (usize)st.st_size) {
+      continue;
+    }
+    for (; start < end; start += sizeof(block)) {
+      usize n = MIN(end - start, sizeof(block));
+      if (buffer_pwrite_(buffer->src_fd, block, n, (off_t)start)) {
+        return ERR_WRITE;
+      }
+      *written += n;
+    }
+  }
+
+  if ((usize)st.st_size != total && ftruncate(buffer->src_fd, (off_t)total)) {
+    return ERR_WRITE;
+  }
+
+  // the file matches the buffer again
+  buffer_dirty_clear(buffer);
+  return OK;
 }
 
 void buffer_free(Buffer *buffer) {
-  if (buffer->data != NULL) {
-    free(buffer->data);
-    buffer->data = NULL;
+  buffer_release_(buffer);
+  if (buffer->src_fd >= 0) {
+    close(buffer->src_fd);
+  }
+  free(buffer->dirty);
+  buffer_init(buffer);
+}
+
+#ifdef TEST
+
+#include "nusstats.h"
+
+// the original byte-at-a-time read loop.
+// kept as a reference for test_buffer_read and buffer_bench_read
+static void buffer_read_bytewise_(Buffer *buffer, FILE *file) {
+  usize cap = 524288;
+  usize total_read = 0;
+  buffer_init(buffer);
+  buffer->data = malloc(cap);
+
+  char buf = '\0';
+  while (fread(&buf, 1, 1, file) > 0) {
+    if (total_read >= cap) {
+      u8 *new_data = malloc(cap * 2);
+      memcpy(new_data, buffer->data, cap);
+      free(buffer->data);
+      buffer->data = new_data;
+      cap *= 2;
+    }
+    buffer->data[total_read++] = buf;
+  }
+  buffer->len = total_read;
+  buffer->base = buffer->data;
+  buffer->cap = cap;
+}
+
+int buffer_bench_read(FILE *in, FILE *out, bool bytewise) {
+  struct stat st;
+  const char *kind = "stream";
+  if (fstat(fileno(in), &st) == 0) {
+    kind = S_ISFIFO(st.st_mode) ? "pipe" : S_ISREG(st.st_mode) ? "file" : kind;
+  }
+
+  Buffer buffer;
+  buffer_init(&buffer);
+  f64 start = nus_stats_now();
+  Error err = OK;
+  if (bytewise) {
+    buffer_read_bytewise_(&buffer, in);
+  } else {
+    err = buffer_read(&buffer, in);
+  }
+  f64 elapsed = nus_stats_now() - start;
+
+  fprintf(out, "%-14s %-6s %10li bytes %8.3fs %10.1f MiB/s\n",
+          bytewise ? "bytewise" : "buffer_read", kind, buffer.len, elapsed,
+          (f64)buffer.len / (1024.0 * 1024.0) /
+              (elapsed > 0 ? elapsed : 0.000001));
+  buffer_free(&buffer);
+  return err;
+}
+
+void test_buffer_read(void **state) {
+  const usize len = 0x800000 + 3; // NOLINT
+  FILE *f = tmpfile();
+  assert_non_null(f);
+  for (usize i = 0; i < len; i++) {
+    fputc((int)(i * 7), f);
   }
+
+  Buffer fast;
+  Buffer slow;
+  buffer_init(&fast);
+  buffer_init(&slow);
+
+  rewind(f);
+  assert_int_equal(OK, buffer_read(&fast, f));
+
+  rewind(f);
+  buffer_read_bytewise_(&slow, f);
+
+  assert_int_equal(len, fast.len);
+  assert_int_equal(slow.len, fast.len);
+  assert_memory_equal(slow.data, fast.data, len);
+
+  buffer_free(&fast);
+
+  // the chunked path used for pipes has to produce the same result
+  // even when starting from a tiny allocation
+  rewind(f);
+  assert_int_equal(OK, buffer_read_chunked_(&fast, f, 1, (usize)-1));
+  assert_int_equal(len, fast.len);
+  assert_memory_equal(slow.data, fast.data, len);
+  buffer_free(&fast);
+
+  // only the requested prefix is read
+  rewind(f);
+  assert_int_equal(OK, buffer_read_max(&fast, f, 0x1000));
+  assert_int_equal(0x1000, fast.len);
+  assert_memory_equal(slow.data, fast.data, 0x1000);
+  assert_int_equal(0x1000, ftell(f));
+  buffer_free(&fast);
+
+  rewind(f);
+  assert_int_equal(OK, buffer_read_chunked_(&fast, f, 1, 0x123456));
+  assert_int_equal(0x123456, fast.len);
+  assert_memory_equal(slow.data, fast.data, 0x123456);
+
+  buffer_free(&fast);
+  buffer_free(&slow);
+  fclose(f);
 }
+
+void test_buffer_map(void **state) {
+  const usize len = 0x2000;
+  FILE *f = tmpfile();
+  assert_non_null(f);
+  for (usize i = 0; i < len; i++) {
+    fputc((int)i, f);
+  }
+  fflush(f);
+  rewind(f);
+
+  Buffer b;
+  buffer_init(&b);
+  assert_int_equal(OK, buffer_map(&b, f));
+  assert_true(b.mapped);
+  assert_int_equal(len, b.len);
+  assert_int_equal(0x12, b.data[0x12]);
+
+  // writes stay private to the buffer
+  buffer_set(&b, 0, 0xAA, 4);
+  assert_int_equal(0xAA, b.data[0]);
+  rewind(f);
+  assert_int_equal(0, fgetc(f));
+
+  // growing past the file promotes the mapping to the heap
+  buffer_pad_by(&b, 0x10, 0);
+  assert_false(b.mapped);
+  assert_int_equal(len + 0x10, b.len);
+  assert_int_equal(0xAA, b.data[3]);
+  assert_int_equal(0x34, b.data[0x1234]);
+
+  buffer_free(&b);
+  fclose(f);
+}
+
+// writes the buffer to a temporary file and reads it back
+static void buffer_roundtrip_(const Buffer *b, Buffer *out) {
+  FILE *f = tmpfile();
+  assert_non_null(f);
+  assert_int_equal(OK, buffer_write(b, f));
+  assert_int_equal(buffer_len(b), ftell(f));
+  rewind(f);
+  assert_int_equal(OK, buffer_read(out, f));
+  fclose(f);
+}
+
+void test_buffer_write_src(void **state) {
+  const usize len = 0x3000;
+  FILE *f = tmpfile();
+  assert_non_null(f);
+  for (usize i = 0; i < len; i++) {
+    fputc((int)(i * 3), f);
+  }
+  fflush(f);
+  rewind(f);
+
+  Buffer b;
+  Buffer out;
+  buffer_init(&b);
+  assert_int_equal(OK, buffer_map(&b, f));
+  fclose(f);
+  assert_true(b.src_fd >= 0);
+
+  // untouched input is copied from the source file
+  buffer_roundtrip_(&b, &out);
+  assert_int_equal(len, out.len);
+  assert_memory_equal(b.data, out.data, len);
+  buffer_free(&out);
+
+  // modified ranges come from memory
+  buffer_set(&b, 0x10, 0xAA, 8);
+  buffer_inject(&b, 0x2FFE, (const u8 *)"abcd", 4);
+  buffer_pad_by(&b, BUFFER_SPARSE_MIN, 0xEE);
+  buffer_roundtrip_(&b, &out);
+  assert_int_equal(buffer_len(&b), out.len);
+  assert_memory_equal(b.data, out.data, b.len);
+  assert_int_equal(0xEE, out.data[out.len - 1]);
+  buffer_free(&out);
+
+  // pipes get the same bytes
+  int fds[2];
+  assert_int_equal(0, pipe(fds));
+  FILE *w = fdopen(fds[1], "w");
+  FILE *r = fdopen(fds[0], "r");
+  buffer_trim(&b, 0x3002);
+  assert_int_equal(OK, buffer_write(&b, w));
+  fclose(w);
+  assert_int_equal(OK, buffer_read(&out, r));
+  fclose(r);
+  assert_int_equal(0x3002, out.len);
+  assert_memory_equal(b.data, out.data, 0x3002);
+  buffer_free(&out);
+
+  // a promoted copy still knows which bytes match the source
+  buffer_prepend(&b, 0x40, 0);
+  buffer_roundtrip_(&b, &out);
+  assert_memory_equal(b.data, out.data, b.len);
+  buffer_free(&out);
+
+  buffer_free(&b);
+}
+
+void test_buffer_sync(void **state) {
+  const usize len = 0x3000;
+  FILE *f = tmpfile();
+  assert_non_null(f);
+  for (usize i = 0; i < len; i++) {
+    fputc((int)i, f);
+  }
+  fflush(f);
+  rewind(f);
+
+  Buffer b;
+  buffer_init(&b);
+  assert_int_equal(OK, buffer_map(&b, f));
+
+  // only the modified ranges are written back
+  usize written = 0;
+  buffer_set(&b, 0x10, 0xAA, 8);
+  buffer_inject(&b, 0x2000, (const u8 *)"abcd", 4);
+  assert_int_equal(OK, buffer_sync(&b, &written));
+  assert_int_equal(12, written);
+  assert_int_equal(0, b.dirty_len);
+
+  u8 expected[0x3000];
+  for (usize i = 0; i < len; i++) {
+    expected[i] = (u8)i;
+  }
+  memset(expected + 0x10, 0xAA, 8);
+  memcpy(expected + 0x2000, "abcd", 4);
+  u8 actual[0x3000];
+  assert_int_equal(len, pread(fileno(f), actual, len, 0));
+  assert_memory_equal(expected, actual, len);
+
+  // nothing changed, nothing is written
+  assert_int_equal(OK, buffer_sync(&b, &written));
+  assert_int_equal(0, written);
+
+  // growing and shrinking changes the length of the file
+  buffer_pad_to(&b, len + BUFFER_SPARSE_MIN, 0);
+  buffer_set(&b, len + 0x10, 0xBB, 1);
+  assert_int_equal(OK, buffer_sync(&b, &written));
+  assert_int_equal(0x11, written);
+  struct stat st;
+  assert_int_equal(0, fstat(fileno(f), &st));
+  assert_int_equal(len + BUFFER_SPARSE_MIN, st.st_size);
+  assert_int_equal(1, pread(fileno(f), actual, 1, len + 0x10));
+  assert_int_equal(0xBB, actual[0]);
+
+  buffer_trim(&b, 0x100);
+  assert_int_equal(OK, buffer_sync(&b, &written));
+  assert_int_equal(0, fstat(fileno(f), &st));
+  assert_int_equal(0x100, st.st_size);
+
+  buffer_free(&b);
+  fclose(f);
+}
+
+// the original printf based array writer with line breaks.
+// kept as a reference for the array tests
+static void buffer_write_array_ref_(const Buffer *buffer, FILE *file,
+                                    const char *name, const char *type,
+                                    usize per_line) {
+  fprintf(file, "%s %s[] = {\n", type, name);
+  for (usize i = 0; i < buffer_len(buffer); i++) { // NOLINT
+    fprintf(file, "0x%x, ",
+            i < buffer->len ? buffer->data[i] : buffer->fill_val);
+    if (per_line && (i + 1) % per_line == 0) {
+      fprintf(file, "\n");
+    }
+  }
+  fprintf(file, "\n};\n#define %s_LEN %ld\n", name, buffer_len(buffer));
+}
+
+// formats the buffer into a string with either writer
+static char *buffer_array_string_(const Buffer *buffer,
+                                  const BufferArrayFmt *fmt, bool ref) {
+  char *text = NULL;
+  size_t text_len = 0;
+  FILE *f = open_memstream(&text, &text_len);
+  assert_non_null(f);
+
+  if (ref) {
+    buffer_write_array_ref_(buffer, f, "arr", "const u8", fmt->per_line);
+  } else {
+    assert_int_equal(OK, buffer_write_array(buffer, f, "arr", "const u8", fmt));
+  }
+  fclose(f);
+  return text;
+}
+
+void test_buffer_array(void **state) {
+  Buffer b;
+  buffer_init(&b);
+  buffer_resize(&b, BUFFER_ARRAY_CHUNK * 4 + 123);
+  for (usize i = 0; i < b.len; i++) {
+    b.data[i] = (u8)(i * 31 + (i >> 9));
+  }
+
+  const usize lines[] = {0, 1, 7, 16};
+  const usize threads[] = {1, 3, 0};
+  for (usize l = 0; l < 4; l++) {
+    BufferArrayFmt fmt = {lines[l], 1};
+    char *ref = buffer_array_string_(&b, &fmt, TRUE);
+    for (usize t = 0; t < 3; t++) {
+      fmt.threads = threads[t];
+      char *fast = buffer_array_string_(&b, &fmt, FALSE);
+      assert_string_equal(ref, fast);
+      free(fast);
+    }
+    free(ref);
+  }
+
+  // fill is written as well, empty buffers only get the declaration
+  buffer_trim(&b, 3);
+  buffer_pad_by(&b, BUFFER_SPARSE_MIN, 0xAB);
+  BufferArrayFmt fmt = {8, 2};
+  char *ref = buffer_array_string_(&b, &fmt, TRUE);
+  char *fast = buffer_array_string_(&b, &fmt, FALSE);
+  assert_string_equal(ref, fast);
+  free(ref);
+  free(fast);
+
+  buffer_free(&b);
+  fast = buffer_array_string_(&b, NULL, FALSE);
+  assert_string_equal("const u8 arr[] = {\n\n};\n#define arr_LEN 0\n", fast);
+  free(fast);
+}
+
+static Error buffer_parse_string_(const char *text, Buffer *b) {
+  buffer_init(b);
+  buffer_inject(b, 0, (const u8 *)text, strlen(text));
+  return buffer_parse_array(b);
+}
+
+void test_buffer_parse_array(void **state) {
+  Buffer b;
+  Buffer text;
+  buffer_init(&b);
+  buffer_resize(&b, 0x400000);
+  for (usize i = 0; i < b.len; i++) {
+    b.data[i] = (u8)((i * 2654435761U) >> 13);
+  }
+
+  // everything the array writer emits parses back into the same bytes
+  const usize lines[] = {0, 12};
+  for (usize l = 0; l < 2; l++) {
+    BufferArrayFmt fmt = {lines[l], 0};
+    char *str = buffer_array_string_(&b, &fmt, FALSE);
+    buffer_init(&text);
+    buffer_inject(&text, 0, (const u8 *)str, strlen(str));
+    free(str);
+
+    assert_int_equal(OK, buffer_parse_array(&text));
+
+    assert_int_equal(b.len, text.len);
+    assert_memory_equal(b.data, text.data, b.len);
+    buffer_free(&text);
+  }
+  buffer_free(&b);
+
+  // decimal, octal, suffixes and comments
+  assert_int_equal(
+      OK, buffer_parse_string_("1, 0x1F,017 /* c */ 255u,\n\t0XaBUL // x\n0",
+                               &b));
+  const u8 expected[] = {1, 0x1F, 017, 255, 0xAB, 0};
+  assert_int_equal(sizeof(expected), b.len);
+  assert_memory_equal(expected, b.data, sizeof(expected));
+  buffer_free(&b);
+
+  assert_int_equal(OK, buffer_parse_string_("", &b));
+  assert_int_equal(0, b.len);
+  buffer_free(&b);
+
+  // values that do not fit a byte and anything else are rejected
+  assert_int_equal(ERR_PARSE, buffer_parse_string_("256", &b));
+  buffer_free(&b);
+  assert_int_equal(ERR_PARSE, buffer_parse_string_("0x100", &b));
+  buffer_free(&b);
+  assert_int_equal(ERR_PARSE, buffer_parse_string_("1, 0x, 2", &b));
+  buffer_free(&b);
+  assert_int_equal(ERR_PARSE, buffer_parse_string_("a", &b));
+  buffer_free(&b);
+  assert_int_equal(ERR_PARSE, buffer_parse_string_("08", &b));
+  buffer_free(&b);
+  assert_int_equal(ERR_PARSE, buffer_parse_string_("x[] = {1, 2", &b));
+  buffer_free(&b);
+  assert_int_equal(ERR_PARSE, buffer_parse_string_("1 /* 2", &b));
+  buffer_free(&b);
+}
+
+void test_buffer_dirty(void **state) {
+  Buffer b;
+  buffer_init(&b);
+  buffer_resize(&b, 0x1000);
+  buffer_dirty_clear(&b);
+
+  usize start = 0;
+  u64 version = b.version;
+  assert_false(buffer_dirty_since(&b, version, 0, &start));
+
+  buffer_set(&b, 0x800, 1, 0x10);
+  buffer_set(&b, 0x100, 1, 0x10);
+  assert_int_equal(2, b.dirty_len);
+  assert_true(buffer_dirty_since(&b, version, 0, &start));
+  assert_int_equal(0x100, start);
+
+  // only writes after version count
+  version = b.version;
+  buffer_inject(&b, 0x808, (const u8 *)"ab", 2);
+  assert_true(buffer_dirty_since(&b, version, 0, &start));
+  assert_int_equal(0x808, start);
+
+  // the older parts around the write are kept
+  assert_int_equal(4, b.dirty_len);
+  assert_int_equal(0x800, b.dirty[1].start);
+  assert_int_equal(0x808, b.dirty[1].end);
+  assert_int_equal(0x80A, b.dirty[3].start);
+  assert_int_equal(0x810, b.dirty[3].end);
+  assert_true(b.dirty[3].version <= version);
+
+  // a range covering others replaces them
+  buffer_set(&b, 0x80, 0, 0xFF);
+  buffer_inject(&b, 0x17F, b.data, 0x700);
+  assert_int_equal(2, b.dirty_len);
+  assert_int_equal(0x80, b.dirty[0].start);
+  assert_int_equal(0x87F, b.dirty[1].end);
+
+  // too many ranges collapse into one
+  for (usize i = 0; i < BUFFER_DIRTY_MAX + 1; i++) {
+    buffer_set(&b, 0x900 + i * 4, 2, 1);
+  }
+  assert_true(b.dirty_len <= BUFFER_DIRTY_MAX);
+  assert_int_equal(0x80, b.dirty[0].start);
+
+  buffer_dirty_clear(&b);
+  assert_false(buffer_dirty_since(&b, 0, 0, &start));
+
+  buffer_free(&b);
+}
+
+void test_buffer_sparse(void **state) {
+  const usize len = 0x4000000; // NOLINT
+  Buffer b;
+  buffer_init(&b);
+  buffer_pad_by(&b, 0x200000, 0x11);
+  buffer_resize(&b, 0x200000);
+  usize cap = b.cap;
+
+  // padding to a full cart size does not allocate
+  buffer_pad_to(&b, len, 0);
+  assert_int_equal(0x200000, b.len);
+  assert_int_equal(len, buffer_len(&b));
+  assert_int_equal(cap, b.cap);
+  usize start = 0;
+  assert_true(buffer_dirty_since(&b, 0, 0x200000, &start));
+  assert_int_equal(0x200000, start);
+
+  // writing into the fill only stores the fill in front of it
+  buffer_set(&b, 0x300000, 0xCC, 4);
+  assert_int_equal(0x300004, b.len);
+  assert_int_equal(len, buffer_len(&b));
+  assert_int_equal(0, b.data[0x2FFFFF]);
+  assert_int_equal(0xCC, b.data[0x300003]);
+
+  // zero fill becomes a hole, the file still reads back as zeroes
+  FILE *f = tmpfile();
+  assert_non_null(f);
+  assert_int_equal(OK, buffer_write(&b, f));
+  fflush(f);
+  struct stat st;
+  assert_int_equal(0, fstat(fileno(f), &st));
+  assert_int_equal(len, st.st_size);
+  fseek(f, 0x300003, SEEK_SET);
+  assert_int_equal(0xCC, fgetc(f));
+  assert_int_equal(0, fgetc(f));
+  fseek(f, -1, SEEK_END);
+  assert_int_equal(0, fgetc(f));
+  fclose(f);
+
+  // other fill values are written out
+  buffer_trim(&b, 0x300010);
+  assert_int_equal(0x300004, b.len);
+  assert_int_equal(0xC, b.fill_len);
+  buffer_pad_by(&b, BUFFER_SPARSE_MIN, 0xFF);
+  assert_int_equal(0x300010, b.len);
+  assert_int_equal(BUFFER_SPARSE_MIN, b.fill_len);
+  f = tmpfile();
+  assert_non_null(f);
+  assert_int_equal(OK, buffer_write(&b, f));
+  assert_int_equal(0x300010 + BUFFER_SPARSE_MIN, ftell(f));
+  fseek(f, -1, SEEK_END);
+  assert_int_equal(0xFF, fgetc(f));
+  fclose(f);
+
+  // the header is prepended in front of the fill
+  buffer_prepend(&b, 0x40, 0);
+  assert_int_equal(0x300050, b.len);
+  assert_int_equal(0x11, b.data[0x40]);
+
+  buffer_materialize(&b, (usize)-1);
+  assert_int_equal(0x300050 + BUFFER_SPARSE_MIN, b.len);
+  assert_int_equal(0, b.fill_len);
+  assert_int_equal(0xFF, b.data[b.len - 1]);
+
+  buffer_free(&b);
+}
+
+void test_buffer_grow(void **state) {
+  Buffer b;
+  buffer_init(&b);
+
+  // growing one byte at a time only reallocates a handful of times
+  usize grows = 0;
+  usize last_cap = 0;
+  for (usize i = 0; i < 0x10000; i++) {
+    buffer_pad_by(&b, 1, (u8)i);
+    if (b.cap != last_cap) {
+      grows++;
+      last_cap = b.cap;
+    }
+  }
+  assert_int_equal(0x10000, b.len);
+  assert_true(grows <= 17);
+  assert_int_equal(0x34, b.data[0x1234]);
+
+  // pad and set fill the new space
+  buffer_pad_to(&b, 0x10010, 0xEE);
+  assert_int_equal(0xEE, b.data[0x1000F]);
+  buffer_set(&b, 0x10020, 0xCC, 4);
+  assert_int_equal(0, b.data[0x1001F]);
+  assert_int_equal(0xCC, b.data[0x10023]);
+
+  // prepending without front slack shifts inside the allocation
+  u8 *base = b.base;
+  usize len = b.len;
+  buffer_prepend(&b, 0x40, 0);
+  assert_int_equal(len + 0x40, b.len);
+  assert_int_equal(0, b.data[0x3F]);
+  assert_int_equal(0x34, b.data[0x1234 + 0x40]);
+  assert_ptr_equal(base, b.base);
+  buffer_free(&b);
+
+  // data that was read has front slack for a header
+  FILE *f = tmpfile();
+  assert_non_null(f);
+  fputs("rom", f);
+  rewind(f);
+  assert_int_equal(OK, buffer_read(&b, f));
+  u8 *data = b.data;
+  buffer_prepend(&b, BUFFER_FRONT_SLACK, 0xFF);
+  assert_ptr_equal(data - BUFFER_FRONT_SLACK, b.data);
+  assert_int_equal(BUFFER_FRONT_SLACK + 3, b.len);
+  assert_int_equal(0xFF, b.data[0]);
+  assert_memory_equal("rom", b.data + BUFFER_FRONT_SLACK, 3);
+  buffer_free(&b);
+
+  // growing data that was read keeps room for its front slack
+  rewind(f);
+  assert_int_equal(OK, buffer_read(&b, f));
+  assert_int_equal(OK, buffer_pad_to(&b, 0x8000, 0xEE));
+  assert_int_equal(0x8000, b.len);
+  assert_memory_equal("rom", b.data, 3);
+  assert_int_equal(0xEE, b.data[0x7FFF]);
+  assert_true(b.data + b.len <= b.base + b.cap);
+
+  usize end = b.cap * 2;
+  assert_int_equal(OK, buffer_inject(&b, end - 4, (const u8 *)"abcd", 4));
+  assert_int_equal(end, b.len);
+  assert_memory_equal("rom", b.data, 3);
+  assert_int_equal(0xEE, b.data[0x7FFF]);
+  assert_memory_equal("abcd", b.data + end - 4, 4);
+  assert_true(b.data + b.len <= b.base + b.cap);
+
+  buffer_free(&b);
+  fclose(f);
+}
+
+#endif
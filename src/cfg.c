@@ -1,3 +1,9 @@
 #include "cfg.h"
 
 u32 nuss_verbose = 0;
+
+const char *nuss_session = NULL;
+
+const char *nuss_transport = NULL;
+
+u32 nuss_stats = 0;
@@ -16,6 +16,24 @@ void error_fprint(FILE *file, Error error) {
   case ERR_WRITE:
     fprintf(file, "IO Write Error\n");
     break;
+  case ERR_CRC_MISMATCH:
+    fprintf(file, "CRC mismatch\n");
+    break;
+  case ERR_THREAD:
+    fprintf(file, "Unable to start worker threads\n");
+    break;
+  case ERR_EXPORT_ARCH:
+    fprintf(file, "Unknown export architecture\n");
+    break;
+  case ERR_PARSE:
+    fprintf(file, "Invalid array literal\n");
+    break;
+  case ERR_TRANSPORT:
+    fprintf(file, "Unknown usb transport\n");
+    break;
+  case ERR_ALLOC:
+    fprintf(file, "Out of memory\n");
+    break;
   default:
     fprintf(file, "Unknown error\n");
     break;
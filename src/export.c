@@ -0,0 +1,441 @@
+#include "export.h"
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+
+// mips3 instructions with the o64 abi, what gcc emits for the vr4300
+#define EXPORT_MIPS_FLAGS (EF_MIPS_ARCH_3 | 0x00002000)
+
+typedef struct ElfWriter { // NOLINT
+  FILE *file;
+  bool is64;
+  bool msb;
+  usize pos;
+  Error err;
+} ElfWriter;
+
+Error export_arch_from_name(const char *name, ExportArch *arch) {
+  if (strcmp(name, "mips") == 0) {
+    *arch = EXPORT_ARCH_MIPS;
+  } else if (strcmp(name, "x86_64") == 0) {
+    *arch = EXPORT_ARCH_X86_64;
+  } else {
+    return ERR_EXPORT_ARCH;
+  }
+  return OK;
+}
+
+static void elf_bytes_(ElfWriter *w, const void *data, usize len) {
+  if (len && !fwrite(data, len, 1, w->file)) {
+    w->err = ERR_WRITE;
+  }
+  w->pos += len;
+}
+
+// writes an integer of size bytes in the byte order of the object
+static void elf_put_(ElfWriter *w, u64 val, usize size) {
+  u8 bytes[8];
+  for (usize i = 0; i < size; i++) {
+    bytes[w->msb ? size - 1 - i : i] = (u8)(val >> (8 * i));
+  }
+  elf_bytes_(w, bytes, size);
+}
+
+// addresses, offsets and sizes depend on the elf class
+static void elf_word_(ElfWriter *w, u64 val) {
+  elf_put_(w, val, w->is64 ? 8 : 4);
+}
+
+static void elf_pad_(ElfWriter *w, usize to) {
+  static const u8 zero[16] = {0};
+  while (w->pos < to) {
+    usize n = to - w->pos < sizeof(zero) ? to - w->pos : sizeof(zero);
+    elf_bytes_(w, zero, n);
+  }
+}
+
+static usize align_(usize val, usize align) {
+  return (val + align - 1) / align * align;
+}
+
+static void elf_section_(ElfWriter *w, u32 name, u32 type, u64 flags,
+                         usize offset, usize size, u32 link, u32 info,
+                         usize align, usize entsize) {
+  elf_put_(w, name, 4);
+  elf_put_(w, type, 4);
+  elf_word_(w, flags);
+  elf_word_(w, 0); // addr
+  elf_word_(w, offset);
+  elf_word_(w, size);
+  elf_put_(w, link, 4);
+  elf_put_(w, info, 4);
+  elf_word_(w, align);
+  elf_word_(w, entsize);
+}
+
+static void elf_symbol_(ElfWriter *w, u32 name, usize value, usize size) {
+  u8 info = ELF32_ST_INFO(STB_GLOBAL, STT_OBJECT);
+  elf_put_(w, name, 4);
+  if (w->is64) {
+    elf_put_(w, info, 1);
+    elf_put_(w, STV_DEFAULT, 1);
+    elf_put_(w, 1, 2); // .rodata
+    elf_put_(w, value, 8);
+    elf_put_(w, size, 8);
+  } else {
+    elf_put_(w, value, 4);
+    elf_put_(w, size, 4);
+    elf_put_(w, info, 1);
+    elf_put_(w, STV_DEFAULT, 1);
+    elf_put_(w, 1, 2);
+  }
+}
+
+Error export_elf(const Buffer *buffer, FILE *file, const char *name,
+                 ExportArch arch) {
+  ElfWriter w = {file, arch == EXPORT_ARCH_X86_64, arch == EXPORT_ARCH_MIPS,
+                 0, OK};
+
+  // sections: null, .rodata, .symtab, .strtab, .shstrtab, .note.GNU-stack.
+  // the empty note tells the linker the object needs no executable stack
+  static const char shstrtab[] =
+      "\0.rodata\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+  const u32 sh_rodata = 1;
+  const u32 sh_symtab = 9;
+  const u32 sh_strtab = 17;
+  const u32 sh_shstrtab = 25;
+  const u32 sh_note = 35;
+
+  usize name_len = strlen(name);
+  usize data_len = buffer_len(buffer);
+  usize ehsize = w.is64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+  usize shentsize = w.is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr);
+  usize symentsize = w.is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+
+  // .rodata holds the data followed by its length
+  usize rodata_off = align_(ehsize, 16);
+  usize len_off = align_(data_len, 4);
+  usize rodata_size = len_off + 4;
+  usize symtab_off = align_(rodata_off + rodata_size, 8);
+  usize symtab_size = 3 * symentsize;
+  usize strtab_off = symtab_off + symtab_size;
+  usize strtab_size = 1 + name_len + 1 + name_len + sizeof("_LEN");
+  usize shstrtab_off = strtab_off + strtab_size;
+  usize shoff = align_(shstrtab_off + sizeof(shstrtab), 8);
+
+  u8 ident[EI_NIDENT] = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3};
+  ident[EI_CLASS] = w.is64 ? ELFCLASS64 : ELFCLASS32;
+  ident[EI_DATA] = w.msb ? ELFDATA2MSB : ELFDATA2LSB;
+  ident[EI_VERSION] = EV_CURRENT;
+  elf_bytes_(&w, ident, EI_NIDENT);
+  elf_put_(&w, ET_REL, 2);
+  elf_put_(&w, w.is64 ? EM_X86_64 : EM_MIPS, 2);
+  elf_put_(&w, EV_CURRENT, 4);
+  elf_word_(&w, 0); // entry
+  elf_word_(&w, 0); // program headers
+  elf_word_(&w, shoff);
+  elf_put_(&w, w.is64 ? 0 : EXPORT_MIPS_FLAGS, 4);
+  elf_put_(&w, ehsize, 2);
+  elf_put_(&w, 0, 2);
+  elf_put_(&w, 0, 2);
+  elf_put_(&w, shentsize, 2);
+  elf_put_(&w, 6, 2);
+  elf_put_(&w, 4, 2);
+
+  // the data is written like any other output
+  // so unmodified input and fill are not copied through memory
+  elf_pad_(&w, rodata_off);
+  if (buffer_write(buffer, file)) {
+    return ERR_WRITE;
+  }
+  w.pos += data_len;
+  elf_pad_(&w, rodata_off + len_off);
+  elf_put_(&w, data_len, 4);
+
+  elf_pad_(&w, symtab_off);
+  elf_bytes_(&w, (u8[24]){0}, symentsize);
+  elf_symbol_(&w, 1, 0, data_len);
+  elf_symbol_(&w, 1 + name_len + 1, len_off, 4);
+
+  elf_bytes_(&w, "", 1);
+  elf_bytes_(&w, name, name_len + 1);
+  elf_bytes_(&w, name, name_len);
+  elf_bytes_(&w, "_LEN", sizeof("_LEN"));
+
+  elf_bytes_(&w, shstrtab, sizeof(shstrtab));
+
+  elf_pad_(&w, shoff);
+  elf_section_(&w, 0, SHT_NULL, 0, 0, 0, 0, 0, 0, 0);
+  elf_section_(&w, sh_rodata, SHT_PROGBITS, SHF_ALLOC, rodata_off,
+               rodata_size, 0, 0, 16, 0);
+  // every symbol after the null symbol is global
+  elf_section_(&w, sh_symtab, SHT_SYMTAB, 0, symtab_off, symtab_size, 3, 1,
+               8, symentsize);
+  elf_section_(&w, sh_strtab, SHT_STRTAB, 0, strtab_off, strtab_size, 0, 0, 1,
+               0);
+  elf_section_(&w, sh_shstrtab, SHT_STRTAB, 0, shstrtab_off, sizeof(shstrtab),
+               0, 0, 1, 0);
+  elf_section_(&w, sh_note, SHT_PROGBITS, 0, shoff, 0, 0, 0, 1, 0);
+
+  return w.err;
+}
+
+Error export_incbin(const Buffer *buffer, FILE *file, const char *name,
+                    const char *path) {
+  fprintf(file, ".section .rodata\n");
+  fprintf(file, ".balign 16\n");
+  fprintf(file, ".global %s\n", name);
+  fprintf(file, ".type %s, @object\n", name);
+  fprintf(file, "%s:\n", name);
+  fprintf(file, ".incbin \"%s\"\n", path);
+  fprintf(file, ".size %s, . - %s\n", name, name);
+  fprintf(file, ".balign 4\n");
+  fprintf(file, ".global %s_LEN\n", name);
+  fprintf(file, ".type %s_LEN, @object\n", name);
+  fprintf(file, "%s_LEN:\n", name);
+  fprintf(file, ".4byte %ld\n", buffer_len(buffer));
+  fprintf(file, ".size %s_LEN, 4\n", name);
+  fprintf(file, ".section .note.GNU-stack, \"\", @progbits\n");
+  return ferror(file) ? ERR_WRITE : OK;
+}
+
+Error export_embed(const Buffer *buffer, FILE *file, const char *name,
+                   const char *type, const char *path) {
+  fprintf(file, "%s %s[] = {\n", type, name);
+  fprintf(file, "#embed \"%s\"\n", path);
+  fprintf(file, "};\n#define %s_LEN %ld\n", name, buffer_len(buffer));
+  return ferror(file) ? ERR_WRITE : OK;
+}
+
+Error export_shards(const Buffer *buffer, FILE *header, const char *prefix,
+                    const char *name, const char *type,
+                    const BufferArrayFmt *fmt, usize shard_len, usize align) {
+  align = align ? align : 1;
+  shard_len = shard_len / align * align;
+  shard_len = shard_len ? shard_len : align;
+
+  // an empty buffer still gets one (empty) shard
+  usize len = buffer_len(buffer);
+  usize shards = len ? (len + shard_len - 1) / shard_len : 1;
+
+  usize path_len = strlen(prefix) + 32;
+  usize name_len = strlen(name) + 32;
+  char *path = malloc(path_len);
+  char *shard_name = malloc(name_len);
+  if (path == NULL || shard_name == NULL) {
+    free(path);
+    free(shard_name);
+    return ERR_WRITE;
+  }
+
+  Error err = OK;
+  for (usize i = 0; i < shards && !err; i++) {
+    snprintf(path, path_len, "%s_%ld.c", prefix, i);
+    snprintf(shard_name, name_len, "%s_%ld", name, i);
+
+    FILE *f = fopen(path, "we");
+    if (f == NULL) {
+      err = ERR_WRITE;
+      break;
+    }
+    usize start = i * shard_len;
+    usize end = start + shard_len < len ? start + shard_len : len;
+    err = buffer_write_array_range(buffer, f, shard_name, type, fmt, start,
+                                   end);
+    if (fclose(f)) {
+      err = ERR_WRITE;
+    }
+  }
+  free(path);
+  free(shard_name);
+  if (err) {
+    return err;
+  }
+
+  // byte i is NAME[i / NAME_SHARD_LEN][i % NAME_SHARD_LEN]
+  fprintf(header, "#ifndef %s_SHARDS\n", name);
+  fprintf(header, "#define %s_SHARDS %ld\n", name, shards);
+  fprintf(header, "#define %s_SHARD_LEN %ld\n", name, shard_len);
+  fprintf(header, "#define %s_LEN %ld\n", name, len);
+  for (usize i = 0; i < shards; i++) {
+    fprintf(header, "extern %s %s_%ld[];\n", type, name, i);
+  }
+  fprintf(header, "static %s *const %s[%s_SHARDS] = {\n", type, name, name);
+  for (usize i = 0; i < shards; i++) {
+    fprintf(header, "%s_%ld, ", name, i);
+  }
+  fprintf(header, "\n};\n#endif\n");
+
+  return ferror(header) ? ERR_WRITE : OK;
+}
+
+#ifdef TEST
+
+#include "macros.h"
+#include <unistd.h>
+
+static char *export_string_(const Buffer *buffer, ExportArch arch,
+                            size_t *len) {
+  char *text = NULL;
+  FILE *f = open_memstream(&text, len);
+  assert_non_null(f);
+  assert_int_equal(OK, export_elf(buffer, f, "asset", arch));
+  fclose(f);
+  return text;
+}
+
+void test_export_elf(void **state) {
+  Buffer b;
+  buffer_init(&b);
+  buffer_inject(&b, 0, (const u8 *)"nus", 3);
+
+  // the host object can be read with the system headers
+  size_t len = 0;
+  char *obj = export_string_(&b, EXPORT_ARCH_X86_64, &len);
+  Elf64_Ehdr eh;
+  memcpy(&eh, obj, sizeof(eh));
+  assert_memory_equal(ELFMAG, eh.e_ident, SELFMAG);
+  assert_int_equal(ET_REL, eh.e_type);
+  assert_int_equal(EM_X86_64, eh.e_machine);
+  assert_int_equal(6, eh.e_shnum);
+  assert_int_equal(len, eh.e_shoff + 6 * sizeof(Elf64_Shdr));
+
+  Elf64_Shdr sh[6];
+  memcpy(sh, obj + eh.e_shoff, sizeof(sh));
+  assert_string_equal(".rodata", obj + sh[4].sh_offset + sh[1].sh_name);
+  assert_memory_equal("nus", obj + sh[1].sh_offset, 3);
+  u32 data_len = 0;
+  memcpy(&data_len, obj + sh[1].sh_offset + 4, 4);
+  assert_int_equal(3, data_len);
+
+  Elf64_Sym sym[3];
+  memcpy(sym, obj + sh[2].sh_offset, sizeof(sym));
+  const char *strtab = obj + sh[3].sh_offset;
+  assert_string_equal("asset", strtab + sym[1].st_name);
+  assert_int_equal(3, sym[1].st_size);
+  assert_string_equal("asset_LEN", strtab + sym[2].st_name);
+  assert_int_equal(4, sym[2].st_value);
+  assert_int_equal(1, sym[2].st_shndx);
+  free(obj);
+
+  // the cart object is big endian and includes the fill
+  buffer_pad_by(&b, BUFFER_SPARSE_MIN, 0xFF);
+  obj = export_string_(&b, EXPORT_ARCH_MIPS, &len);
+  assert_int_equal(ELFCLASS32, obj[EI_CLASS]);
+  assert_int_equal(ELFDATA2MSB, obj[EI_DATA]);
+  assert_int_equal(EM_MIPS, obj[0x13]);
+  assert_int_equal(0xFF, (u8)obj[0x40 + 3 + BUFFER_SPARSE_MIN - 1]);
+  const u8 *len_bytes = (const u8 *)obj + 0x40 + 3 + BUFFER_SPARSE_MIN + 1;
+  assert_int_equal(3 + BUFFER_SPARSE_MIN, (len_bytes[0] << 24) |
+                                              (len_bytes[1] << 16) |
+                                              (len_bytes[2] << 8) |
+                                              len_bytes[3]);
+  free(obj);
+
+  ExportArch arch;
+  assert_int_equal(OK, export_arch_from_name("mips", &arch));
+  assert_int_equal(EXPORT_ARCH_MIPS, arch);
+  assert_int_equal(ERR_EXPORT_ARCH, export_arch_from_name("arm", &arch));
+
+  buffer_free(&b);
+}
+
+// reads a whole file into a string
+static char *export_read_(const char *path) {
+  FILE *f = fopen(path, "re");
+  assert_non_null(f);
+  Buffer b;
+  assert_int_equal(OK, buffer_read(&b, f));
+  fclose(f);
+  char *text = calloc(b.len + 1, 1);
+  memcpy(text, b.data, b.len);
+  buffer_free(&b);
+  return text;
+}
+
+void test_export_shards(void **state) {
+  char dir[] = "/tmp/nusstool_shardsXXXXXX";
+  assert_non_null(mkdtemp(dir));
+  char prefix[64];
+  snprintf(prefix, sizeof(prefix), "%s/asset", dir);
+
+  Buffer b;
+  buffer_init(&b);
+  buffer_resize(&b, 1000);
+  for (usize i = 0; i < b.len; i++) {
+    b.data[i] = (u8)(i * 13);
+  }
+
+  // 300 is aligned down to 256, the last shard is shorter
+  char *header = NULL;
+  size_t header_len = 0;
+  FILE *f = open_memstream(&header, &header_len);
+  BufferArrayFmt fmt = {16, 2};
+  assert_int_equal(OK, export_shards(&b, f, prefix, "asset", "const u8", &fmt,
+                                     300, 256));
+  fclose(f);
+  assert_non_null(strstr(header, "#define asset_SHARDS 4\n"));
+  assert_non_null(strstr(header, "#define asset_SHARD_LEN 256\n"));
+  assert_non_null(strstr(header, "#define asset_LEN 1000\n"));
+  assert_non_null(strstr(header, "extern const u8 asset_3[];\n"));
+  assert_non_null(strstr(header, "asset_0, asset_1, asset_2, asset_3, "));
+  free(header);
+
+  // every shard is the array of its slice
+  for (usize i = 0; i < 4; i++) {
+    char path[96];
+    char name[16];
+    snprintf(path, sizeof(path), "%s_%ld.c", prefix, i);
+    snprintf(name, sizeof(name), "asset_%ld", i);
+    char *shard = export_read_(path);
+
+    Buffer slice;
+    buffer_init(&slice);
+    usize len = i < 3 ? 256 : 1000 - 768;
+    buffer_inject(&slice, 0, b.data + i * 256, len);
+    char *expected = NULL;
+    size_t expected_len = 0;
+    f = open_memstream(&expected, &expected_len);
+    assert_int_equal(OK,
+                     buffer_write_array(&slice, f, name, "const u8", &fmt));
+    fclose(f);
+
+    assert_string_equal(expected, shard);
+    free(expected);
+    free(shard);
+    buffer_free(&slice);
+    unlink(path);
+  }
+  rmdir(dir);
+
+  buffer_free(&b);
+}
+
+void test_export_text(void **state) {
+  Buffer b;
+  buffer_init(&b);
+  buffer_resize(&b, 0x20);
+
+  char *text = NULL;
+  size_t len = 0;
+  FILE *f = open_memstream(&text, &len);
+  assert_non_null(f);
+  assert_int_equal(OK, export_embed(&b, f, "asset", "const u8", "a.bin"));
+  fclose(f);
+  assert_string_equal("const u8 asset[] = {\n#embed \"a.bin\"\n};\n"
+                      "#define asset_LEN 32\n",
+                      text);
+  free(text);
+
+  f = open_memstream(&text, &len);
+  assert_non_null(f);
+  assert_int_equal(OK, export_incbin(&b, f, "asset", "a.bin"));
+  fclose(f);
+  assert_non_null(strstr(text, "asset:\n.incbin \"a.bin\"\n"));
+  assert_non_null(strstr(text, "asset_LEN:\n.4byte 32\n"));
+  free(text);
+
+  buffer_free(&b);
+}
+
+#endif
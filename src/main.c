@@ -15,13 +15,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <argp.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "pool.h"
+#include "export.h"
+#include "session.h"
+#include "recipe.h"
 
 const char *argp_program_version = "nusstool 0.1";
 const char *argp_program_bug_address = "<lukas@krickl.dev>";
 
 static char doc[] = "nusstool";
 
-static char args_doc[] = "";
+static char args_doc[] = "[FILE...]";
 
 // anything past the ascii range can still be used as a key
 enum ArgpKeys {
@@ -53,9 +62,27 @@ enum ArgpKeys {
   NUS_DUMP,
   NUS_RAM_WR,
   NUS_RAM_RD,
+  NUS_LOAD_BOOT,
   WR_ARR,
   WR_TXTARR,
   WR_ARRAY_TYPE,
+  WR_ARRAY_LINE,
+  WR_ARRAY_SHARD,
+  RD_ARR,
+  WR_ARRAY_ALIGN,
+  WR_ELF,
+  WR_ELF_ARCH,
+  WR_INCBIN,
+  WR_EMBED,
+  WR_BIN,
+  RECIPE,
+  BATCH,
+  NUS_VERIFY,
+  INPLACE,
+  DAEMON,
+  SESSION,
+  TRANSPORT,
+  STATS,
 
   BMP_1BPP
 };
@@ -71,7 +98,34 @@ static struct argp_option options[] = {
     {"dry", DRY, NULL, 0, "Dry run - no output will be generated"},
     {"op", OP, "OPERATION", 0,
      "The operation type. PAD_TO = 1, PAD_BY = 2, SET = 3, INJECT_FILE = 4, "
-     "INJECT = 5"},
+     "INJECT = 5, ADD_HEADER = 12, SET_HEADER = 13, TRIM = 14. "
+     "May be repeated, operations are applied in order"},
+    {"batch", BATCH, NULL, 0,
+     "Apply the operations to every FILE (or every file in a directory) "
+     "in parallel. Results are written back to each file, or into the "
+     "directory given by -o"},
+    {"jobs", 'j', "THREADS", 0,
+     "Number of worker threads for --batch and --warray "
+     "(defaults to the core count)"},
+    {"inplace", INPLACE, "FILE", 0,
+     "Apply the operations to FILE and only write the modified "
+     "ranges back to it"},
+    {"daemon", DAEMON, "SOCKET", 0,
+     "Keep the cart connection open and run usb operations "
+     "sent to SOCKET by --session until interrupted"},
+    {"session", SESSION, "SOCKET", 0,
+     "Send usb operations to the daemon on SOCKET "
+     "(defaults to $NUSS_SESSION)"},
+    {"transport", TRANSPORT, "SPEC", 0,
+     "Run usb operations over ftdi or an emulated cart "
+     "emu[:BYTES_PER_S[:LATENCY_US]] (defaults to $NUSS_TRANSPORT)"},
+    {"stats", STATS, "FORMAT", OPTION_ARG_OPTIONAL,
+     "Print usb transfer statistics to stderr as table (default) or json"},
+    {"nusverify", NUS_VERIFY, NULL, 0,
+     "Compare the stored nus crc with the calculated crc"},
+    {"recipe", RECIPE, "FILE", 0,
+     "Read additional options from FILE. "
+     "Lines are split like a command line, # starts a comment"},
     {"at", AT, "OFFSET", 0,
      "Where data should be inserted. For INJECT INJECT_FILE and SET."},
     {"path", PATH, "FILE", 0, "Path to be injected by INJECT_FILE"},
@@ -87,7 +141,28 @@ static struct argp_option options[] = {
     {"wtxtarray", WR_TXTARR, "NAME", 0,
      "Output as const u8 array but assumes the content of input is a correctly "
      "formatted text input (a, b, c...)"},
+    {"rarray", RD_ARR, NULL, 0,
+     "Parse the input as c array text (hex, octal or decimal literals) "
+     "into bytes before applying any operation"},
     {"warrtype", WR_ARRAY_TYPE, "TYPE", 0, "The data type for the array"},
+    {"warrline", WR_ARRAY_LINE, "COUNT", 0,
+     "Elements per line of the array (defaults to a single line)"},
+    {"warrshard", WR_ARRAY_SHARD, "SIZE", 0,
+     "Split --warray into arrays of at most SIZE bytes. Each one is written "
+     "to OUTPUT_N.c and the output becomes a header indexing them"},
+    {"warralign", WR_ARRAY_ALIGN, "ALIGN", 0,
+     "Round the shard size down to a multiple of ALIGN"},
+    {"welf", WR_ELF, "NAME", 0,
+     "Output as relocatable elf object with the symbols NAME and NAME_LEN"},
+    {"welfarch", WR_ELF_ARCH, "ARCH", 0,
+     "Architecture of the elf object. mips (default) or x86_64"},
+    {"wincbin", WR_INCBIN, "NAME", 0,
+     "Output as GNU as stub that includes the binary with .incbin"},
+    {"wembed", WR_EMBED, "NAME", 0,
+     "Output as header that includes the binary with #embed"},
+    {"wbin", WR_BIN, "FILE", 0,
+     "Write the binary for --wincbin and --wembed to FILE. "
+     "Without it the unmodified input file is included"},
 
     {"nustitle", NUS_TITLE, "TITLE", 0, ""},
     {"nusboot", NUS_BOOT_ADDR, "ADDRESS", 0, ""},
@@ -104,6 +179,8 @@ static struct argp_option options[] = {
      "Dump data over usb. Data is read into the buffer until it is filled"},
     {"nuswrusb", NUS_RAM_WR, NULL, 0, "Write buffer to ram"},
     {"nusrdusb", NUS_RAM_RD, NULL, 0, "Read buffer from ram"},
+    {"load-and-boot", NUS_LOAD_BOOT, NULL, 0,
+     "Load via usb and boot as soon as the cart is ready"},
 
     {"bmp1", BMP_1BPP, NULL, 0,
      "Interpret input as bmp and convert to 1bpp array"},
@@ -121,7 +198,11 @@ enum OperationKind {
   NUSDUMP,
   NUSRAMRD,
   NUSRAMWR,
-  BMP_1BPP_OP
+  NUSLOADBOOT,
+  BMP_1BPP_OP,
+  ADD_HEADER,
+  SET_HEADER,
+  TRIM
 };
 
 struct Inject {
@@ -142,6 +223,10 @@ struct PadBy {
   usize by;
 };
 
+struct Trim {
+  usize to;
+};
+
 struct Set {
   usize at;
   usize len;
@@ -153,16 +238,44 @@ union Operation {
   struct InjectFile inject_file;
   struct PadTo pad_to;
   struct PadBy pad_by;
+  struct Trim trim;
   struct Set set;
 };
 
+struct Op {
+  enum OperationKind kind;
+  union Operation op;
+};
+
+// options read from a recipe file.
+// the arguments point into text so it has to outlive the parse
+struct Recipe {
+  Buffer text;
+  char **argv;
+  // the resolved path of the file. open while its options are parsed
+  char *path;
+  bool open;
+  struct Recipe *next;
+};
+
 struct Arguments {
   char *output_file;
   char *input_file;
+  char *inplace_file;
+  char *daemon_socket;
 
   char *array_name;
   char *text_array_name;
   char *array_type;
+  usize array_per_line;
+  bool parse_array;
+  usize array_shard;
+  usize array_align;
+  char *elf_name;
+  ExportArch elf_arch;
+  char *incbin_name;
+  char *embed_name;
+  char *bin_file;
 
   usize buffer_len;
   u32 addr;
@@ -172,6 +285,13 @@ struct Arguments {
   bool setnush;
   bool dry;
   bool noinput;
+  bool verify;
+
+  // input files and directories for batch mode
+  bool batch;
+  usize jobs;
+  char **paths;
+  usize paths_len;
 
   char *nus_title;
   char *nus_boot_addr;
@@ -184,11 +304,41 @@ struct Arguments {
   char nus_destination;
   char nus_version;
 
-  // mutually exclusive options
-  enum OperationKind op_kind;
-  union Operation op;
+  // operations are applied to the buffer in order
+  struct Op *ops;
+  usize ops_len;
+
+  struct Recipe *recipes;
 };
 
+// appends a new operation. All following operation options apply to it
+static struct Op *op_push_(struct Arguments *arguments,
+                           enum OperationKind kind) {
+  struct Op *ops =
+      realloc(arguments->ops, (arguments->ops_len + 1) * sizeof(struct Op));
+  if (ops == NULL) {
+    return NULL;
+  }
+  arguments->ops = ops;
+
+  struct Op *op = &arguments->ops[arguments->ops_len++];
+  memset(op, 0, sizeof(struct Op));
+  op->kind = kind;
+  return op;
+}
+
+// the operation that options like --at currently apply to
+static struct Op *op_last_(struct Arguments *arguments,
+                           enum OperationKind kind) {
+  if (arguments->ops_len == 0 ||
+      arguments->ops[arguments->ops_len - 1].kind != kind) {
+    return NULL;
+  }
+  return &arguments->ops[arguments->ops_len - 1];
+}
+
+static error_t parse_recipe_(struct Arguments *arguments, const char *path);
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   struct Arguments *arguments = state->input;
 
@@ -199,6 +349,24 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   case 'i':
     arguments->input_file = arg;
     break;
+  case INPLACE:
+    arguments->inplace_file = arg;
+    break;
+  case DAEMON:
+    arguments->daemon_socket = arg;
+    break;
+  case SESSION:
+    nuss_session = arg;
+    break;
+  case TRANSPORT:
+    nuss_transport = arg;
+    break;
+  case STATS:
+    nuss_stats = nus_stats_format_from_name(arg);
+    if (nuss_stats == NUS_STATS_OFF) {
+      argp_error(state, "unknown stats format %s", arg);
+    }
+    break;
   case 'v':
     nuss_verbose = 1;
     break;
@@ -249,71 +417,104 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     arguments->dry = TRUE;
     break;
 
+  case RECIPE:
+    return parse_recipe_(arguments, arg);
+
   case OP:
-    arguments->op_kind = atoi(arg);
-    break;
-  case AT:
-    if (arguments->op_kind == INJECT) {
-      arguments->op.inject.at = atoi(arg);
-    } else if (arguments->op_kind == INJECT_FILE) {
-      arguments->op.inject_file.at = atoi(arg);
-    } else if (arguments->op_kind == SET) {
-      arguments->op.set.at = atoi(arg);
+    if (!op_push_(arguments, atoi(arg))) {
+      return ENOMEM;
+    }
+    break;
+  case AT: {
+    struct Op *op = NULL;
+    if ((op = op_last_(arguments, INJECT))) {
+      op->op.inject.at = atoi(arg);
+    } else if ((op = op_last_(arguments, INJECT_FILE))) {
+      op->op.inject_file.at = atoi(arg);
+    } else if ((op = op_last_(arguments, SET))) {
+      op->op.set.at = atoi(arg);
     } else {
       return ARGP_ERR_UNKNOWN;
     }
     break;
-  case DATA:
-    if (arguments->op_kind == INJECT) {
-      arguments->op.inject.data = arg;
+  }
+  case DATA: {
+    struct Op *op = op_last_(arguments, INJECT);
+    if (op) {
+      op->op.inject.data = arg;
     } else {
       return ARGP_ERR_UNKNOWN;
     }
     break;
-  case LEN:
-    if (arguments->op_kind == SET) {
-      arguments->op.set.len = atoi(arg);
+  }
+  case LEN: {
+    struct Op *op = op_last_(arguments, SET);
+    if (op) {
+      op->op.set.len = atoi(arg);
     } else {
       return ARGP_ERR_UNKNOWN;
     }
     break;
-  case PATH:
-    if (arguments->op_kind == INJECT_FILE) {
-      arguments->op.inject_file.path = arg;
+  }
+  case PATH: {
+    struct Op *op = op_last_(arguments, INJECT_FILE);
+    if (op) {
+      op->op.inject_file.path = arg;
     } else {
       return ARGP_ERR_UNKNOWN;
     }
     break;
-  case BY:
-    if (arguments->op_kind == PAD_BY) {
-      arguments->op.pad_by.by = atoi(arg);
+  }
+  case BY: {
+    struct Op *op = op_last_(arguments, PAD_BY);
+    if (op) {
+      op->op.pad_by.by = atoi(arg);
     } else {
       return ARGP_ERR_UNKNOWN;
     }
     break;
-  case TO:
-    if (arguments->op_kind == PAD_TO) {
-      arguments->op.pad_to.to = atoi(arg);
+  }
+  case TO: {
+    struct Op *op = NULL;
+    if ((op = op_last_(arguments, PAD_TO))) {
+      op->op.pad_to.to = atoi(arg);
+    } else if ((op = op_last_(arguments, TRIM))) {
+      op->op.trim.to = atoi(arg);
     } else {
       return ARGP_ERR_UNKNOWN;
     }
     break;
-  case VAL:
-    if (arguments->op_kind == SET) {
-      arguments->op.set.val = atoi(arg);
+  }
+  case VAL: {
+    struct Op *op = op_last_(arguments, SET);
+    if (op) {
+      op->op.set.val = atoi(arg);
     } else {
       return ARGP_ERR_UNKNOWN;
     }
     break;
-  case ARGP_KEY_ARG:
-    if (state->arg_num >= 0) {
-      /* Too many arguments. */
-      argp_usage(state); // NOLINT
+  }
+  case BATCH:
+    arguments->batch = TRUE;
+    break;
+  case 'j':
+    arguments->jobs = atoi(arg);
+    break;
+  case NUS_VERIFY:
+    arguments->verify = TRUE;
+    break;
+  case ARGP_KEY_ARG: {
+    // files are only used by batch mode which may be enabled
+    // by a later option. it is checked once parsing is done
+    char **paths = realloc(arguments->paths,
+                           (arguments->paths_len + 1) * sizeof(char *));
+    if (paths == NULL) {
+      return ENOMEM;
     }
-
-    // arguments->args[state->arg_num] = arg;
-
+    arguments->paths = paths;
+    arguments->paths[arguments->paths_len++] = arg;
     break;
+  }
   case ARGP_KEY_END:
     if (state->arg_num < 0) {
       /* Not enough arguments. */
@@ -321,19 +522,34 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     }
     break;
   case NUS_BOOT:
-    arguments->op_kind = NUSBOOT;
+    if (!op_push_(arguments, NUSBOOT)) {
+      return ENOMEM;
+    }
     break;
   case NUS_LOAD:
-    arguments->op_kind = NUSLOAD;
+    if (!op_push_(arguments, NUSLOAD)) {
+      return ENOMEM;
+    }
     break;
   case NUS_DUMP:
-    arguments->op_kind = NUSDUMP;
+    if (!op_push_(arguments, NUSDUMP)) {
+      return ENOMEM;
+    }
     break;
   case NUS_RAM_WR:
-    arguments->op_kind = NUSRAMWR;
+    if (!op_push_(arguments, NUSRAMWR)) {
+      return ENOMEM;
+    }
     break;
   case NUS_RAM_RD:
-    arguments->op_kind = NUSRAMRD;
+    if (!op_push_(arguments, NUSRAMRD)) {
+      return ENOMEM;
+    }
+    break;
+  case NUS_LOAD_BOOT:
+    if (!op_push_(arguments, NUSLOADBOOT)) {
+      return ENOMEM;
+    }
     break;
   case WR_ARR:
     arguments->array_name = arg;
@@ -344,8 +560,39 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   case WR_ARRAY_TYPE:
     arguments->array_type = arg;
     break;
+  case WR_ARRAY_LINE:
+    arguments->array_per_line = atoi(arg);
+    break;
+  case RD_ARR:
+    arguments->parse_array = TRUE;
+    break;
+  case WR_ARRAY_SHARD:
+    arguments->array_shard = atoi(arg);
+    break;
+  case WR_ARRAY_ALIGN:
+    arguments->array_align = atoi(arg);
+    break;
+  case WR_ELF:
+    arguments->elf_name = arg;
+    break;
+  case WR_ELF_ARCH:
+    if (export_arch_from_name(arg, &arguments->elf_arch)) {
+      argp_error(state, "unknown architecture %s", arg);
+    }
+    break;
+  case WR_INCBIN:
+    arguments->incbin_name = arg;
+    break;
+  case WR_EMBED:
+    arguments->embed_name = arg;
+    break;
+  case WR_BIN:
+    arguments->bin_file = arg;
+    break;
   case BMP_1BPP:
-    arguments->op_kind = BMP_1BPP_OP;
+    if (!op_push_(arguments, BMP_1BPP_OP)) {
+      return ENOMEM;
+    }
     break;
   default:
     return ARGP_ERR_UNKNOWN;
@@ -355,177 +602,871 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 
 static struct argp argp = {options, parse_opt, args_doc, doc};
 
-int main(int argc, char **argv) {
-  int exit_code = 0;
-
-  struct Arguments arguments;
-  memset(&arguments, 0, sizeof(struct Arguments));
-
-  /* Default values. */
-  arguments.output_file = NULL;
-  arguments.input_file = NULL;
-  arguments.array_type = "const unsigned char";
-
-  FILE *in = stdin;
-  FILE *out = stdout;
-
-  argp_parse(&argp, argc, argv, 0, 0, &arguments); // NOLINT
+static error_t parse_recipe_(struct Arguments *arguments, const char *path) {
+  // a recipe including one that is still being parsed never ends
+  char *resolved = realpath(path, NULL);
+  usize depth = 0;
+  for (struct Recipe *r = arguments->recipes; resolved && r; r = r->next) {
+    if (r->open && strcmp(r->path, resolved) == 0) {
+      fprintf(stderr, "Recipe %s includes itself\n", path);
+      free(resolved);
+      return ELOOP;
+    }
+    depth += r->open;
+  }
+  if (depth >= RECIPE_DEPTH_MAX) {
+    fprintf(stderr, "Recipes are nested deeper than %d at %s\n",
+            RECIPE_DEPTH_MAX, path);
+    free(resolved);
+    return ELOOP;
+  }
 
-  if (arguments.input_file && strncmp(arguments.input_file, "-", 1) == 0) {
-    arguments.noinput = TRUE;
+  FILE *f = fopen(path, "re");
+  if (resolved == NULL || f == NULL) {
+    fprintf(stderr, "Unable to open %s\n", path);
+    free(resolved);
+    if (f) {
+      fclose(f);
+    }
+    return ENOENT;
   }
-  if (arguments.output_file && strncmp(arguments.output_file, "-", 1) == 0) {
-    arguments.dry = TRUE;
+
+  struct Recipe *recipe = malloc(sizeof(struct Recipe));
+  if (recipe == NULL) {
+    free(resolved);
+    fclose(f);
+    return ENOMEM;
   }
+  buffer_init(&recipe->text);
+  recipe->argv = NULL;
+  recipe->path = resolved;
+  recipe->open = FALSE;
+  recipe->next = arguments->recipes;
+  arguments->recipes = recipe;
 
-  if (arguments.output_file && !arguments.dry) {
-    out = fopen(arguments.output_file, "we");
+  Error err = buffer_read(&recipe->text, f);
+  fclose(f);
+  if (!err) {
+    err = buffer_pad_by(&recipe->text, 1, '\0');
   }
-  if (arguments.input_file && !arguments.noinput) {
-    in = fopen(arguments.input_file, "re");
+  if (err) {
+    return err == ERR_ALLOC ? ENOMEM : EIO;
   }
 
-  if (out == NULL || in == NULL) {
-    fprintf(stderr, "Unable to open file\n");
-    return -1;
+  // the first pass counts the tokens, the second one splits them
+  char *text = (char *)recipe->text.data;
+  usize argc = recipe_split(text, NULL) + 1;
+  recipe->argv = malloc((argc + 1) * sizeof(char *));
+  if (recipe->argv == NULL) {
+    return ENOMEM;
   }
+  recipe->argv[0] = (char *)path;
+  recipe_split(text, recipe->argv + 1);
+  recipe->argv[argc] = NULL;
 
-  // all actions are applied to the buffer which is read here
-  Buffer buffer;
-  buffer_init(&buffer);
-  if (!arguments.noinput) {
-    buffer_read(&buffer, in);
+  recipe->open = TRUE;
+  error_t result = argp_parse(&argp, (int)argc, recipe->argv, 0, 0, arguments);
+  recipe->open = FALSE;
+  return result;
+}
+
+static void recipes_free_(struct Recipe *recipe) {
+  while (recipe) {
+    struct Recipe *next = recipe->next;
+    buffer_free(&recipe->text);
+    free(recipe->argv);
+    free(recipe->path);
+    free(recipe);
+    recipe = next;
   }
+}
 
-  if (buffer.len < arguments.buffer_len) {
-    buffer_pad_to(&buffer, arguments.buffer_len, 0);
+// applies the header options to the header in buffer and recalculates the crc
+static void set_header_(Buffer *buffer, const struct Arguments *arguments,
+                        NusCrcCache *crc) {
+  NusHeader header;
+  buffer_materialize(buffer, NUS_IPL3_END);
+  nus_from_bytes(&header, buffer->data, buffer->len);
+
+  // modify the header if needed
+  if (arguments->nus_cfg_flags) {
+    header.cfg_flags = atoi(arguments->nus_cfg_flags);
+  }
+  if (arguments->nus_boot_addr) {
+    header.boot_addr = atoi(arguments->nus_boot_addr);
+  }
+  if (arguments->nus_clock_rate) {
+    header.clck_rate = atoi(arguments->nus_clock_rate);
+  }
+  if (arguments->nus_lu_ver) {
+    header.lu_ver = atoi(arguments->nus_lu_ver);
+  }
+  if (arguments->nus_category) {
+    header.category = arguments->nus_category;
+  }
+  if (arguments->nus_unique) {
+    header.unique[0] = arguments->nus_unique[0];
+    if (arguments->nus_unique[0] != '\0') {
+      header.unique[1] = arguments->nus_unique[1];
+    }
+  }
+  if (arguments->nus_version) {
+    header.version = arguments->nus_version;
+  }
+  if (arguments->nus_destination) {
+    header.destination = arguments->nus_destination;
+  }
+  if (arguments->nus_title) {
+    memset(header.title, 0, NUS_TITLE_LEN);
+    usize len = MIN(NUS_TITLE_LEN, strlen(arguments->nus_title));
+    strncpy(header.title, arguments->nus_title, len);
   }
 
-  switch (arguments.op_kind) {
+  nus_set_header_cached(buffer, &header, crc);
+}
+
+static int apply_op_(Buffer *buffer, const struct Arguments *arguments,
+                     const struct Op *op, NusCrcCache *crc) {
+  int exit_code = 0;
+
+  switch (op->kind) {
   case NONE:
     break;
   case PAD_TO:
-    buffer_pad_to(&buffer, arguments.op.pad_to.to, 0);
+    exit_code = buffer_pad_to(buffer, op->op.pad_to.to, 0);
     break;
   case PAD_BY:
-    buffer_pad_by(&buffer, arguments.op.pad_by.by, 0);
+    exit_code = buffer_pad_by(buffer, op->op.pad_by.by, 0);
     break;
   case SET:
-    buffer_set(&buffer, arguments.op.set.at, arguments.op.set.val,
-               arguments.op.set.len);
+    exit_code =
+        buffer_set(buffer, op->op.set.at, op->op.set.val, op->op.set.len);
     break;
   case INJECT_FILE: {
-    FILE *f = fopen(arguments.op.inject_file.path, "re");
+    FILE *f = NULL;
+    if (op->op.inject_file.path) {
+      f = fopen(op->op.inject_file.path, "re");
+    }
     if (f) {
-      buffer_inject_file(&buffer, arguments.op.inject_file.at, f);
+      exit_code = buffer_inject_file(buffer, op->op.inject_file.at, f);
+      fclose(f);
     } else {
-      fprintf(stderr, "Unable to open %s\n", arguments.op.inject_file.path);
+      fprintf(stderr, "Unable to open %s\n", op->op.inject_file.path);
+      exit_code = ERR_READ;
     }
     break;
   }
   case INJECT:
-    buffer_inject(&buffer, arguments.op.inject.at,
-                  (u8 *)arguments.op.inject.data,
-                  strlen(arguments.op.inject.data));
+    if (op->op.inject.data) {
+      exit_code =
+          buffer_inject(buffer, op->op.inject.at, (u8 *)op->op.inject.data,
+                        strlen(op->op.inject.data));
+    }
     break;
   case NUSBOOT:
-    if ((exit_code = nus_usb_boot(&buffer)) && nuss_verbose) {
+    if ((exit_code = nus_usb_boot(buffer)) && nuss_verbose) {
       fprintf(stderr, "boot failed\n");
     }
     break;
   case NUSLOAD:
-    if ((exit_code = nus_usb_load(&buffer, arguments.addr)) && nuss_verbose) {
+    if ((exit_code = nus_usb_load(buffer, arguments->addr)) && nuss_verbose) {
       fprintf(stderr, "load failed\n");
     }
     break;
   case NUSDUMP:
-    if ((exit_code = nus_usb_dump(&buffer, arguments.addr)) && nuss_verbose) {
+    if ((exit_code = nus_usb_dump(buffer, arguments->addr)) && nuss_verbose) {
       fprintf(stderr, "dump failed\n");
     }
     break;
   case NUSRAMWR:
-    if ((exit_code = nus_usb_ram_wr(&buffer, arguments.addr)) && nuss_verbose) {
+    if ((exit_code = nus_usb_ram_wr(buffer, arguments->addr)) &&
+        nuss_verbose) {
       fprintf(stderr, "write failed\n");
     }
     break;
   case NUSRAMRD:
-    if ((exit_code = nus_usb_ram_rd(&buffer, arguments.addr)) && nuss_verbose) {
+    if ((exit_code = nus_usb_ram_rd(buffer, arguments->addr)) &&
+        nuss_verbose) {
       fprintf(stderr, "read failed\n");
     }
     break;
+  case NUSLOADBOOT:
+    if ((exit_code = nus_usb_load_boot(buffer, arguments->addr)) &&
+        nuss_verbose) {
+      fprintf(stderr, "load and boot failed\n");
+    }
+    break;
   case BMP_1BPP_OP:
-    if ((exit_code = bitmap_to_1bpp(&buffer)) && nuss_verbose) {
+    buffer_materialize(buffer, (usize)-1);
+    if ((exit_code = bitmap_to_1bpp(buffer)) && nuss_verbose) {
       fprintf(stderr, "bmp conversion failed\n");
     }
     break;
+  case ADD_HEADER:
+    nus_add_header(buffer);
+    break;
+  case SET_HEADER:
+    set_header_(buffer, arguments, crc);
+    break;
+  case TRIM:
+    buffer_trim(buffer, op->op.trim.to);
+    break;
   }
 
-  if (arguments.addnush) {
-    nus_add_header(&buffer);
+  return exit_code;
+}
+
+// true if the operations change the buffer and it has to be written
+static bool modifies_(const struct Arguments *arguments) {
+  return arguments->ops_len > 0 || arguments->addnush || arguments->setnush ||
+         arguments->buffer_len > 0 || arguments->parse_array;
+}
+
+// read-only runs without output only need the start of the rom:
+// the header and boot code for printing and the crc area for verifying
+static usize input_limit_(const struct Arguments *arguments) {
+  if (modifies_(arguments) || !arguments->dry) {
+    return (usize)-1;
   }
+  if (arguments->verify) {
+    return NUS_CRC_END;
+  }
+  if (arguments->pnush) {
+    return NUS_IPL3_END;
+  }
+  return (usize)-1;
+}
+
+static void verify_fprint_(FILE *log, Error err, const NusCrc *stored,
+                           const NusCrc *computed) {
+  if (err == OK) {
+    fprintf(log, "crc ok\n");
+  } else if (err == ERR_CRC_MISMATCH) {
+    fprintf(log, "crc mismatch: stored (%x - %x) calculated (%x - %x)\n",
+            stored->crc1, stored->crc2, computed->crc1, computed->crc2);
+  } else {
+    error_fprint(log, err);
+  }
+}
 
-  if (arguments.setnush) {
+// a dump or ram read into an empty buffer that is written out as is
+// goes straight to the output instead of through the buffer
+static bool streams_(const struct Arguments *arguments) {
+  if (arguments->ops_len != 1 || !arguments->noinput || arguments->dry ||
+      arguments->buffer_len == 0) {
+    return FALSE;
+  }
+  if (arguments->addnush || arguments->setnush || arguments->pnush ||
+      arguments->parse_array || arguments->array_name ||
+      arguments->text_array_name || arguments->elf_name ||
+      arguments->incbin_name || arguments->embed_name) {
+    return FALSE;
+  }
+  enum OperationKind kind = arguments->ops[0].kind;
+  return kind == NUSDUMP || kind == NUSRAMRD;
+}
+
+// the crc is verified from the hashes taken while streaming
+static int stream_run_(const struct Arguments *arguments, FILE *out,
+                       FILE *log) {
+  NusUsbDigest digest;
+  Error err;
+  if (arguments->ops[0].kind == NUSDUMP) {
+    err = nus_usb_dump_file(out, arguments->buffer_len, arguments->addr,
+                            &digest);
+  } else {
+    err = nus_usb_ram_rd_file(out, arguments->buffer_len, arguments->addr,
+                              &digest);
+  }
+  if (err) {
+    if (nuss_verbose) {
+      fprintf(stderr, "read failed\n");
+    }
+    return err;
+  }
+  if (nuss_verbose) {
+    fprintf(stderr, "crc32 %08x\n", digest.crc32);
+  }
+
+  if (arguments->verify) {
+    err = digest.crc_err;
+    if (!err && (digest.crc.crc1 != digest.stored.crc1 ||
+                 digest.crc.crc2 != digest.stored.crc2)) {
+      err = ERR_CRC_MISMATCH;
+    }
+    verify_fprint_(log, err, &digest.stored, &digest.crc);
+  }
+  return err;
+}
+
+// runs every operation and header option on the buffer.
+// anything that is printed goes to log.
+// The crc is only recalculated from the first byte that changed
+// since crc last saw the buffer
+static int process_(Buffer *buffer, const struct Arguments *arguments,
+                    NusCrcCache *crc, FILE *log) {
+  int exit_code = 0;
+
+  if (arguments->parse_array && (exit_code = buffer_parse_array(buffer))) {
+    error_fprint(log, exit_code);
+    return exit_code;
+  }
+
+  if (buffer_len(buffer) < arguments->buffer_len &&
+      (exit_code = buffer_pad_to(buffer, arguments->buffer_len, 0))) {
+    error_fprint(log, exit_code);
+    return exit_code;
+  }
+
+  // every operation works on the same buffer,
+  // stop at the first one that fails
+  for (usize i = 0; i < arguments->ops_len && !exit_code; i++) {
+    exit_code = apply_op_(buffer, arguments, &arguments->ops[i], crc);
+  }
+
+  if (arguments->addnush) {
+    nus_add_header(buffer);
+  }
+
+  if (arguments->setnush) {
+    set_header_(buffer, arguments, crc);
+  }
+
+  if (arguments->verify) {
+    NusCrc stored;
+    NusCrc computed;
+    Error err = nus_crc_verify_cached(crc, buffer, &stored, &computed);
+    verify_fprint_(log, err, &stored, &computed);
+    if (!exit_code) {
+      exit_code = err;
+    }
+  }
+
+  if (arguments->pnush) {
     NusHeader header;
-    nus_from_bytes(&header, buffer.data, buffer.len);
+    buffer_materialize(buffer, NUS_IPL3_END);
+    nus_from_bytes(&header, buffer->data, buffer->len);
+    nus_fprint(log, &header);
+  }
+
+  return exit_code;
+}
+
+struct BatchJob {
+  char *path;
+  // where the result is written, NULL if nothing is written
+  char *dst;
+  char *log;
+  size_t log_len;
+  int exit_code;
+};
+
+struct Batch {
+  const struct Arguments *arguments;
+  struct BatchJob *jobs;
+  usize len;
+  int exit_code;
+};
+
+// the result of path is written to the output directory
+// under its name or replaces path itself
+static char *batch_dst_(const struct Arguments *arguments, const char *path) {
+  if (arguments->output_file == NULL) {
+    // the same file may be given by different paths
+    char *dst = realpath(path, NULL);
+    return dst ? dst : strdup(path);
+  }
+
+  const char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  usize len = strlen(arguments->output_file) + 1 + strlen(name) + 1;
+  char *dst = malloc(len);
+  if (dst) {
+    snprintf(dst, len, "%s/%s", arguments->output_file, name);
+  }
+  return dst;
+}
+
+// writes the buffer to a temporary file next to dst and renames it over dst.
+// the input may still be mapped, so it must never be truncated in place.
+// The result keeps the permissions of the input at path
+static Error batch_write_(const Buffer *buffer, const char *path,
+                          const char *dst) {
+  struct stat st;
+  if (stat(path, &st)) {
+    return ERR_WRITE;
+  }
 
-    // modify the header if needed
-    if (arguments.nus_cfg_flags) {
-      header.cfg_flags = atoi(arguments.nus_cfg_flags);
+  usize tmp_len = strlen(dst) + 8;
+  char *tmp = malloc(tmp_len);
+  if (tmp == NULL) {
+    return ERR_WRITE;
+  }
+  snprintf(tmp, tmp_len, "%s.XXXXXX", dst);
+
+  Error err = OK;
+  int fd = mkostemp(tmp, O_CLOEXEC);
+  FILE *f = fd < 0 ? NULL : fdopen(fd, "we");
+  if (f == NULL) {
+    err = ERR_WRITE;
+    if (fd >= 0) {
+      close(fd);
+      remove(tmp);
     }
-    if (arguments.nus_boot_addr) {
-      header.boot_addr = atoi(arguments.nus_boot_addr);
+  } else {
+    err = buffer_write(buffer, f);
+    if (!err && fchmod(fd, st.st_mode & 07777)) {
+      err = ERR_WRITE;
     }
-    if (arguments.nus_clock_rate) {
-      header.clck_rate = atoi(arguments.nus_clock_rate);
+    if (fclose(f) && !err) {
+      err = ERR_WRITE;
     }
-    if (arguments.nus_lu_ver) {
-      header.lu_ver = atoi(arguments.nus_lu_ver);
+    if (!err && rename(tmp, dst)) {
+      err = ERR_WRITE;
     }
-    if (arguments.nus_category) {
-      header.category = arguments.nus_category;
+    if (err) {
+      remove(tmp);
     }
-    if (arguments.nus_unique) {
-      header.unique[0] = arguments.nus_unique[0];
-      if (arguments.nus_unique[0] != '\0') {
-        header.unique[1] = arguments.nus_unique[1];
+  }
+
+  free(tmp);
+  return err;
+}
+
+static void batch_job_(usize index, void *ctx) {
+  struct Batch *batch = ctx;
+  const struct Arguments *arguments = batch->arguments;
+  struct BatchJob *job = &batch->jobs[index];
+
+  FILE *log = open_memstream(&job->log, &job->log_len);
+  if (log == NULL) {
+    job->exit_code = ERR_WRITE;
+    return;
+  }
+  fprintf(log, "%s:\n", job->path);
+
+  Buffer buffer;
+  buffer_init(&buffer);
+
+  FILE *in = fopen(job->path, "re");
+  if (in == NULL) {
+    job->exit_code = ERR_READ;
+  } else if (buffer_map(&buffer, in)) {
+    job->exit_code = buffer_read_max(&buffer, in, input_limit_(arguments));
+  }
+  if (in) {
+    fclose(in);
+  }
+
+  if (!job->exit_code) {
+    NusCrcCache crc;
+    nus_crc_cache_init(&crc);
+    job->exit_code = process_(&buffer, arguments, &crc, log);
+  }
+
+  if (!job->exit_code && job->dst) {
+    job->exit_code = batch_write_(&buffer, job->path, job->dst);
+  }
+
+  if (job->exit_code && job->exit_code != ERR_CRC_MISMATCH) {
+    error_fprint(log, job->exit_code);
+  }
+
+  buffer_free(&buffer);
+  fclose(log);
+}
+
+static void batch_done_(usize index, void *ctx) {
+  struct Batch *batch = ctx;
+  struct BatchJob *job = &batch->jobs[index];
+
+  if (job->log) {
+    fwrite(job->log, 1, job->log_len, stdout);
+    free(job->log);
+    job->log = NULL;
+  }
+
+  if (job->exit_code && !batch->exit_code) {
+    batch->exit_code = job->exit_code;
+  }
+}
+
+static int batch_cmp_(const void *a, const void *b) {
+  return strcmp(((const struct BatchJob *)a)->path,
+                ((const struct BatchJob *)b)->path);
+}
+
+static int batch_dst_cmp_(const void *a, const void *b) {
+  return strcmp((*(const struct BatchJob *const *)a)->dst,
+                (*(const struct BatchJob *const *)b)->dst);
+}
+
+// sets the destination of every job. Two jobs writing the same file
+// would race on it and lose one of the results, so they are rejected
+static Error batch_plan_(struct Batch *batch) {
+  const struct Arguments *arguments = batch->arguments;
+  if (arguments->dry || !modifies_(arguments) || batch->len == 0) {
+    return OK;
+  }
+
+  struct BatchJob **sorted = malloc(batch->len * sizeof(struct BatchJob *));
+  if (sorted == NULL) {
+    return ERR_WRITE;
+  }
+  Error err = OK;
+  for (usize i = 0; i < batch->len; i++) {
+    batch->jobs[i].dst = batch_dst_(arguments, batch->jobs[i].path);
+    if (batch->jobs[i].dst == NULL) {
+      err = ERR_WRITE;
+      break;
+    }
+    sorted[i] = &batch->jobs[i];
+  }
+
+  if (!err) {
+    qsort(sorted, batch->len, sizeof(struct BatchJob *), batch_dst_cmp_);
+    for (usize i = 1; i < batch->len; i++) {
+      if (strcmp(sorted[i - 1]->dst, sorted[i]->dst) == 0) {
+        fprintf(stderr, "%s and %s would both be written to %s\n",
+                sorted[i - 1]->path, sorted[i]->path, sorted[i]->dst);
+        err = ERR_WRITE;
       }
     }
-    if (arguments.nus_version) {
-      header.version = arguments.nus_version;
+  }
+
+  free(sorted);
+  return err;
+}
+
+// adds path to the batch. directories add every regular file inside them
+static void batch_add_(struct Batch *batch, const char *path) {
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+      fprintf(stderr, "Unable to open %s\n", path);
+      return;
     }
-    if (arguments.nus_destination) {
-      header.destination = arguments.nus_destination;
+
+    usize first = batch->len;
+    struct dirent *entry = NULL;
+    while ((entry = readdir(dir))) {
+      usize len = strlen(path) + 1 + strlen(entry->d_name) + 1;
+      char *child = malloc(len);
+      snprintf(child, len, "%s/%s", path, entry->d_name);
+
+      if (stat(child, &st) || !S_ISREG(st.st_mode)) {
+        free(child);
+        continue;
+      }
+      batch_add_(batch, child);
+      free(child);
     }
-    if (arguments.nus_title) {
-      memset(header.title, 0, NUS_TITLE_LEN);
-      usize len = MIN(NUS_TITLE_LEN, strlen(arguments.nus_title));
-      strncpy(header.title, arguments.nus_title, len);
+    closedir(dir);
+
+    // readdir has no defined order
+    qsort(batch->jobs + first, batch->len - first, sizeof(struct BatchJob),
+          batch_cmp_);
+    return;
+  }
+
+  struct BatchJob *jobs =
+      realloc(batch->jobs, (batch->len + 1) * sizeof(struct BatchJob));
+  if (jobs == NULL) {
+    return;
+  }
+  batch->jobs = jobs;
+
+  struct BatchJob *job = &batch->jobs[batch->len++];
+  memset(job, 0, sizeof(struct BatchJob));
+  job->path = strdup(path);
+}
+
+static int batch_run_(const struct Arguments *arguments) {
+  for (usize i = 0; i < arguments->ops_len; i++) {
+    switch (arguments->ops[i].kind) {
+    case NUSBOOT:
+    case NUSLOAD:
+    case NUSDUMP:
+    case NUSRAMRD:
+    case NUSRAMWR:
+    case NUSLOADBOOT:
+      fprintf(stderr, "usb operations are not supported in batch mode\n");
+      return -1;
+    default:
+      break;
     }
+  }
+
+  struct Batch batch;
+  memset(&batch, 0, sizeof(struct Batch));
+  batch.arguments = arguments;
 
-    nus_set_header(&buffer, &header);
+  for (usize i = 0; i < arguments->paths_len; i++) {
+    batch_add_(&batch, arguments->paths[i]);
   }
 
-  if (arguments.pnush) {
-    NusHeader header;
-    nus_from_bytes(&header, buffer.data, buffer.len);
-    nus_fprint(stdout, &header);
+  Error err = batch_plan_(&batch);
+  if (err) {
+    batch.exit_code = err;
+  } else {
+    usize threads =
+        arguments->jobs ? arguments->jobs : pool_default_threads();
+    err = pool_run(batch.len, threads, batch_job_, batch_done_, &batch);
+    if (err) {
+      error_fprint(stderr, err);
+      batch.exit_code = err;
+    }
+  }
+
+  for (usize i = 0; i < batch.len; i++) {
+    free(batch.jobs[i].path);
+    free(batch.jobs[i].dst);
+    free(batch.jobs[i].log);
+  }
+  free(batch.jobs);
+
+  return batch.exit_code;
+}
+
+// applies the operations to a mapping of the file
+// and only writes the ranges that changed back to it
+static int inplace_run_(const struct Arguments *arguments) {
+  FILE *f = fopen(arguments->inplace_file, "r+e");
+  if (f == NULL) {
+    fprintf(stderr, "Unable to open %s\n", arguments->inplace_file);
+    return ERR_READ;
+  }
+
+  Buffer buffer;
+  buffer_init(&buffer);
+  int exit_code = buffer_map(&buffer, f);
+  fclose(f);
+  if (exit_code) {
+    fprintf(stderr, "Unable to map %s\n", arguments->inplace_file);
+    return exit_code;
+  }
+
+  // the checkpoints of the last run on the file are reused,
+  // so a small patch only rehashes the blocks after it
+  NusCrcCache crc;
+  nus_crc_cache_init(&crc);
+  if (nus_crc_cache_load(&crc, &buffer) == OK && nuss_verbose) {
+    fprintf(stderr, "Reusing the crc checkpoints of the last run\n");
+  }
+  exit_code = process_(&buffer, arguments, &crc, stdout);
+
+  if (!exit_code && !arguments->dry) {
+    usize written = 0;
+    exit_code = nus_crc_cache_sync(&crc, &buffer, &written);
+    if (nuss_verbose) {
+      fprintf(stderr, "Wrote %li of %li bytes\n", written,
+              buffer_len(&buffer));
+    }
+  }
+
+  buffer_free(&buffer);
+  return exit_code;
+}
+
+// shards are written next to the output file,
+// named after it without its extension
+static Error write_shards_(const Buffer *buffer,
+                           const struct Arguments *arguments, FILE *header,
+                           const BufferArrayFmt *fmt) {
+  if (arguments->output_file == NULL) {
+    fprintf(stderr, "--warrshard needs an output file\n");
+    return ERR_WRITE;
+  }
+
+  char *prefix = strdup(arguments->output_file);
+  if (prefix == NULL) {
+    return ERR_WRITE;
+  }
+  char *ext = strrchr(prefix, '.');
+  if (ext && !strchr(ext, '/')) {
+    *ext = '\0';
+  }
+
+  Error err = export_shards(buffer, header, prefix, arguments->array_name,
+                            arguments->array_type, fmt, arguments->array_shard,
+                            arguments->array_align);
+  free(prefix);
+  return err;
+}
+
+// the binary included by --wincbin and --wembed.
+// It is written to --wbin, without it the input has to be unmodified.
+// The path is absolute since the assembler or compiler resolves it
+// relative to its own working directory. Free it when done
+static char *export_bin_(const Buffer *buffer,
+                         const struct Arguments *arguments) {
+  if (arguments->bin_file) {
+    FILE *f = fopen(arguments->bin_file, "we");
+    Error err = f ? buffer_write(buffer, f) : ERR_WRITE;
+    if (f && fclose(f)) {
+      err = ERR_WRITE;
+    }
+    return err ? NULL : realpath(arguments->bin_file, NULL);
+  }
+
+  struct stat st;
+  if (arguments->input_file && buffer->src_fd >= 0 &&
+      buffer->dirty_len == 0 && !fstat(buffer->src_fd, &st) &&
+      (usize)st.st_size == buffer_len(buffer)) {
+    return realpath(arguments->input_file, NULL);
+  }
+
+  fprintf(stderr, "The input was modified, use --wbin to write it\n");
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int exit_code = 0;
+
+  struct Arguments arguments;
+  memset(&arguments, 0, sizeof(struct Arguments));
+
+  /* Default values. */
+  arguments.output_file = NULL;
+  arguments.input_file = NULL;
+  arguments.array_type = "const unsigned char";
+
+  FILE *in = stdin;
+  FILE *out = stdout;
+
+  nuss_session = getenv("NUSS_SESSION");
+  nuss_transport = getenv("NUSS_TRANSPORT");
+  // errors of recipes were already reported
+  if (argp_parse(&argp, argc, argv, 0, 0, &arguments)) { // NOLINT
+    free(arguments.ops);
+    recipes_free_(arguments.recipes);
+    return -1;
   }
+
+  if (arguments.daemon_socket) {
+    nuss_session = NULL;
+    exit_code = nus_session_serve(arguments.daemon_socket);
+    free(arguments.ops);
+    recipes_free_(arguments.recipes);
+    return exit_code;
+  }
+
+  if (arguments.input_file && strncmp(arguments.input_file, "-", 1) == 0) {
+    arguments.noinput = TRUE;
+  }
+  if (arguments.output_file && strncmp(arguments.output_file, "-", 1) == 0) {
+    arguments.dry = TRUE;
+  }
+
+  if (arguments.batch) {
+    exit_code = batch_run_(&arguments);
+    free(arguments.ops);
+    free(arguments.paths);
+    recipes_free_(arguments.recipes);
+    return exit_code;
+  }
+
+  if (arguments.paths_len) {
+    fprintf(stderr, "Files are only accepted by --batch\n");
+    return -1;
+  }
+
+  if (arguments.inplace_file) {
+    exit_code = inplace_run_(&arguments);
+    free(arguments.ops);
+    recipes_free_(arguments.recipes);
+    return exit_code;
+  }
+
+  if (arguments.output_file && !arguments.dry) {
+    out = fopen(arguments.output_file, "we");
+  }
+  if (arguments.input_file && !arguments.noinput) {
+    in = fopen(arguments.input_file, "re");
+  }
+
+  if (out == NULL || in == NULL) {
+    fprintf(stderr, "Unable to open file\n");
+    return -1;
+  }
+
+  if (streams_(&arguments)) {
+    exit_code = stream_run_(&arguments, out, stdout);
+    nus_stats_print(nus_usb_stats(), stderr, nuss_stats);
+    free(arguments.ops);
+    recipes_free_(arguments.recipes);
+    if (arguments.output_file) {
+      fclose(out);
+    }
+    return exit_code;
+  }
+
+  // all actions are applied to the buffer which is read here
+  Buffer buffer;
+  buffer_init(&buffer);
+  if (!arguments.noinput) {
+    // files are mapped so read-only operations never copy the input,
+    // stdin and anything that cannot be mapped is read instead
+    if (!arguments.input_file || buffer_map(&buffer, in)) {
+      buffer_read_max(&buffer, in, input_limit_(&arguments));
+    }
+  }
+
+  NusCrcCache crc;
+  nus_crc_cache_init(&crc);
+  exit_code = process_(&buffer, &arguments, &crc, stdout);
+  nus_stats_print(nus_usb_stats(), stderr, nuss_stats);
+
+  // output that refers to a binary is useless without it
+  bool drop_output = FALSE;
   if (!arguments.dry) {
-    if (arguments.array_name) {
+    Error err = OK;
+    if (arguments.array_name && arguments.array_shard) {
+      BufferArrayFmt fmt = {arguments.array_per_line, arguments.jobs};
+      err = write_shards_(&buffer, &arguments, out, &fmt);
+    } else if (arguments.array_name) {
+      BufferArrayFmt fmt = {arguments.array_per_line, arguments.jobs};
       buffer_write_array(&buffer, out, arguments.array_name,
-                         arguments.array_type);
+                         arguments.array_type, &fmt);
+    } else if (arguments.elf_name) {
+      err = export_elf(&buffer, out, arguments.elf_name, arguments.elf_arch);
+    } else if (arguments.incbin_name || arguments.embed_name) {
+      char *bin = export_bin_(&buffer, &arguments);
+      if (bin == NULL) {
+        err = ERR_WRITE;
+      } else if (arguments.incbin_name) {
+        err = export_incbin(&buffer, out, arguments.incbin_name, bin);
+      } else {
+        err = export_embed(&buffer, out, arguments.embed_name,
+                           arguments.array_type, bin);
+      }
+      free(bin);
+      drop_output = err != OK;
     } else if (arguments.text_array_name) {
+      buffer_materialize(&buffer, (usize)-1);
       buffer_write_text_array(&buffer, out, arguments.text_array_name,
                               arguments.array_type);
     } else {
       buffer_write(&buffer, out);
     }
+    if (!exit_code) {
+      exit_code = err;
+    }
   }
 
   buffer_free(&buffer);
+  free(arguments.ops);
+  recipes_free_(arguments.recipes);
 
   if (arguments.output_file) {
+    struct stat st;
+    drop_output =
+        drop_output && !fstat(fileno(out), &st) && S_ISREG(st.st_mode);
     fclose(out);
+    if (drop_output) {
+      remove(arguments.output_file);
+    }
   }
   if (arguments.input_file) {
     fclose(in);
@@ -545,11 +1486,54 @@ int main(int argc, char **argv) {
 #include "macros.h"
 #include "nusheader.h"
 #include "buffer.h"
+#include "pool.h"
+#include "nuscrc.h"
+#include "export.h"
+#include "nusmanifest.h"
+#include "nusstats.h"
+#include "nustransport.h"
+#include "nusemu.h"
+#include "nususb.h"
+#include "session.h"
+#include "recipe.h"
 
 int main(int argc, char **argv) {
+  // test read block|bytewise times a reader on stdin, see make benchread
+  if (argc == 3 && strcmp(argv[1], "read") == 0) {
+    return buffer_bench_read(stdin, stdout, strcmp(argv[2], "bytewise") == 0);
+  }
+
   const struct CMUnitTest tests[] = {cmocka_unit_test(test_crc_fail),
                                      cmocka_unit_test(test_crc),
-                                     cmocka_unit_test(test_bmp1_converter)};
+                                     cmocka_unit_test(test_crc_stream),
+                                     cmocka_unit_test(test_crc_cache),
+                                     cmocka_unit_test(test_crc_cache_file),
+                                     cmocka_unit_test(test_bmp1_converter),
+                                     cmocka_unit_test(test_buffer_read),
+                                     cmocka_unit_test(test_buffer_map),
+                                     cmocka_unit_test(test_buffer_grow),
+                                     cmocka_unit_test(test_buffer_dirty),
+                                     cmocka_unit_test(test_buffer_sparse),
+                                     cmocka_unit_test(test_buffer_write_src),
+                                     cmocka_unit_test(test_buffer_sync),
+                                     cmocka_unit_test(test_buffer_array),
+                                     cmocka_unit_test(test_buffer_parse_array),
+                                     cmocka_unit_test(test_export_elf),
+                                     cmocka_unit_test(test_export_text),
+                                     cmocka_unit_test(test_export_shards),
+                                     cmocka_unit_test(test_nus_manifest),
+                                     cmocka_unit_test(test_nus_manifest_file),
+                                     cmocka_unit_test(test_nus_stats),
+                                     cmocka_unit_test(test_nus_transport_init),
+                                     cmocka_unit_test(test_nus_emu),
+                                     cmocka_unit_test(test_nus_usb_emu),
+                                     cmocka_unit_test(test_nus_session_path),
+                                     cmocka_unit_test(test_nus_session_stream),
+                                     cmocka_unit_test(test_pool),
+                                     cmocka_unit_test(test_crc_kernels),
+                                     cmocka_unit_test(test_cic),
+                                     cmocka_unit_test(test_crc_cic),
+                                     cmocka_unit_test(test_recipe_split)};
   return cmocka_run_group_tests(tests, NULL, NULL);
 }
 
@@ -0,0 +1,488 @@
+#include "nuscrc.h"
+#include <string.h>
+#include <stdlib.h>
+#include "macros.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                              \
+    (defined(__GNUC__) || defined(__clang__))
+#define NUS_CRC_X86
+#include <immintrin.h>
+#endif
+
+void nus_crc_state_init(NusCrcState *state, u32 seed) {
+  state->t2 = seed;
+  state->t3 = seed;
+  state->a2 = seed;
+  state->t4 = seed;
+  state->crc1 = seed;
+  state->crc2 = seed;
+}
+
+static u32 load_be_(const u8 *data) {
+  u32 word = 0;
+  memcpy(&word, data, sizeof(u32));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  word = __builtin_bswap32(word);
+#endif
+  return word;
+}
+
+static u32 rotl_(u32 word, u32 n) {
+  n &= 0x1f;                                   // NOLINT
+  return (word << n) | (word >> ((32 - n) & 0x1f)); // NOLINT
+}
+
+void nus_crc_kernel_scalar(NusCrcState *state, const u8 *data, usize len) {
+  NusCrcState s = *state;
+
+  for (usize idx = 0; idx + 4 <= len; idx += 4) {
+    // take the next 4 bytes and convert them to
+    // a native integer
+    u32 current_data = load_be_(data + idx);
+
+    u32 a1 = s.crc1 + current_data;
+
+    if (a1 < s.crc1) {
+      s.t2 = s.t2 + 1;
+    }
+
+    u32 a0 = rotl_(current_data, current_data);
+    s.crc1 = a1;
+
+    s.t3 ^= current_data;
+
+    s.crc2 = s.crc2 + a0;
+
+    if (s.a2 < current_data) {
+      s.a2 ^= s.crc1 ^ current_data;
+    } else {
+      s.a2 ^= a0;
+    }
+
+    s.t4 = s.t4 + (current_data ^ s.crc2);
+  }
+
+  *state = s;
+}
+
+void nus_crc_kernel_6105(NusCrcState *state, const u8 *data, usize len,
+                         const u8 *key, usize offset) {
+  NusCrcState s = *state;
+
+  for (usize idx = 0; idx + 4 <= len; idx += 4) {
+    u32 current_data = load_be_(data + idx);
+
+    u32 a1 = s.crc1 + current_data;
+    if (a1 < s.crc1) {
+      s.t2 = s.t2 + 1;
+    }
+
+    u32 a0 = rotl_(current_data, current_data);
+    s.crc1 = a1;
+    s.t3 ^= current_data;
+    s.crc2 = s.crc2 + a0;
+
+    if (s.a2 < current_data) {
+      s.a2 ^= s.crc1 ^ current_data;
+    } else {
+      s.a2 ^= a0;
+    }
+
+    // instead of crc2 the key is mixed in
+    s.t4 = s.t4 + (load_be_(key + ((offset + idx) & 0xFF)) ^ current_data);
+  }
+
+  *state = s;
+}
+
+static const u32 crc32_table_[256] = {
+    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+    0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+    0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+    0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+    0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+    0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+    0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+    0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+    0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+    0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+    0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+    0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+    0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+    0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+    0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+    0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+    0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+    0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+    0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+    0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+    0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+    0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+    0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+    0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+    0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+    0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+    0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+    0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+    0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+    0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D,
+};
+
+u32 nus_crc32(u32 crc, const u8 *data, usize len) {
+  crc = ~crc;
+  for (usize i = 0; i < len; i++) {
+    crc = crc32_table_[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// CRC-32 of the boot code (0x40-0x1000) of every known cic
+static const struct {
+  u32 hash;
+  NusCic cic;
+} cic_table_[] = {
+    {0x6170A4A1, NUS_CIC_6101}, {0x90BB6CB5, NUS_CIC_6102},
+    {0x0B050EE0, NUS_CIC_6103}, {0x98BC2C86, NUS_CIC_6105},
+    {0xACC8580A, NUS_CIC_6106},
+};
+
+NusCic nus_cic_from_hash(u32 hash) {
+  for (usize i = 0; i < sizeof(cic_table_) / sizeof(cic_table_[0]); i++) {
+    if (cic_table_[i].hash == hash) {
+      return cic_table_[i].cic;
+    }
+  }
+  return NUS_CIC_UNKNOWN;
+}
+
+NusCic nus_cic_identify(const u8 *data, usize len) {
+  if (len < NUS_IPL3_END) {
+    return NUS_CIC_UNKNOWN;
+  }
+  return nus_cic_from_hash(
+      nus_crc32(0, data + NUS_IPL3_START, NUS_IPL3_END - NUS_IPL3_START));
+}
+
+u32 nus_cic_seed(NusCic cic) {
+  switch (cic) {
+  case NUS_CIC_6103:
+    return 0xA3886759;
+  case NUS_CIC_6105:
+    return 0xDF26F436;
+  case NUS_CIC_6106:
+    return 0x1FEA617A;
+  default:
+    return 0xF8CA4DDC;
+  }
+}
+
+#ifdef NUS_CRC_X86
+
+// words the vector kernels compute before a2 is folded over them
+#define NUS_CRC_LANE_WORDS 64
+
+// a2 is the only part of the state that depends on itself in a data
+// dependent way. The vector lanes compute the two values it may be
+// xored with, this loop only picks one per word
+static inline u32 nus_crc_a2_(u32 a2, const u32 *d, const u32 *taken,
+                              const u32 *rot, usize words) {
+  for (usize i = 0; i < words; i++) {
+    // both results are computed next to the comparison so only
+    // a conditional move is left on the chain. compilers turn the
+    // select into a branch, which mispredicts about half of the time
+    u32 if_less = a2 ^ taken[i];
+    u32 next = a2 ^ rot[i];
+    __asm__("cmpl %[d], %[a2]\n\t"
+            "cmovb %[if_less], %[next]"
+            : [next] "+r"(next)
+            : [a2] "r"(a2), [d] "rm"(d[i]), [if_less] "r"(if_less)
+            : "cc");
+    a2 = next;
+  }
+  return a2;
+}
+
+__attribute__((target("sse4.1"))) void
+nus_crc_kernel_sse41(NusCrcState *state, const u8 *data, usize len) {
+  const __m128i bswap =
+      _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  const __m128i one = _mm_set1_epi32(0x3f800000); // 1.0f
+  const __m128i mask = _mm_set1_epi32(0x1f);
+  const __m128i bias = _mm_set1_epi32((int)0x80000000);
+
+  usize blocks = len / 16;
+
+  __m128i t2 = _mm_setzero_si128();
+  __m128i t3 = _mm_setzero_si128();
+  __m128i t4 = _mm_setzero_si128();
+  __m128i crc1 = _mm_set1_epi32((int)state->crc1);
+  __m128i crc2 = _mm_set1_epi32((int)state->crc2);
+  u32 a2 = state->a2;
+
+  u32 d_words[NUS_CRC_LANE_WORDS];
+  u32 taken[NUS_CRC_LANE_WORDS];
+  u32 rot[NUS_CRC_LANE_WORDS];
+
+  for (usize b = 0; b < blocks;) {
+    usize run = MIN(blocks - b, NUS_CRC_LANE_WORDS / 4);
+    for (usize r = 0; r < run; r++, b++) {
+      __m128i d = _mm_loadu_si128((const __m128i *)(data + b * 16));
+      d = _mm_shuffle_epi8(d, bswap);
+
+      // rotate left by d & 31. sse has no variable shifts so
+      // multiply by 2^n in 64 bits and fold the high half back in.
+      // 2^n is built as a float, 2^31 converts to 0x80000000 as needed
+      __m128i n = _mm_and_si128(d, mask);
+      __m128i pow = _mm_cvtps_epi32(
+          _mm_castsi128_ps(_mm_add_epi32(_mm_slli_epi32(n, 23), one)));
+      __m128i even = _mm_mul_epu32(d, pow);
+      __m128i odd =
+          _mm_mul_epu32(_mm_srli_epi64(d, 32), _mm_srli_epi64(pow, 32));
+      even = _mm_or_si128(even, _mm_srli_epi64(even, 32));
+      odd = _mm_or_si128(odd, _mm_srli_epi64(odd, 32));
+      __m128i a0 = _mm_blend_epi16(even, _mm_slli_epi64(odd, 32), 0xCC);
+
+      t3 = _mm_xor_si128(t3, d);
+
+      // prefix sum of d gives crc1 after every word.
+      // the sum wrapped wherever it is below the one before it
+      __m128i p1 = _mm_add_epi32(d, _mm_slli_si128(d, 4));
+      p1 = _mm_add_epi32(p1, _mm_slli_si128(p1, 8));
+      p1 = _mm_add_epi32(p1, crc1);
+      __m128i before = _mm_alignr_epi8(p1, crc1, 12);
+      __m128i wrapped = _mm_cmpgt_epi32(_mm_xor_si128(before, bias),
+                                        _mm_xor_si128(p1, bias));
+      t2 = _mm_sub_epi32(t2, wrapped);
+      crc1 = _mm_shuffle_epi32(p1, 0xFF);
+
+      // prefix sum of a0 gives crc2 after every word
+      __m128i p2 = _mm_add_epi32(a0, _mm_slli_si128(a0, 4));
+      p2 = _mm_add_epi32(p2, _mm_slli_si128(p2, 8));
+      p2 = _mm_add_epi32(p2, crc2);
+      crc2 = _mm_shuffle_epi32(p2, 0xFF);
+
+      t4 = _mm_add_epi32(t4, _mm_xor_si128(d, p2));
+
+      _mm_storeu_si128((__m128i *)(d_words + r * 4), d);
+      _mm_storeu_si128((__m128i *)(taken + r * 4), _mm_xor_si128(p1, d));
+      _mm_storeu_si128((__m128i *)(rot + r * 4), a0);
+    }
+    a2 = nus_crc_a2_(a2, d_words, taken, rot, run * 4);
+  }
+
+  u32 lanes[4];
+  _mm_storeu_si128((__m128i *)lanes, t2);
+  state->t2 += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  _mm_storeu_si128((__m128i *)lanes, t3);
+  state->t3 ^= lanes[0] ^ lanes[1] ^ lanes[2] ^ lanes[3];
+  _mm_storeu_si128((__m128i *)lanes, t4);
+  state->t4 += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  state->crc1 = (u32)_mm_cvtsi128_si32(crc1);
+  state->crc2 = (u32)_mm_cvtsi128_si32(crc2);
+  state->a2 = a2;
+
+  nus_crc_kernel_scalar(state, data + blocks * 16, len - blocks * 16);
+}
+
+__attribute__((target("avx2"))) void
+nus_crc_kernel_avx2(NusCrcState *state, const u8 *data, usize len) {
+  const __m256i bswap = _mm256_set_epi8(
+      12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3, 12, 13, 14, 15, 8,
+      9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  const __m256i mask = _mm256_set1_epi32(0x1f);
+  const __m256i bits = _mm256_set1_epi32(32);
+  const __m256i last_lo = _mm256_set1_epi32(3);
+  const __m256i last = _mm256_set1_epi32(7);
+  const __m256i upper = _mm256_set_epi32(-1, -1, -1, -1, 0, 0, 0, 0);
+  const __m256i previous = _mm256_set_epi32(6, 5, 4, 3, 2, 1, 0, 7);
+  const __m256i bias = _mm256_set1_epi32((int)0x80000000);
+
+  usize blocks = len / 32;
+
+  __m256i t2 = _mm256_setzero_si256();
+  __m256i t3 = _mm256_setzero_si256();
+  __m256i t4 = _mm256_setzero_si256();
+  __m256i crc1 = _mm256_set1_epi32((int)state->crc1);
+  __m256i crc2 = _mm256_set1_epi32((int)state->crc2);
+  u32 a2 = state->a2;
+
+  u32 d_words[NUS_CRC_LANE_WORDS];
+  u32 taken[NUS_CRC_LANE_WORDS];
+  u32 rot[NUS_CRC_LANE_WORDS];
+
+  for (usize b = 0; b < blocks;) {
+    usize run = MIN(blocks - b, NUS_CRC_LANE_WORDS / 8);
+    for (usize r = 0; r < run; r++, b++) {
+      __m256i d = _mm256_loadu_si256((const __m256i *)(data + b * 32));
+      d = _mm256_shuffle_epi8(d, bswap);
+
+      // a shift by 32 yields 0 which is what rotating by 0 needs
+      __m256i n = _mm256_and_si256(d, mask);
+      __m256i a0 =
+          _mm256_or_si256(_mm256_sllv_epi32(d, n),
+                          _mm256_srlv_epi32(d, _mm256_sub_epi32(bits, n)));
+
+      t3 = _mm256_xor_si256(t3, d);
+
+      // prefix sums within each 128 bit half,
+      // then carry the lower half into the upper one
+      __m256i p1 = _mm256_add_epi32(d, _mm256_slli_si256(d, 4));
+      p1 = _mm256_add_epi32(p1, _mm256_slli_si256(p1, 8));
+      p1 = _mm256_add_epi32(p1, _mm256_and_si256(
+                                    _mm256_permutevar8x32_epi32(p1, last_lo),
+                                    upper));
+      p1 = _mm256_add_epi32(p1, crc1);
+      // crc1 before every word, the sum wrapped where it went down
+      __m256i before = _mm256_blend_epi32(
+          _mm256_permutevar8x32_epi32(p1, previous), crc1, 0x01);
+      __m256i wrapped = _mm256_cmpgt_epi32(_mm256_xor_si256(before, bias),
+                                           _mm256_xor_si256(p1, bias));
+      t2 = _mm256_sub_epi32(t2, wrapped);
+      crc1 = _mm256_permutevar8x32_epi32(p1, last);
+
+      __m256i p2 = _mm256_add_epi32(a0, _mm256_slli_si256(a0, 4));
+      p2 = _mm256_add_epi32(p2, _mm256_slli_si256(p2, 8));
+      p2 = _mm256_add_epi32(p2, _mm256_and_si256(
+                                    _mm256_permutevar8x32_epi32(p2, last_lo),
+                                    upper));
+      p2 = _mm256_add_epi32(p2, crc2);
+      crc2 = _mm256_permutevar8x32_epi32(p2, last);
+
+      t4 = _mm256_add_epi32(t4, _mm256_xor_si256(d, p2));
+
+      _mm256_storeu_si256((__m256i *)(d_words + r * 8), d);
+      _mm256_storeu_si256((__m256i *)(taken + r * 8), _mm256_xor_si256(p1, d));
+      _mm256_storeu_si256((__m256i *)(rot + r * 8), a0);
+    }
+    a2 = nus_crc_a2_(a2, d_words, taken, rot, run * 8);
+  }
+
+  u32 lanes[8];
+  _mm256_storeu_si256((__m256i *)lanes, t2);
+  for (usize i = 0; i < 8; i++) {
+    state->t2 += lanes[i];
+  }
+  _mm256_storeu_si256((__m256i *)lanes, t3);
+  for (usize i = 0; i < 8; i++) {
+    state->t3 ^= lanes[i];
+  }
+  _mm256_storeu_si256((__m256i *)lanes, t4);
+  for (usize i = 0; i < 8; i++) {
+    state->t4 += lanes[i];
+  }
+  state->crc1 = (u32)_mm256_cvtsi256_si32(crc1);
+  state->crc2 = (u32)_mm256_cvtsi256_si32(crc2);
+  state->a2 = a2;
+
+  nus_crc_kernel_scalar(state, data + blocks * 32, len - blocks * 32);
+}
+
+// the sse4.1 kernel is not faster than the scalar one,
+// its rotate costs more than the lanes save
+NusCrcKernel nus_crc_kernel(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return nus_crc_kernel_avx2;
+  }
+  return nus_crc_kernel_scalar;
+}
+
+#else
+
+void nus_crc_kernel_sse41(NusCrcState *state, const u8 *data, usize len) {
+  nus_crc_kernel_scalar(state, data, len);
+}
+
+void nus_crc_kernel_avx2(NusCrcState *state, const u8 *data, usize len) {
+  nus_crc_kernel_scalar(state, data, len);
+}
+
+NusCrcKernel nus_crc_kernel(void) { return nus_crc_kernel_scalar; }
+
+#endif
+
+#ifdef TEST
+
+static void crc_kernel_check_(NusCrcKernel kernel, const u8 *data, usize len) {
+  NusCrcState expected;
+  NusCrcState result;
+
+  nus_crc_state_init(&expected, 0xF8CA4DDC);
+  nus_crc_kernel_scalar(&expected, data, len);
+
+  nus_crc_state_init(&result, 0xF8CA4DDC);
+  kernel(&result, data, len);
+  assert_memory_equal(&expected, &result, sizeof(NusCrcState));
+
+  // resuming from an intermediate state has to give the same result
+  usize split = (len / 3) & ~(usize)3;
+  nus_crc_state_init(&result, 0xF8CA4DDC);
+  kernel(&result, data, split);
+  kernel(&result, data + split, len - split);
+  assert_memory_equal(&expected, &result, sizeof(NusCrcState));
+}
+
+void test_crc_kernels(void **state) {
+  const usize len = 0x100000 + 0x1c;
+  u8 *data = malloc(len);
+  u32 x = 0x12345678;
+  for (usize i = 0; i < len; i++) {
+    // xorshift, any pattern that hits every rotation will do
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    data[i] = (u8)x;
+  }
+
+  usize lens[] = {0, 4, 12, 28, 36, 100, 300, 1000, len};
+  for (usize i = 0; i < sizeof(lens) / sizeof(usize); i++) {
+    crc_kernel_check_(nus_crc_kernel_scalar, data, lens[i]);
+    crc_kernel_check_(nus_crc_kernel(), data, lens[i]);
+#ifdef NUS_CRC_X86
+    if (__builtin_cpu_supports("sse4.1")) {
+      crc_kernel_check_(nus_crc_kernel_sse41, data, lens[i]);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      crc_kernel_check_(nus_crc_kernel_avx2, data, lens[i]);
+    }
+#endif
+  }
+
+  free(data);
+}
+
+void test_cic(void **state) {
+  assert_int_equal(0xCBF43926, nus_crc32(0, (const u8 *)"123456789", 9));
+  // hashing in pieces gives the same result
+  assert_int_equal(0xCBF43926,
+                   nus_crc32(nus_crc32(0, (const u8 *)"1234", 4),
+                             (const u8 *)"56789", 5));
+
+  assert_int_equal(NUS_CIC_6102, nus_cic_from_hash(0x90BB6CB5));
+  assert_int_equal(NUS_CIC_6105, nus_cic_from_hash(0x98BC2C86));
+  assert_int_equal(NUS_CIC_UNKNOWN, nus_cic_from_hash(0));
+
+  u8 data[NUS_IPL3_END];
+  memset(data, 0, sizeof(data));
+  assert_int_equal(NUS_CIC_UNKNOWN, nus_cic_identify(data, sizeof(data)));
+  assert_int_equal(NUS_CIC_UNKNOWN, nus_cic_identify(data, 0x100));
+
+  assert_int_equal(0xF8CA4DDC, nus_cic_seed(NUS_CIC_UNKNOWN));
+  assert_int_equal(0xF8CA4DDC, nus_cic_seed(NUS_CIC_6101));
+  assert_int_equal(0xDF26F436, nus_cic_seed(NUS_CIC_6105));
+}
+
+#endif
@@ -0,0 +1,373 @@
+#include "nusemu.h"
+#include "nustransport.h"
+#include "macros.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// commands are padded to this size, only the first 16 bytes are used.
+// Writes send their data right after those 16 bytes
+#define NUS_EMU_CMD_LEN 512
+#define NUS_EMU_CMD_HEAD 16
+#define NUS_EMU_BLOCK 512
+// large writes cross the link in usb transfers of this size
+#define NUS_EMU_TRANSFER 0x10000
+
+static u8 *emu_rom_ = NULL;
+static u8 *emu_ram_ = NULL;
+static NusEmuStats emu_stats_;
+
+// the state of one connection to the cart
+typedef struct NusEmuLink { // NOLINT
+  u8 head[NUS_EMU_CMD_HEAD];
+  usize head_len;
+  // padding of the current command that is still to come
+  usize skip;
+  // data of the current write that is still to come,
+  // the part that does not fit into memory is dropped
+  usize data_left;
+  u8 *dst;
+  usize dst_left;
+  // replies that were not read yet
+  u8 *out;
+  usize out_pos;
+  usize out_len;
+  usize out_cap;
+  // when the link is free again
+  struct timespec deadline;
+} NusEmuLink;
+
+const NusEmuStats *nus_emu_stats(void) { return &emu_stats_; }
+
+// memory at addr, len is cut to the end of the region
+static u8 *emu_span_(u32 addr, usize *len) {
+  u8 *base = NULL;
+  u64 offset = 0;
+  u64 size = 0;
+  if (addr >= NUS_EMU_ROM_ADDR && addr - NUS_EMU_ROM_ADDR < NUS_EMU_ROM_LEN) {
+    base = emu_rom_;
+    offset = addr - NUS_EMU_ROM_ADDR;
+    size = NUS_EMU_ROM_LEN;
+  } else if (addr >= NUS_EMU_RAM_ADDR &&
+             addr - NUS_EMU_RAM_ADDR < NUS_EMU_RAM_LEN) {
+    base = emu_ram_;
+    offset = addr - NUS_EMU_RAM_ADDR;
+    size = NUS_EMU_RAM_LEN;
+  }
+  if (base == NULL) {
+    *len = 0;
+    return NULL;
+  }
+  *len = MIN(*len, size - offset);
+  return base + offset;
+}
+
+u8 *nus_emu_memory(u32 addr, usize len) {
+  usize fit = len;
+  u8 *p = emu_span_(addr, &fit);
+  return fit == len ? p : NULL;
+}
+
+void nus_emu_reset(void) {
+  free(emu_rom_);
+  free(emu_ram_);
+  emu_rom_ = NULL;
+  emu_ram_ = NULL;
+  memset(&emu_stats_, 0, sizeof(emu_stats_));
+}
+
+// lets the link be busy for one transfer of len bytes
+static void emu_wait_(NusTransport *transport, usize len) {
+  if (!transport->bandwidth && !transport->latency_us) {
+    return;
+  }
+  NusEmuLink *link = transport->ctx;
+
+  u64 ns = transport->latency_us * 1000;
+  if (transport->bandwidth) {
+    ns += (u64)len * 1000000000ULL / transport->bandwidth;
+  }
+
+  // transfers queue up behind each other, short ones
+  // are not rounded up to the resolution of the sleep
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (link->deadline.tv_sec < now.tv_sec ||
+      (link->deadline.tv_sec == now.tv_sec &&
+       link->deadline.tv_nsec < now.tv_nsec)) {
+    link->deadline = now;
+  }
+  u64 nsec = (u64)link->deadline.tv_nsec + ns;
+  link->deadline.tv_sec += (time_t)(nsec / 1000000000ULL);
+  link->deadline.tv_nsec = (long)(nsec % 1000000000ULL);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &link->deadline,
+                         NULL) == EINTR) {
+  }
+}
+
+static Error emu_reply_(NusEmuLink *link, const u8 *data, usize len) {
+  if (link->out_pos == link->out_len) {
+    link->out_pos = 0;
+    link->out_len = 0;
+  }
+  if (link->out_len + len > link->out_cap) {
+    usize cap = MAX(link->out_cap * 2, link->out_len + len);
+    u8 *out = realloc(link->out, cap);
+    if (out == NULL) {
+      return ERR_NUS_USB;
+    }
+    link->out = out;
+    link->out_cap = cap;
+  }
+  if (data) {
+    memcpy(link->out + link->out_len, data, len);
+  } else {
+    memset(link->out + link->out_len, 0, len);
+  }
+  link->out_len += len;
+  return OK;
+}
+
+static u32 emu_be32_(const u8 *p) {
+  return (u32)p[0] << 24 | (u32)p[1] << 16 | (u32)p[2] << 8 | (u32)p[3];
+}
+
+static Error emu_command_(NusEmuLink *link) {
+  const u8 *h = link->head;
+  if (memcmp(h, "cmd", 3) != 0) {
+    return ERR_NUS_USB;
+  }
+  char cmd = (char)h[3];
+  u32 addr = emu_be32_(h + 4);
+  usize len = (usize)emu_be32_(h + 8) * NUS_EMU_BLOCK;
+  u32 arg = emu_be32_(h + 12);
+  emu_stats_.commands++;
+
+  if (cmd == 'W' || cmd == 'w') {
+    link->data_left = len;
+    link->dst_left = len;
+    link->dst = emu_span_(addr, &link->dst_left);
+    return OK;
+  }
+
+  link->skip = NUS_EMU_CMD_LEN - NUS_EMU_CMD_HEAD;
+  switch (cmd) {
+  case 't': {
+    u8 reply[NUS_EMU_CMD_LEN] = {'c', 'm', 'd', 'r'};
+    return emu_reply_(link, reply, sizeof(reply));
+  }
+  case 'R':
+  case 'r': {
+    usize fit = len;
+    const u8 *src = emu_span_(addr, &fit);
+    Error err = emu_reply_(link, src, fit);
+    if (!err && fit < len) {
+      err = emu_reply_(link, NULL, len - fit);
+    }
+    return err;
+  }
+  case 'c': {
+    u8 *dst = emu_span_(addr, &len);
+    for (usize i = 0; i < len; i++) {
+      dst[i] = (u8)(arg >> (24 - (i % 4) * 8));
+    }
+    return OK;
+  }
+  case 's':
+    emu_stats_.boots++;
+    return OK;
+  }
+  return OK;
+}
+
+static Error emu_open_(NusTransport *transport) {
+  if (emu_rom_ == NULL) {
+    // calloc leaves untouched pages unbacked
+    emu_rom_ = calloc(1, NUS_EMU_ROM_LEN);
+    emu_ram_ = calloc(1, NUS_EMU_RAM_LEN);
+    if (emu_rom_ == NULL || emu_ram_ == NULL) {
+      nus_emu_reset();
+      return ERR_NUS_USB;
+    }
+  }
+
+  NusEmuLink *link = calloc(1, sizeof(NusEmuLink));
+  if (link == NULL) {
+    return ERR_NUS_USB;
+  }
+  transport->ctx = link;
+  strcpy(transport->serial, "emu");
+  return OK;
+}
+
+// runs the bytes the host sent through the command parser
+static Error emu_feed_(NusEmuLink *link, const u8 *data, usize len) {
+  emu_stats_.written += len;
+
+  while (len) {
+    usize n = 0;
+    if (link->data_left) {
+      n = MIN(link->data_left, len);
+      usize copy = MIN(n, link->dst_left);
+      if (copy) {
+        memcpy(link->dst, data, copy);
+        link->dst += copy;
+        link->dst_left -= copy;
+      }
+      link->data_left -= n;
+    } else if (link->skip) {
+      n = MIN(link->skip, len);
+      link->skip -= n;
+    } else {
+      n = MIN(NUS_EMU_CMD_HEAD - link->head_len, len);
+      memcpy(link->head + link->head_len, data, n);
+      link->head_len += n;
+      if (link->head_len == NUS_EMU_CMD_HEAD) {
+        link->head_len = 0;
+        if (emu_command_(link)) {
+          return ERR_NUS_USB;
+        }
+      }
+    }
+    data += n;
+    len -= n;
+  }
+  return OK;
+}
+
+static Error emu_write_(NusTransport *transport, const u8 *data, usize len) {
+  for (usize offset = 0; offset < len; offset += NUS_EMU_TRANSFER) {
+    usize size = MIN(NUS_EMU_TRANSFER, len - offset);
+    f64 start = nus_stats_now();
+    emu_wait_(transport, size);
+    if (transport->stats) {
+      nus_stats_block(&transport->stats->write, nus_stats_now() - start);
+    }
+    if (emu_feed_(transport->ctx, data + offset, size)) {
+      return ERR_NUS_USB;
+    }
+  }
+  return OK;
+}
+
+static i64 emu_read_(NusTransport *transport, u8 *data, usize len) {
+  NusEmuLink *link = transport->ctx;
+  usize n = MIN(len, link->out_len - link->out_pos);
+  emu_wait_(transport, n);
+  memcpy(data, link->out + link->out_pos, n);
+  link->out_pos += n;
+  emu_stats_.read += n;
+  return (i64)n;
+}
+
+static Error emu_close_(NusTransport *transport) {
+  NusEmuLink *link = transport->ctx;
+  free(link->out);
+  free(link);
+  return OK;
+}
+
+const NusTransportOps nus_transport_emu = {"emu", emu_open_, emu_write_,
+                                           emu_read_, emu_close_};
+
+#ifdef TEST
+
+static void emu_cmd_(u8 *cmd, char c, u32 addr, u32 blocks, u32 arg) {
+  memset(cmd, 0, NUS_EMU_CMD_LEN);
+  u32 fields[] = {addr, blocks, arg};
+  memcpy(cmd, "cmd", 3);
+  cmd[3] = (u8)c;
+  for (usize i = 0; i < 3; i++) {
+    for (usize j = 0; j < 4; j++) {
+      cmd[4 + i * 4 + j] = (u8)(fields[i] >> (24 - j * 8));
+    }
+  }
+}
+
+void test_nus_emu(void **state) {
+  nus_emu_reset();
+  NusTransport t;
+  assert_int_equal(OK, nus_transport_init(&t, "emu"));
+  assert_int_equal(OK, nus_transport_open(&t));
+  assert_string_equal("emu", t.serial);
+
+  u8 cmd[NUS_EMU_CMD_LEN];
+  u8 reply[NUS_EMU_BLOCK * 2];
+
+  // nothing to read before a command
+  assert_int_equal(0, nus_transport_read(&t, reply, sizeof(reply)));
+
+  emu_cmd_(cmd, 't', 0, 0, 0);
+  assert_int_equal(OK, nus_transport_write(&t, cmd, NUS_EMU_CMD_LEN));
+  assert_int_equal(NUS_EMU_BLOCK, nus_transport_read(&t, reply, 1024));
+  assert_int_equal('r', reply[3]);
+
+  // a write sends its data right after the command head,
+  // even when both arrive in pieces
+  u8 data[NUS_EMU_BLOCK];
+  for (usize i = 0; i < sizeof(data); i++) {
+    data[i] = (u8)(i * 3);
+  }
+  emu_cmd_(cmd, 'W', NUS_EMU_ROM_ADDR + 0x1000, 1, 0);
+  assert_int_equal(OK, nus_transport_write(&t, cmd, 10));
+  assert_int_equal(OK, nus_transport_write(&t, cmd + 10, 6));
+  assert_int_equal(OK, nus_transport_write(&t, data, 100));
+  assert_int_equal(OK, nus_transport_write(&t, data + 100, 412));
+  assert_memory_equal(data, nus_emu_memory(NUS_EMU_ROM_ADDR + 0x1000, 512),
+                      512);
+
+  // reads queue up until the host picks them up
+  emu_cmd_(cmd, 'R', NUS_EMU_ROM_ADDR + 0x1000, 1, 0);
+  assert_int_equal(OK, nus_transport_write(&t, cmd, NUS_EMU_CMD_LEN));
+  emu_cmd_(cmd, 'c', NUS_EMU_ROM_ADDR + 0x1000, 1, 0xAABBCCDD);
+  assert_int_equal(OK, nus_transport_write(&t, cmd, NUS_EMU_CMD_LEN));
+  emu_cmd_(cmd, 'R', NUS_EMU_ROM_ADDR + 0x1000, 1, 0);
+  assert_int_equal(OK, nus_transport_write(&t, cmd, NUS_EMU_CMD_LEN));
+  assert_int_equal(1024, nus_transport_read(&t, reply, 1024));
+  assert_memory_equal(data, reply, 512);
+  u8 fill[] = {0xAA, 0xBB, 0xCC, 0xDD};
+  assert_memory_equal(fill, reply + 512, 4);
+  assert_memory_equal(fill, reply + 1020, 4);
+
+  // memory outside rom and ram reads as zero
+  emu_cmd_(cmd, 'r', 0x40000000, 1, 0);
+  assert_int_equal(OK, nus_transport_write(&t, cmd, NUS_EMU_CMD_LEN));
+  assert_int_equal(512, nus_transport_read(&t, reply, 1024));
+  assert_int_equal(0, reply[0]);
+
+  emu_cmd_(cmd, 's', 0, 0, 1);
+  assert_int_equal(OK, nus_transport_write(&t, cmd, NUS_EMU_CMD_LEN));
+  assert_int_equal(1, nus_emu_stats()->boots);
+  assert_int_equal(7, nus_emu_stats()->commands);
+
+  // garbage is not a command
+  memset(cmd, 0, NUS_EMU_CMD_HEAD);
+  assert_int_equal(ERR_NUS_USB, nus_transport_write(&t, cmd, 16));
+  assert_int_equal(OK, nus_transport_close(&t));
+
+  // the memory stays until the cart is power cycled
+  assert_int_equal(OK, nus_transport_open(&t));
+  assert_int_equal(0xBB, nus_emu_memory(NUS_EMU_ROM_ADDR + 0x1000, 2)[1]);
+  assert_int_equal(OK, nus_transport_close(&t));
+  nus_emu_reset();
+  assert_null(nus_emu_memory(NUS_EMU_ROM_ADDR, 1));
+
+  // the link takes latency plus size over bandwidth
+  assert_int_equal(OK, nus_transport_init(&t, "emu:1000000:1000"));
+  assert_int_equal(OK, nus_transport_open(&t));
+  struct timespec a;
+  struct timespec b;
+  clock_gettime(CLOCK_MONOTONIC, &a);
+  for (usize i = 0; i < 10; i++) {
+    emu_cmd_(cmd, 't', 0, 0, 0);
+    assert_int_equal(OK, nus_transport_write(&t, cmd, NUS_EMU_CMD_LEN));
+  }
+  clock_gettime(CLOCK_MONOTONIC, &b);
+  f64 elapsed = (f64)(b.tv_sec - a.tv_sec) + (f64)(b.tv_nsec - a.tv_nsec) / 1e9;
+  assert_true(elapsed >= 10 * (0.001 + 512 / 1e6));
+  assert_int_equal(OK, nus_transport_close(&t));
+  nus_emu_reset();
+}
+
+#endif
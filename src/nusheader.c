@@ -1,27 +1,42 @@
 #include "nusheader.h"
+#include "nuscrc.h"
+#include "nusmanifest.h"
 #include <string.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
+#include <sys/stat.h>
+#include "macros.h"
 
-void nus_add_header(Buffer *buffer) {
-  usize old_len = buffer->len;
-  u8 *old_data = buffer->data;
-
-  buffer->len += NUS_HEADER_SIZE;
-  buffer->data = malloc(buffer->len);
+// the file the checkpoints of a cache file were taken of
+typedef struct NusCrcCacheHeader { // NOLINT
+  u32 magic;
+  u32 cic;
+  u64 dev;
+  u64 ino;
+  u64 size;
+  i64 mtime_sec;
+  i64 mtime_nsec;
+} NusCrcCacheHeader;
 
+void nus_add_header(Buffer *buffer) {
   // this is different from the regular buffer resize function
-  memset(buffer->data, 0, NUS_HEADER_SIZE);
-  memcpy(buffer->data + NUS_HEADER_SIZE, old_data, old_len);
-
-  free(old_data);
+  buffer_prepend(buffer, NUS_HEADER_SIZE, 0);
 }
 
 void nus_set_header(Buffer *buffer, NusHeader *header) {
+  buffer_materialize(buffer, NUS_CRC_END);
   nus_crc(header, buffer->data, buffer->len);
   u8 header_bytes[NUS_HEADER_SIZE];
   nus_to_bytes(header, header_bytes);
-  memcpy(buffer->data, header_bytes, NUS_HEADER_SIZE);
+  buffer_inject(buffer, 0, header_bytes, NUS_HEADER_SIZE);
+}
+
+void nus_set_header_cached(Buffer *buffer, NusHeader *header,
+                           NusCrcCache *cache) {
+  nus_crc_cached(cache, buffer, &header->crc);
+  u8 header_bytes[NUS_HEADER_SIZE];
+  nus_to_bytes(header, header_bytes);
+  buffer_inject(buffer, 0, header_bytes, NUS_HEADER_SIZE);
 }
 
 void nus_fprint(FILE *file, const NusHeader *header) {
@@ -43,6 +58,11 @@ void nus_fprint(FILE *file, const NusHeader *header) {
   fprintf(file, "uid: %c%c\n", header->unique[0], header->unique[1]);
   fprintf(file, "destination: %c\n", header->destination);
   fprintf(file, "version: %d\n", header->version);
+  if (header->cic == NUS_CIC_UNKNOWN) {
+    fprintf(file, "cic: unknown\n");
+  } else {
+    fprintf(file, "cic: %d\n", header->cic);
+  }
 }
 
 void nus_init(NusHeader *header) {
@@ -86,10 +106,7 @@ Error nus_from_bytes(NusHeader *header, const u8 *data, const usize len) {
   header->destination = (char)data[0x3E];
   header->version = (char)data[0x3F];
 
-  // attempt crc, if it fails just leave it be!
-  // if it didn't failt it should correct a wrong crc value
-  // or calculate the same result as the exisiting value
-  nus_crc(header, data, len);
+  header->cic = nus_cic_identify(data, len);
 
   return OK;
 }
@@ -121,58 +138,202 @@ void nus_to_bytes(NusHeader *header, u8 *result) {
   result[0x3F] = header->version;
 }
 
-Error calc_crc_(const u8 *data, const usize len, NusCrc *crc) {
-  // this is just some magic number used as an initial value
-  const u32 INITIAL = -120959524;
+// folds whole words of the crc area into the state.
+// offset is the rom offset of data
+static void nus_crc_fold_(NusCrcState *state, NusCic cic, const u8 *key,
+                          const u8 *data, usize len, usize offset) {
+  if (cic == NUS_CIC_6105) {
+    nus_crc_kernel_6105(state, data, len, key, offset);
+  } else {
+    nus_crc_kernel()(state, data, len);
+  }
+}
 
-  if (len < NUS_CRC_LEN + NUS_CRC_START) {
-    return ERR_CRC_NOT_ENOUGH_DATA;
+static void nus_crc_finish_(const NusCrcState *s, NusCic cic, NusCrc *crc) {
+  switch (cic) {
+  case NUS_CIC_6103:
+    crc->crc1 = (s->crc1 ^ s->t2) + s->t3;
+    crc->crc2 = (s->crc2 ^ s->a2) + s->t4;
+    break;
+  case NUS_CIC_6106:
+    crc->crc1 = (s->crc1 * s->t2) + s->t3;
+    crc->crc2 = (s->crc2 * s->a2) + s->t4;
+    break;
+  default:
+    crc->crc1 = (s->crc1 ^ s->t2) ^ s->t3;
+    crc->crc2 = (s->crc2 ^ s->a2) ^ s->t4;
+    break;
   }
+}
 
-  u32 t2 = INITIAL;
-  u32 t3 = INITIAL;
-  u32 a2 = INITIAL;
-  u32 t4 = INITIAL;
-  u32 crc1 = INITIAL;
-  u32 crc2 = INITIAL;
+void nus_crc_init(NusCrcCtx *ctx) {
+  ctx->offset = 0;
+  ctx->partial_len = 0;
+  ctx->cic = NUS_CIC_UNKNOWN;
+  ctx->forced = FALSE;
+  ctx->ipl3_hash = 0;
+  memset(ctx->key, 0, NUS_CIC_6105_KEY_LEN);
+  nus_crc_state_init(&ctx->state, nus_cic_seed(ctx->cic));
+}
 
-  for (u32 idx = 0; idx < NUS_CRC_LEN; idx += 4) {
-    // take the next 4 bytes and convert them to
-    // a native integer
-    u32 current_data = ntohl_from_(data, NUS_CRC_START + idx);
+void nus_crc_init_cic(NusCrcCtx *ctx, NusCic cic) {
+  nus_crc_init(ctx);
+  ctx->cic = cic;
+  ctx->forced = TRUE;
+}
+
+// hashes the boot code and keeps the 6105 key
+static void nus_crc_boot_code_(NusCrcCtx *ctx, const u8 *data, usize len) {
+  usize offset = ctx->offset;
+  usize end = offset + len;
+
+  if (end > NUS_IPL3_START && offset < NUS_IPL3_END) {
+    usize from = MAX(offset, NUS_IPL3_START);
+    usize to = MIN(end, NUS_IPL3_END);
+    ctx->ipl3_hash = nus_crc32(ctx->ipl3_hash, data + (from - offset), to - from);
+  }
 
-    u32 a1 = crc1 + current_data;
+  usize key_end = NUS_CIC_6105_KEY + NUS_CIC_6105_KEY_LEN;
+  if (end > NUS_CIC_6105_KEY && offset < key_end) {
+    usize from = MAX(offset, NUS_CIC_6105_KEY);
+    usize to = MIN(end, key_end);
+    memcpy(ctx->key + (from - NUS_CIC_6105_KEY), data + (from - offset),
+           to - from);
+  }
+}
+
+void nus_crc_update(NusCrcCtx *ctx, const u8 *data, usize len) {
+  // everything in front of the crc area is only looked at for the boot code
+  if (ctx->offset < NUS_CRC_START) {
+    usize skip = MIN(len, NUS_CRC_START - ctx->offset);
+    nus_crc_boot_code_(ctx, data, skip);
+    ctx->offset += skip;
+    data += skip;
+    len -= skip;
+
+    if (ctx->offset == NUS_CRC_START) {
+      if (!ctx->forced) {
+        ctx->cic = nus_cic_from_hash(ctx->ipl3_hash);
+      }
+      nus_crc_state_init(&ctx->state, nus_cic_seed(ctx->cic));
+    }
+  }
 
-    if (a1 < crc1) {
-      t2 = t2 + 1;
+  // and everything after it is skipped
+  if (ctx->offset >= NUS_CRC_END) {
+    ctx->offset += len;
+    return;
+  }
+  usize tail = 0;
+  if (len > NUS_CRC_END - ctx->offset) {
+    tail = len - (NUS_CRC_END - ctx->offset);
+    len -= tail;
+  }
+  usize offset = ctx->offset;
+  ctx->offset += len;
+
+  // finish a word that was split between two chunks
+  if (ctx->partial_len) {
+    usize fill = MIN(len, 4 - ctx->partial_len);
+    memcpy(ctx->partial + ctx->partial_len, data, fill);
+    ctx->partial_len += fill;
+    data += fill;
+    len -= fill;
+    offset += fill;
+
+    if (ctx->partial_len < 4) {
+      ctx->offset += tail;
+      return;
     }
+    nus_crc_fold_(&ctx->state, ctx->cic, ctx->key, ctx->partial, 4,
+                  offset - 4);
+    ctx->partial_len = 0;
+  }
 
-    u32 v1 = current_data & 0x1f;                                // NOLINT
-    u32 a0 = (current_data << v1) | (current_data >> (32 - v1)); // NOLINT
-    crc1 = a1;
+  usize words = len & ~(usize)3;
+  nus_crc_fold_(&ctx->state, ctx->cic, ctx->key, data, words, offset);
 
-    t3 ^= current_data;
+  ctx->partial_len = len - words;
+  memcpy(ctx->partial, data + words, ctx->partial_len);
 
-    crc2 = crc2 + a0;
+  ctx->offset += tail;
+}
 
-    if (a2 < current_data) {
-      a2 ^= crc1 ^ current_data;
-    } else {
-      a2 ^= a0;
-    }
+Error nus_crc_final(NusCrcCtx *ctx, NusCrc *crc) {
+  if (ctx->offset < NUS_CRC_END) {
+    return ERR_CRC_NOT_ENOUGH_DATA;
+  }
 
-    t4 = t4 + (current_data ^ crc2);
+  nus_crc_finish_(&ctx->state, ctx->cic, crc);
+
+  return OK;
+}
+
+void nus_crc_cache_init(NusCrcCache *cache) {
+  cache->version = 0;
+  cache->valid = 0;
+  cache->hashed = 0;
+  cache->cic = NUS_CIC_UNKNOWN;
+}
+
+Error nus_crc_cached(NusCrcCache *cache, Buffer *buffer, NusCrc *crc) {
+  cache->hashed = 0;
+  // padding may still be lazily filled
+  buffer_materialize(buffer, NUS_CRC_END);
+  if (buffer->len < NUS_CRC_END) {
+    return ERR_CRC_NOT_ENOUGH_DATA;
   }
 
-  crc1 = (crc1 ^ t2) ^ t3;
-  crc2 = (crc2 ^ a2) ^ t4;
+  // drop every checkpoint at or after the first modified byte
+  usize start = 0;
+  bool dirty =
+      buffer_dirty_since(buffer, cache->version, NUS_IPL3_START, &start);
+  if (dirty && start < NUS_CRC_END) {
+    usize block = start < NUS_CRC_START
+                      ? 0
+                      : (start - NUS_CRC_START) / NUS_CRC_CHECKPOINT;
+    cache->valid = MIN(cache->valid, block);
+  }
+  cache->version = buffer->version;
 
-  crc->crc1 = crc1;
-  crc->crc2 = crc2;
+  // a new boot code may need a different seed, so everything is rehashed
+  if (cache->valid == 0) {
+    cache->cic = nus_cic_identify(buffer->data, buffer->len);
+    nus_crc_state_init(&cache->checkpoints[0], nus_cic_seed(cache->cic));
+  }
+
+  const u8 *key = buffer->data + NUS_CIC_6105_KEY;
+  NusCrcState state;
+  if (cache->valid < NUS_CRC_CHECKPOINTS) {
+    state = cache->checkpoints[cache->valid];
+    for (usize i = cache->valid; i < NUS_CRC_CHECKPOINTS; i++) {
+      usize offset = NUS_CRC_START + i * NUS_CRC_CHECKPOINT;
+      cache->checkpoints[i] = state;
+      nus_crc_fold_(&state, cache->cic, key, buffer->data + offset,
+                    NUS_CRC_CHECKPOINT, offset);
+      cache->hashed += NUS_CRC_CHECKPOINT;
+    }
+    cache->final = state;
+    cache->valid = NUS_CRC_CHECKPOINTS;
+  }
+
+  nus_crc_finish_(&cache->final, cache->cic, crc);
 
   return OK;
 }
 
+Error calc_crc_(const u8 *data, const usize len, NusCrc *crc) {
+  if (len < NUS_CRC_LEN + NUS_CRC_START) {
+    return ERR_CRC_NOT_ENOUGH_DATA;
+  }
+
+  NusCrcCtx ctx;
+  nus_crc_init(&ctx);
+  nus_crc_update(&ctx, data, NUS_CRC_END);
+
+  return nus_crc_final(&ctx, crc);
+}
+
 Error nus_crc(NusHeader *header, const u8 *data, const usize len) {
   NusCrc result;
   Error err = calc_crc_(data, len, &result);
@@ -182,9 +343,151 @@ Error nus_crc(NusHeader *header, const u8 *data, const usize len) {
   return err;
 }
 
+static Error nus_crc_compare_(const u8 *data, const usize len, NusCrc *stored,
+                              NusCrc *computed, Error err) {
+  if (len < NUS_HEADER_SIZE) {
+    return ERR_HEADER_NOT_ENOUGH_DATA;
+  }
+
+  stored->crc1 = ntohl_from_(data, 0x10);
+  stored->crc2 = ntohl_from_(data, 0x14);
+
+  if (err) {
+    return err;
+  }
+
+  if (stored->crc1 != computed->crc1 || stored->crc2 != computed->crc2) {
+    return ERR_CRC_MISMATCH;
+  }
+
+  return OK;
+}
+
+Error nus_crc_verify(const u8 *data, const usize len, NusCrc *stored,
+                     NusCrc *computed) {
+  Error err = calc_crc_(data, len, computed);
+  return nus_crc_compare_(data, len, stored, computed, err);
+}
+
+Error nus_crc_verify_cached(NusCrcCache *cache, Buffer *buffer,
+                            NusCrc *stored, NusCrc *computed) {
+  Error err = nus_crc_cached(cache, buffer, computed);
+  return nus_crc_compare_(buffer->data, buffer->len, stored, computed, err);
+}
+
+// the cache file of the file buffer was mapped from
+static Error nus_crc_cache_file_(const Buffer *buffer, char *path, usize len,
+                                 NusCrcCacheHeader *header, bool create) {
+  struct stat st;
+  if (buffer->src_fd < 0 || fstat(buffer->src_fd, &st)) {
+    return ERR_READ;
+  }
+  memset(header, 0, sizeof(NusCrcCacheHeader));
+  header->magic = NUS_CRC_CACHE_MAGIC;
+  header->dev = (u64)st.st_dev;
+  header->ino = (u64)st.st_ino;
+  header->size = (u64)st.st_size;
+  header->mtime_sec = (i64)st.st_mtim.tv_sec;
+  header->mtime_nsec = (i64)st.st_mtim.tv_nsec;
+
+  char name[40];
+  snprintf(name, sizeof(name), "%llx-%llx", header->dev, header->ino);
+  return nus_manifest_cache_path(path, len, name, "crc", create);
+}
+
+Error nus_crc_cache_load(NusCrcCache *cache, const Buffer *buffer) {
+  char path[NUS_MANIFEST_PATH_MAX];
+  NusCrcCacheHeader expected;
+  if (buffer->len < NUS_HEADER_SIZE ||
+      nus_crc_cache_file_(buffer, path, sizeof(path), &expected, FALSE)) {
+    return ERR_READ;
+  }
+  FILE *f = fopen(path, "rbe");
+  if (f == NULL) {
+    return ERR_READ;
+  }
+
+  NusCrcCacheHeader header;
+  NusCrcCache loaded;
+  nus_crc_cache_init(&loaded);
+  bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+            fread(loaded.checkpoints, sizeof(loaded.checkpoints), 1, f) == 1 &&
+            fread(&loaded.final, sizeof(loaded.final), 1, f) == 1;
+  fclose(f);
+  // anything that touched the file since it was saved changed
+  // its size or modification time
+  if (!ok || header.magic != expected.magic || header.dev != expected.dev ||
+      header.ino != expected.ino || header.size != expected.size ||
+      header.mtime_sec != expected.mtime_sec ||
+      header.mtime_nsec != expected.mtime_nsec) {
+    return ERR_READ;
+  }
+
+  // the header has to hold the crc the checkpoints end in
+  NusHeader stored;
+  NusCrc crc;
+  loaded.cic = (NusCic)header.cic;
+  nus_crc_finish_(&loaded.final, loaded.cic, &crc);
+  nus_from_bytes(&stored, buffer->data, buffer->len);
+  if (crc.crc1 != stored.crc.crc1 || crc.crc2 != stored.crc.crc2) {
+    return ERR_READ;
+  }
+
+  loaded.valid = NUS_CRC_CHECKPOINTS;
+  loaded.version = buffer->version;
+  *cache = loaded;
+  return OK;
+}
+
+Error nus_crc_cache_save(NusCrcCache *cache, const Buffer *buffer) {
+  // only a cache that was used is worth keeping. One that missed
+  // a write can no longer tell where its checkpoints went stale
+  if (cache->valid == 0 || cache->version != buffer->version) {
+    return ERR_WRITE;
+  }
+
+  char path[NUS_MANIFEST_PATH_MAX];
+  char tmp[NUS_MANIFEST_PATH_MAX + 4];
+  NusCrcCacheHeader header;
+  if (nus_crc_cache_file_(buffer, path, sizeof(path), &header, TRUE)) {
+    return ERR_WRITE;
+  }
+  header.cic = (u32)cache->cic;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  FILE *f = fopen(tmp, "wbe");
+  if (f == NULL) {
+    return ERR_WRITE;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(cache->checkpoints, sizeof(cache->checkpoints), 1, f) == 1 &&
+            fwrite(&cache->final, sizeof(cache->final), 1, f) == 1;
+  if (fclose(f) || !ok || rename(tmp, path)) {
+    remove(tmp);
+    return ERR_WRITE;
+  }
+  return OK;
+}
+
+Error nus_crc_cache_sync(NusCrcCache *cache, Buffer *buffer,
+                         usize *written) {
+  // the dirty ranges are gone after the sync
+  NusCrc crc;
+  if (cache->valid != 0 && nus_crc_cached(cache, buffer, &crc)) {
+    cache->valid = 0;
+  }
+
+  Error err = buffer_sync(buffer, written);
+  if (!err) {
+    nus_crc_cache_save(cache, buffer);
+  }
+  return err;
+}
+
 #ifdef TEST
 
 #include "macros.h"
+#include <unistd.h>
 
 void test_crc_fail(void **state) {
   u8 data1[] = {0, 1, 2, 3};
@@ -212,4 +515,237 @@ void test_crc(void **state) {
   free(test_data);
 }
 
+void test_crc_stream(void **state) {
+  const usize len = NUS_CRC_END + 0x123;
+  u8 *test_data = malloc(len);
+  for (u32 i = 0; i < len; i++) {
+    test_data[i] = (u8)(i * 13 + (i >> 8));
+  }
+
+  NusCrc expected;
+  assert_int_equal(OK, calc_crc_(test_data, len, &expected));
+
+  // feed the rom in odd chunk sizes that split words and
+  // straddle both ends of the crc area
+  const usize chunks[] = {1, 3, 0xFFD, 7, 2, 0x10001, 5, 0x8000};
+  NusCrcCtx ctx;
+  nus_crc_init(&ctx);
+  usize fed = 0;
+  for (usize i = 0; fed < len; i++) {
+    usize chunk = chunks[i % (sizeof(chunks) / sizeof(usize))];
+    chunk = MIN(chunk, len - fed);
+
+    NusCrc result;
+    if (fed < NUS_CRC_END) {
+      assert_int_equal(ERR_CRC_NOT_ENOUGH_DATA, nus_crc_final(&ctx, &result));
+    }
+
+    nus_crc_update(&ctx, test_data + fed, chunk);
+    fed += chunk;
+  }
+
+  NusCrc result;
+  assert_int_equal(OK, nus_crc_final(&ctx, &result));
+  assert_int_equal(expected.crc1, result.crc1);
+  assert_int_equal(expected.crc2, result.crc2);
+
+  free(test_data);
+}
+
+void test_crc_cic(void **state) {
+  const usize len = NUS_CRC_END;
+  u8 *test_data = malloc(len);
+  for (u32 i = 0; i < len; i++) {
+    test_data[i] = (u8)(i * 7 + (i >> 9));
+  }
+
+  // every variant has to give the same result when streamed,
+  // the 6105 key sits in the boot code and is split between chunks
+  NusCic cics[] = {NUS_CIC_6101, NUS_CIC_6102, NUS_CIC_6103, NUS_CIC_6105,
+                   NUS_CIC_6106};
+  NusCrc results[5];
+  for (usize c = 0; c < 5; c++) {
+    NusCrcCtx ctx;
+    nus_crc_init_cic(&ctx, cics[c]);
+    nus_crc_update(&ctx, test_data, len);
+    assert_int_equal(OK, nus_crc_final(&ctx, &results[c]));
+
+    NusCrc streamed;
+    nus_crc_init_cic(&ctx, cics[c]);
+    for (usize fed = 0; fed < len; fed += MIN(0x333, len - fed)) {
+      nus_crc_update(&ctx, test_data + fed, MIN(0x333, len - fed));
+    }
+    assert_int_equal(OK, nus_crc_final(&ctx, &streamed));
+    assert_int_equal(results[c].crc1, streamed.crc1);
+    assert_int_equal(results[c].crc2, streamed.crc2);
+  }
+
+  // 6101 and 6102 share the algorithm, everything else differs
+  assert_int_equal(results[0].crc1, results[1].crc1);
+  assert_int_equal(results[0].crc2, results[1].crc2);
+  for (usize c = 2; c < 5; c++) {
+    assert_int_not_equal(results[1].crc2, results[c].crc2);
+  }
+
+  // unknown boot code is treated as 6102
+  NusCrc unknown;
+  assert_int_equal(OK, calc_crc_(test_data, len, &unknown));
+  assert_int_equal(results[1].crc1, unknown.crc1);
+  assert_int_equal(results[1].crc2, unknown.crc2);
+
+  free(test_data);
+}
+
+void test_crc_cache(void **state) {
+  Buffer b;
+  buffer_init(&b);
+  buffer_resize(&b, NUS_CRC_END);
+  for (u32 i = 0; i < b.len; i++) {
+    b.data[i] = (u8)i;
+  }
+
+  NusCrcCache cache;
+  nus_crc_cache_init(&cache);
+  NusCrc result;
+  NusCrc expected;
+
+  assert_int_equal(OK, nus_crc_cached(&cache, &b, &result));
+  assert_int_equal(NUS_CRC_LEN, cache.hashed);
+  assert_int_equal(4207429594, result.crc1);
+  assert_int_equal(3000934689, result.crc2);
+
+  // header edits are outside of the crc area
+  NusHeader header;
+  nus_from_bytes(&header, b.data, b.len);
+  memcpy(header.title, "TITLE", 5);
+  nus_set_header_cached(&b, &header, &cache);
+  assert_int_equal(0, cache.hashed);
+  assert_int_equal(4207429594, header.crc.crc1);
+
+  // an edit near the end only rehashes the last block
+  buffer_set(&b, NUS_CRC_END - 10, 0xAB, 3);
+  assert_int_equal(OK, nus_crc_cached(&cache, &b, &result));
+  assert_int_equal(NUS_CRC_CHECKPOINT, cache.hashed);
+  assert_int_equal(OK, calc_crc_(b.data, b.len, &expected));
+  assert_int_equal(expected.crc1, result.crc1);
+  assert_int_equal(expected.crc2, result.crc2);
+
+  // an edit in the middle resumes from the checkpoint before it
+  buffer_set(&b, NUS_CRC_START + NUS_CRC_CHECKPOINT * 5 + 7, 0x12, 1);
+  assert_int_equal(OK, nus_crc_cached(&cache, &b, &result));
+  assert_int_equal(NUS_CRC_LEN - NUS_CRC_CHECKPOINT * 5, cache.hashed);
+  assert_int_equal(OK, calc_crc_(b.data, b.len, &expected));
+  assert_int_equal(expected.crc1, result.crc1);
+  assert_int_equal(expected.crc2, result.crc2);
+
+  // nothing changed
+  assert_int_equal(OK, nus_crc_cached(&cache, &b, &result));
+  assert_int_equal(0, cache.hashed);
+
+  buffer_free(&b);
+}
+
+void test_crc_cache_file(void **state) {
+  char dir[] = "/tmp/nusscrcXXXXXX";
+  assert_non_null(mkdtemp(dir));
+  setenv("NUSS_MANIFEST_DIR", dir, 1);
+  char path[64];
+  snprintf(path, sizeof(path), "%s/rom.z64", dir);
+
+  Buffer b;
+  buffer_init(&b);
+  buffer_resize(&b, NUS_CRC_END);
+  for (u32 i = 0; i < b.len; i++) {
+    b.data[i] = (u8)i;
+  }
+  FILE *f = fopen(path, "w+e");
+  assert_int_equal(OK, buffer_write(&b, f));
+  fclose(f);
+  buffer_free(&b);
+
+  // the first run hashes everything and keeps its checkpoints
+  NusCrcCache cache;
+  nus_crc_cache_init(&cache);
+  f = fopen(path, "r+e");
+  assert_int_equal(OK, buffer_map(&b, f));
+  fclose(f);
+  assert_int_equal(ERR_READ, nus_crc_cache_load(&cache, &b));
+  NusHeader header;
+  nus_from_bytes(&header, b.data, b.len);
+  nus_set_header_cached(&b, &header, &cache);
+  assert_int_equal(NUS_CRC_LEN, cache.hashed);
+  usize written = 0;
+  assert_int_equal(OK, nus_crc_cache_sync(&cache, &b, &written));
+  buffer_free(&b);
+
+  // the next run only hashes the block it patched
+  nus_crc_cache_init(&cache);
+  f = fopen(path, "r+e");
+  assert_int_equal(OK, buffer_map(&b, f));
+  fclose(f);
+  assert_int_equal(OK, nus_crc_cache_load(&cache, &b));
+  buffer_set(&b, NUS_CRC_END - 10, 0xAB, 3);
+  nus_from_bytes(&header, b.data, b.len);
+  nus_set_header_cached(&b, &header, &cache);
+  assert_int_equal(NUS_CRC_CHECKPOINT, cache.hashed);
+  NusCrc expected;
+  assert_int_equal(OK, calc_crc_(b.data, b.len, &expected));
+  assert_int_equal(expected.crc1, header.crc.crc1);
+  assert_int_equal(expected.crc2, header.crc.crc2);
+  assert_int_equal(OK, nus_crc_cache_sync(&cache, &b, &written));
+  buffer_free(&b);
+
+  // a patch inside the crc area without a new header
+  nus_crc_cache_init(&cache);
+  f = fopen(path, "r+e");
+  assert_int_equal(OK, buffer_map(&b, f));
+  fclose(f);
+  assert_int_equal(OK, nus_crc_cache_load(&cache, &b));
+  buffer_set(&b, NUS_CRC_START + NUS_CRC_CHECKPOINT * 5 + 7, 0x12, 4);
+  assert_int_equal(OK, nus_crc_cache_sync(&cache, &b, &written));
+  buffer_free(&b);
+
+  // leaves checkpoints that do not match the header,
+  // so signing it again hashes everything
+  nus_crc_cache_init(&cache);
+  f = fopen(path, "r+e");
+  assert_int_equal(OK, buffer_map(&b, f));
+  fclose(f);
+  assert_int_equal(ERR_READ, nus_crc_cache_load(&cache, &b));
+  nus_from_bytes(&header, b.data, b.len);
+  nus_set_header_cached(&b, &header, &cache);
+  assert_int_equal(NUS_CRC_LEN, cache.hashed);
+  assert_int_equal(OK, nus_crc_cache_sync(&cache, &b, &written));
+  buffer_free(&b);
+
+  f = fopen(path, "re");
+  assert_int_equal(OK, buffer_map(&b, f));
+  fclose(f);
+  NusCrc stored;
+  assert_int_equal(OK, nus_crc_verify(b.data, b.len, &stored, &expected));
+  buffer_free(&b);
+
+  // a file changed by something else is hashed from scratch
+  f = fopen(path, "ae");
+  fputc(0, f);
+  fclose(f);
+  f = fopen(path, "r+e");
+  assert_int_equal(OK, buffer_map(&b, f));
+  fclose(f);
+  assert_int_equal(ERR_READ, nus_crc_cache_load(&cache, &b));
+  buffer_free(&b);
+
+  char cached[NUS_MANIFEST_PATH_MAX];
+  struct stat st;
+  assert_int_equal(0, stat(path, &st));
+  char name[40];
+  snprintf(name, sizeof(name), "%llx-%llx", (u64)st.st_dev, (u64)st.st_ino);
+  assert_int_equal(OK, nus_manifest_cache_path(cached, sizeof(cached), name,
+                                               "crc", FALSE));
+  assert_int_equal(0, remove(cached));
+  assert_int_equal(0, remove(path));
+  unsetenv("NUSS_MANIFEST_DIR");
+  assert_int_equal(0, rmdir(dir));
+}
+
 #endif
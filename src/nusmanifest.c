@@ -0,0 +1,355 @@
+#include "nusmanifest.h"
+#include "macros.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+typedef struct NusManifestHeader { // NOLINT
+  u32 magic;
+  u32 addr;
+  u64 len;
+  u64 probe;
+  u64 count;
+} NusManifestHeader;
+
+void nus_manifest_init(NusManifest *manifest) {
+  memset(manifest, 0, sizeof(NusManifest));
+}
+
+void nus_manifest_free(NusManifest *manifest) {
+  free(manifest->hashes);
+  nus_manifest_init(manifest);
+}
+
+static u64 manifest_mix_(u64 h) {
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// hashes 8 bytes per step, the length is part of the seed
+// so a block that only grew does not keep its hash
+u64 nus_manifest_hash(const u8 *data, usize len) {
+  u64 h = manifest_mix_(len + 0x9E3779B97F4A7C15ULL);
+  usize i = 0;
+  for (; i + 8 <= len; i += 8) {
+    u64 w = 0;
+    memcpy(&w, data + i, 8);
+    h = (h ^ w) * 0x9FB21C651E98DF25ULL;
+    h ^= h >> 29;
+  }
+  if (i < len) {
+    u64 w = 0;
+    memcpy(&w, data + i, len - i);
+    h = (h ^ w) * 0x9FB21C651E98DF25ULL;
+  }
+  return manifest_mix_(h);
+}
+
+Error nus_manifest_build(NusManifest *manifest, u32 addr, const u8 *data,
+                         usize len) {
+  nus_manifest_free(manifest);
+  usize count = (len + NUS_MANIFEST_BLOCK - 1) / NUS_MANIFEST_BLOCK;
+  if (count) {
+    manifest->hashes = malloc(count * sizeof(u64));
+    if (manifest->hashes == NULL) {
+      return ERR_WRITE;
+    }
+  }
+
+  manifest->addr = addr;
+  manifest->len = len;
+  manifest->count = count;
+  manifest->probe = nus_manifest_hash(data, MIN(len, NUS_MANIFEST_PROBE));
+  for (usize i = 0; i < count; i++) {
+    usize offset = i * NUS_MANIFEST_BLOCK;
+    usize size = MIN(NUS_MANIFEST_BLOCK, len - offset);
+    manifest->hashes[i] = nus_manifest_hash(data + offset, size);
+  }
+  return OK;
+}
+
+bool nus_manifest_dirty(const NusManifest *prev, const NusManifest *next,
+                        usize i) {
+  return prev->addr != next->addr || i >= prev->count ||
+         prev->hashes[i] != next->hashes[i];
+}
+
+usize nus_manifest_mismatches(const NusManifest *manifest, u32 addr,
+                              const u8 *data, usize len) {
+  usize mismatches = 0;
+  u64 from = addr;
+  u64 to = from + len;
+  for (usize i = 0; i < manifest->count; i++) {
+    u64 start = (u64)manifest->addr + i * NUS_MANIFEST_BLOCK;
+    u64 size = MIN(NUS_MANIFEST_BLOCK, manifest->len - i * NUS_MANIFEST_BLOCK);
+    if (start < from || start + size > to) {
+      continue;
+    }
+    if (nus_manifest_hash(data + (start - from), size) !=
+        manifest->hashes[i]) {
+      mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+// the directory manifests are kept in
+static Error manifest_dir_(char *dir, usize len, bool create) {
+  const char *env = getenv("NUSS_MANIFEST_DIR");
+  if (env) {
+    if (!env[0]) {
+      return ERR_READ;
+    }
+    if (snprintf(dir, len, "%s", env) >= (int)len) {
+      return ERR_READ;
+    }
+    if (create && mkdir(dir, 0700) && errno != EEXIST) {
+      return ERR_WRITE;
+    }
+    return OK;
+  }
+
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int n = 0;
+  if (cache && cache[0]) {
+    n = snprintf(dir, len, "%s", cache);
+  } else if (home && home[0]) {
+    n = snprintf(dir, len, "%s/.cache", home);
+  } else {
+    return ERR_READ;
+  }
+  if (n < 0 || n >= (int)len) {
+    return ERR_READ;
+  }
+  if (create && mkdir(dir, 0700) && errno != EEXIST) {
+    return ERR_WRITE;
+  }
+  if (snprintf(dir + n, len - n, "/nusstool") >= (int)(len - n)) {
+    return ERR_READ;
+  }
+  if (create && mkdir(dir, 0700) && errno != EEXIST) {
+    return ERR_WRITE;
+  }
+  return OK;
+}
+
+Error nus_manifest_cache_path(char *path, usize len, const char *name,
+                              const char *ext, bool create) {
+  Error err = manifest_dir_(path, len, create);
+  if (err) {
+    return err;
+  }
+
+  // names come from the device, keep them to a safe file name
+  usize n = strlen(path);
+  if (n + 2 >= len) {
+    return ERR_READ;
+  }
+  path[n++] = '/';
+  for (; *name && n + 1 < len; name++) {
+    char c = *name;
+    bool safe = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                (c >= '0' && c <= '9') || c == '-' || c == '_';
+    path[n++] = safe ? c : '_';
+  }
+  path[n] = '\0';
+  if (snprintf(path + n, len - n, ".%s", ext) >= (int)(len - n)) {
+    return ERR_READ;
+  }
+  return OK;
+}
+
+Error nus_manifest_path(char *path, usize len, const char *serial) {
+  return nus_manifest_cache_path(path, len, serial, "manifest", FALSE);
+}
+
+Error nus_manifest_load(NusManifest *manifest, const char *serial) {
+  char path[NUS_MANIFEST_PATH_MAX];
+  if (nus_manifest_path(path, sizeof(path), serial)) {
+    return ERR_READ;
+  }
+
+  FILE *f = fopen(path, "rbe");
+  if (f == NULL) {
+    return ERR_READ;
+  }
+
+  nus_manifest_free(manifest);
+  NusManifestHeader header;
+  Error err = OK;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      header.magic != NUS_MANIFEST_MAGIC ||
+      header.count != (header.len + NUS_MANIFEST_BLOCK - 1) /
+                          NUS_MANIFEST_BLOCK) {
+    err = ERR_READ;
+  }
+  if (!err && header.count) {
+    manifest->hashes = malloc(header.count * sizeof(u64));
+    if (manifest->hashes == NULL ||
+        fread(manifest->hashes, sizeof(u64), header.count, f) !=
+            header.count) {
+      err = ERR_READ;
+    }
+  }
+  fclose(f);
+
+  if (err) {
+    nus_manifest_free(manifest);
+    return err;
+  }
+  manifest->addr = header.addr;
+  manifest->len = header.len;
+  manifest->probe = header.probe;
+  manifest->count = header.count;
+  return OK;
+}
+
+Error nus_manifest_save(const NusManifest *manifest, const char *serial) {
+  char path[NUS_MANIFEST_PATH_MAX];
+  char tmp[NUS_MANIFEST_PATH_MAX + 4];
+  if (nus_manifest_cache_path(path, sizeof(path), serial, "manifest", TRUE)) {
+    return ERR_WRITE;
+  }
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  // written next to the manifest and renamed over it,
+  // an interrupted save never leaves half a manifest behind
+  FILE *f = fopen(tmp, "wbe");
+  if (f == NULL) {
+    return ERR_WRITE;
+  }
+  NusManifestHeader header = {NUS_MANIFEST_MAGIC, manifest->addr,
+                              manifest->len, manifest->probe, manifest->count};
+  Error err = OK;
+  if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+      fwrite(manifest->hashes, sizeof(u64), manifest->count, f) !=
+          manifest->count) {
+    err = ERR_WRITE;
+  }
+  if (fclose(f) || err || rename(tmp, path)) {
+    remove(tmp);
+    return ERR_WRITE;
+  }
+  return OK;
+}
+
+void nus_manifest_forget(const char *serial) {
+  char path[NUS_MANIFEST_PATH_MAX];
+  if (nus_manifest_path(path, sizeof(path), serial) == OK) {
+    remove(path);
+  }
+}
+
+#ifdef TEST
+
+#include <unistd.h>
+
+void test_nus_manifest(void **state) {
+  usize len = NUS_MANIFEST_BLOCK * 3 + 100;
+  u8 *data = malloc(len);
+  for (usize i = 0; i < len; i++) {
+    data[i] = (u8)(i * 7 + (i >> 11));
+  }
+
+  NusManifest prev;
+  NusManifest next;
+  nus_manifest_init(&prev);
+  nus_manifest_init(&next);
+  assert_int_equal(OK, nus_manifest_build(&prev, 0x10000000, data, len));
+  assert_int_equal(4, prev.count);
+  assert_int_equal(nus_manifest_hash(data, NUS_MANIFEST_PROBE), prev.probe);
+
+  // only the block with the edit is sent again
+  data[NUS_MANIFEST_BLOCK + 5] ^= 1;
+  assert_int_equal(OK, nus_manifest_build(&next, 0x10000000, data, len));
+  assert_false(nus_manifest_dirty(&prev, &next, 0));
+  assert_true(nus_manifest_dirty(&prev, &next, 1));
+  assert_false(nus_manifest_dirty(&prev, &next, 2));
+  assert_false(nus_manifest_dirty(&prev, &next, 3));
+
+  // a longer last block and a new block are both sent
+  u8 *longer = malloc(len + NUS_MANIFEST_BLOCK);
+  memcpy(longer, data, len);
+  memset(longer + len, 0, NUS_MANIFEST_BLOCK);
+  NusManifest grown;
+  nus_manifest_init(&grown);
+  nus_manifest_build(&grown, 0x10000000, longer, len + NUS_MANIFEST_BLOCK);
+  assert_int_equal(5, grown.count);
+  assert_false(nus_manifest_dirty(&next, &grown, 2));
+  assert_true(nus_manifest_dirty(&next, &grown, 3));
+  assert_true(nus_manifest_dirty(&next, &grown, 4));
+
+  // nothing matches at another address
+  grown.addr = 0x10100000;
+  assert_true(nus_manifest_dirty(&next, &grown, 0));
+
+  // a dump only checks the blocks it fully covers
+  assert_int_equal(0, nus_manifest_mismatches(&next, 0x10000000, data, len));
+  assert_int_equal(1, nus_manifest_mismatches(&prev, 0x10000000, data, len));
+  assert_int_equal(0, nus_manifest_mismatches(&prev, 0x10000000, data,
+                                              NUS_MANIFEST_BLOCK + 10));
+  assert_int_equal(0, nus_manifest_mismatches(
+                          &prev, 0x10000000 + NUS_MANIFEST_BLOCK * 2,
+                          data + NUS_MANIFEST_BLOCK * 2,
+                          NUS_MANIFEST_BLOCK + 100));
+
+  nus_manifest_free(&grown);
+  nus_manifest_free(&next);
+  nus_manifest_free(&prev);
+  free(longer);
+  free(data);
+}
+
+void test_nus_manifest_file(void **state) {
+  char dir[] = "/tmp/nussmanifestXXXXXX";
+  assert_non_null(mkdtemp(dir));
+  setenv("NUSS_MANIFEST_DIR", dir, 1);
+
+  u8 data[1000];
+  for (usize i = 0; i < sizeof(data); i++) {
+    data[i] = (u8)i;
+  }
+  NusManifest m;
+  NusManifest loaded;
+  nus_manifest_init(&m);
+  nus_manifest_init(&loaded);
+  nus_manifest_build(&m, 0x10000000, data, sizeof(data));
+
+  // serials are used as file names
+  char path[NUS_MANIFEST_PATH_MAX];
+  assert_int_equal(OK, nus_manifest_path(path, sizeof(path), "A1/../x"));
+  assert_non_null(strstr(path, "/A1____x.manifest"));
+
+  assert_int_equal(ERR_READ, nus_manifest_load(&loaded, "A1"));
+  assert_int_equal(OK, nus_manifest_save(&m, "A1"));
+  assert_int_equal(OK, nus_manifest_load(&loaded, "A1"));
+  assert_int_equal(m.addr, loaded.addr);
+  assert_int_equal(m.len, loaded.len);
+  assert_int_equal(m.probe, loaded.probe);
+  assert_int_equal(1, loaded.count);
+  assert_false(nus_manifest_dirty(&loaded, &m, 0));
+
+  // other carts have their own manifest
+  assert_int_equal(ERR_READ, nus_manifest_load(&loaded, "B2"));
+
+  nus_manifest_forget("A1");
+  assert_int_equal(ERR_READ, nus_manifest_load(&loaded, "A1"));
+
+  // an empty directory turns manifests off
+  setenv("NUSS_MANIFEST_DIR", "", 1);
+  assert_int_equal(ERR_WRITE, nus_manifest_save(&m, "A1"));
+  unsetenv("NUSS_MANIFEST_DIR");
+
+  nus_manifest_free(&loaded);
+  nus_manifest_free(&m);
+  assert_int_equal(0, rmdir(dir));
+}
+
+#endif
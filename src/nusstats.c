@@ -0,0 +1,176 @@
+#include "nusstats.h"
+#include "macros.h"
+#include <string.h>
+#include <time.h>
+
+void nus_stats_init(NusStats *stats) { memset(stats, 0, sizeof(NusStats)); }
+
+f64 nus_stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (f64)ts.tv_sec + (f64)ts.tv_nsec / 1e9;
+}
+
+void nus_stats_block(NusStatsDir *dir, f64 latency) {
+  f64 us = latency * 1e6;
+  usize i = 0;
+  while (i < NUS_STATS_BUCKETS - 1 && (f64)(1ULL << i) <= us) {
+    i++;
+  }
+  dir->buckets[i]++;
+  dir->blocks++;
+  dir->latency_max = MAX(dir->latency_max, latency);
+}
+
+f64 nus_stats_percentile(const NusStatsDir *dir, f64 p) {
+  if (dir->blocks == 0) {
+    return 0;
+  }
+  u64 target = (u64)(p * (f64)dir->blocks);
+  if ((f64)target < p * (f64)dir->blocks || target == 0) {
+    target++;
+  }
+  u64 seen = 0;
+  for (usize i = 0; i < NUS_STATS_BUCKETS; i++) {
+    seen += dir->buckets[i];
+    if (seen >= target) {
+      // the top bucket is open ended
+      f64 bound = (f64)(1ULL << i) / 1e6;
+      return MIN(bound, dir->latency_max);
+    }
+  }
+  return dir->latency_max;
+}
+
+NusStatsFormat nus_stats_format_from_name(const char *name) {
+  if (name == NULL || strcmp(name, "table") == 0) {
+    return NUS_STATS_TABLE;
+  }
+  if (strcmp(name, "json") == 0) {
+    return NUS_STATS_JSON;
+  }
+  return NUS_STATS_OFF;
+}
+
+static f64 stats_mbps_(const NusStatsDir *dir) {
+  return dir->seconds > 0 ? (f64)dir->bytes / dir->seconds / 1e6 : 0;
+}
+
+static void stats_json_dir_(const NusStatsDir *dir, FILE *file) {
+  fprintf(file,
+          "{\"bytes\":%llu,\"seconds\":%.6f,\"mbps\":%.3f,\"blocks\":%llu,"
+          "\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f,"
+          "\"histogram\":[",
+          dir->bytes, dir->seconds, stats_mbps_(dir), dir->blocks,
+          nus_stats_percentile(dir, 0.5) * 1e6,
+          nus_stats_percentile(dir, 0.99) * 1e6, dir->latency_max * 1e6);
+  bool first = TRUE;
+  for (usize i = 0; i < NUS_STATS_BUCKETS; i++) {
+    if (dir->buckets[i]) {
+      fprintf(file, "%s[%llu,%llu]", first ? "" : ",", 1ULL << i,
+              dir->buckets[i]);
+      first = FALSE;
+    }
+  }
+  fprintf(file, "]}}");
+}
+
+static void stats_table_dir_(const NusStatsDir *dir, FILE *file,
+                             const char *name) {
+  fprintf(file, "%-6s %12llu %9.3f %9.2f %8llu %9.3f %9.3f %9.3f\n", name,
+          dir->bytes, dir->seconds, stats_mbps_(dir), dir->blocks,
+          nus_stats_percentile(dir, 0.5) * 1e3,
+          nus_stats_percentile(dir, 0.99) * 1e3, dir->latency_max * 1e3);
+}
+
+void nus_stats_print(const NusStats *stats, FILE *file, NusStatsFormat format) {
+  if (format == NUS_STATS_JSON) {
+    fprintf(file, "{\"write\":");
+    stats_json_dir_(&stats->write, file);
+    fprintf(file, ",\"read\":");
+    stats_json_dir_(&stats->read, file);
+    fprintf(file,
+            ",\"handshakes\":%llu,\"handshake_seconds\":%.6f,"
+            "\"retries\":%llu,\"stalls\":%llu}\n",
+            stats->handshakes, stats->handshake_seconds, stats->retries,
+            stats->stalls);
+    return;
+  }
+  if (format != NUS_STATS_TABLE) {
+    return;
+  }
+
+  fprintf(file, "%-6s %12s %9s %9s %8s %9s %9s %9s\n", "", "bytes", "seconds",
+          "MB/s", "blocks", "p50 ms", "p99 ms", "max ms");
+  stats_table_dir_(&stats->write, file, "write");
+  stats_table_dir_(&stats->read, file, "read");
+  fprintf(file, "handshakes %llu (%.3fs), retries %llu, stalls %llu\n",
+          stats->handshakes, stats->handshake_seconds, stats->retries,
+          stats->stalls);
+
+  if (!stats->write.blocks && !stats->read.blocks) {
+    return;
+  }
+  fprintf(file, "%-12s %8s %8s\n", "latency", "write", "read");
+  for (usize i = 0; i < NUS_STATS_BUCKETS; i++) {
+    if (stats->write.buckets[i] || stats->read.buckets[i]) {
+      fprintf(file, "< %8.3f ms %8llu %8llu\n", (f64)(1ULL << i) / 1e3,
+              stats->write.buckets[i], stats->read.buckets[i]);
+    }
+  }
+}
+
+#ifdef TEST
+
+#include <stdlib.h>
+
+void test_nus_stats(void **state) {
+  NusStats stats;
+  nus_stats_init(&stats);
+
+  // latencies land in log2 buckets of microseconds
+  nus_stats_block(&stats.read, 0.0000005);
+  nus_stats_block(&stats.read, 0.000003);
+  for (usize i = 0; i < 98; i++) {
+    nus_stats_block(&stats.read, 0.001);
+  }
+  assert_int_equal(100, stats.read.blocks);
+  assert_int_equal(1, stats.read.buckets[0]);
+  assert_int_equal(1, stats.read.buckets[2]);
+  assert_int_equal(98, stats.read.buckets[10]);
+  assert_true(nus_stats_percentile(&stats.read, 0.01) <= 0.000001);
+  assert_true(nus_stats_percentile(&stats.read, 0.5) == 0.001);
+  assert_true(nus_stats_percentile(&stats.read, 1) == 0.001);
+  assert_true(nus_stats_percentile(&stats.write, 0.5) == 0);
+
+  // very slow blocks go into the top bucket
+  nus_stats_block(&stats.write, 1e6);
+  assert_int_equal(1, stats.write.buckets[NUS_STATS_BUCKETS - 1]);
+
+  assert_int_equal(NUS_STATS_TABLE, nus_stats_format_from_name(NULL));
+  assert_int_equal(NUS_STATS_JSON, nus_stats_format_from_name("json"));
+  assert_int_equal(NUS_STATS_OFF, nus_stats_format_from_name("xml"));
+
+  stats.read.bytes = 2000000;
+  stats.read.seconds = 0.5;
+  stats.stalls = 3;
+  char *text = NULL;
+  size_t len = 0;
+  FILE *f = open_memstream(&text, &len);
+  nus_stats_print(&stats, f, NUS_STATS_JSON);
+  fclose(f);
+  assert_non_null(strstr(text, "\"read\":{\"bytes\":2000000,"));
+  assert_non_null(strstr(text, "\"mbps\":4.000"));
+  assert_non_null(strstr(text, "\"histogram\":[[1,1],[4,1],[1024,98]]"));
+  assert_non_null(strstr(text, "\"stalls\":3}\n"));
+  free(text);
+
+  f = open_memstream(&text, &len);
+  nus_stats_print(&stats, f, NUS_STATS_TABLE);
+  fclose(f);
+  assert_non_null(strstr(text, "read        2000000"));
+  assert_non_null(strstr(text, "stalls 3\n"));
+  free(text);
+}
+
+#endif
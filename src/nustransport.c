@@ -0,0 +1,275 @@
+#include "nustransport.h"
+#include "cfg.h"
+#include "macros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+Error nus_transport_init(NusTransport *transport, const char *spec) {
+  memset(transport, 0, sizeof(NusTransport));
+  transport->ops = &nus_transport_ftdi;
+  if (spec == NULL || strcmp(spec, "ftdi") == 0) {
+    return OK;
+  }
+
+  if (strncmp(spec, "emu", 3) != 0 || (spec[3] != '\0' && spec[3] != ':')) {
+    return ERR_TRANSPORT;
+  }
+  transport->ops = &nus_transport_emu;
+
+  // emu:BYTES_PER_S:LATENCY_US, both are optional
+  const char *p = spec + 3;
+  u64 *fields[] = {&transport->bandwidth, &transport->latency_us};
+  for (usize i = 0; i < 2 && *p == ':'; i++) {
+    char *end = NULL;
+    *fields[i] = strtoull(p + 1, &end, 0);
+    if (end == p + 1) {
+      return ERR_TRANSPORT;
+    }
+    p = end;
+  }
+  return *p ? ERR_TRANSPORT : OK;
+}
+
+Error nus_transport_open(NusTransport *transport) {
+  if (nuss_verbose) {
+    fprintf(stderr, "opening %s transport\n", transport->ops->name);
+  }
+  return transport->ops->open(transport);
+}
+
+Error nus_transport_write(NusTransport *transport, const u8 *data,
+                          usize len) {
+  return transport->ops->write(transport, data, len);
+}
+
+i64 nus_transport_read(NusTransport *transport, u8 *data, usize len) {
+  return transport->ops->read(transport, data, len);
+}
+
+Error nus_transport_close(NusTransport *transport) {
+  Error err = transport->ops->close(transport);
+  transport->ctx = NULL;
+  return err;
+}
+
+#ifndef NO_NUSUSB
+
+#include <libftdi1/ftdi.h>
+
+#define NUS_USB_VENDOR 0x0403
+#define NUS_USB_DEVICE 0x6001
+#define NUS_USB_READ_TIMEOUT 5000
+#define NUS_USB_WRITE_TIMEOUT 5000
+#define NUS_BAUD 9600
+
+// transfers queued at once while uploading
+#define NUS_USB_INFLIGHT 4
+// ms the ftdi chip holds back small reads before sending them
+#define NUS_USB_LATENCY 2
+// size of the usb transfers libftdi splits reads and writes into
+#define NUS_USB_CHUNK_SIZE 0x10000
+
+// the serial number of the ftdi chip on the cart
+static void ftdi_serial_(struct ftdi_context *ftdi, char *serial, usize len) {
+  serial[0] = '\0';
+  if (ftdi_read_eeprom(ftdi) < 0 || ftdi_eeprom_decode(ftdi, 0) < 0 ||
+      ftdi_eeprom_get_strings(ftdi, NULL, 0, NULL, 0, serial, (int)len) < 0 ||
+      !serial[0]) {
+    snprintf(serial, len, NUS_TRANSPORT_SERIAL_UNKNOWN);
+  }
+}
+
+static Error ftdi_open_(NusTransport *transport) {
+  struct ftdi_context *ftdi = ftdi_new();
+  if (ftdi == NULL) {
+    if (nuss_verbose) {
+      fprintf(stderr, "ftdi failed\n");
+    }
+    return ERR_NUS_USB;
+  }
+
+  int device = ftdi_usb_open(ftdi, NUS_USB_VENDOR, NUS_USB_DEVICE);
+  if (device < 0) {
+    if (nuss_verbose) {
+      fprintf(stderr, "unable to open ftdi device: %d (%s)\n", device,
+              ftdi_get_error_string(ftdi));
+    }
+    ftdi_free(ftdi);
+    return ERR_NUS_USB;
+  }
+
+  ftdi->usb_read_timeout = NUS_USB_READ_TIMEOUT;
+  ftdi->usb_write_timeout = NUS_USB_WRITE_TIMEOUT;
+
+  if (ftdi_set_baudrate(ftdi, NUS_BAUD) < 0) {
+    ftdi_usb_close(ftdi);
+    ftdi_free(ftdi);
+    return ERR_NUS_USB;
+  }
+
+  // fewer, larger transfers and a short latency timer
+  // so command responses are not held back by the chip
+  if (ftdi_set_latency_timer(ftdi, NUS_USB_LATENCY) < 0 ||
+      ftdi_write_data_set_chunksize(ftdi, NUS_USB_CHUNK_SIZE) < 0 ||
+      ftdi_read_data_set_chunksize(ftdi, NUS_USB_CHUNK_SIZE) < 0) {
+    if (nuss_verbose) {
+      fprintf(stderr, "unable to tune the ftdi chip: %s\n",
+              ftdi_get_error_string(ftdi));
+    }
+  }
+
+  if (ftdi->type == TYPE_R && nuss_verbose) {
+    u32 chipid = 0;
+    fprintf(stderr, "ftdi_read_chipid: %d\n", ftdi_read_chipid(ftdi, &chipid));
+    fprintf(stderr, "ftdi chipid: %X\n", chipid);
+  }
+
+  ftdi_serial_(ftdi, transport->serial, sizeof(transport->serial));
+  transport->ctx = ftdi;
+  return OK;
+}
+
+// writes len bytes with up to NUS_USB_INFLIGHT transfers queued,
+// so the next block is already submitted while the current one
+// is on the wire. Falls back to blocking writes if submitting fails
+static Error ftdi_write_(NusTransport *transport, const u8 *data, usize len) {
+  struct ftdi_context *ftdi = transport->ctx;
+  const usize block_size = NUS_USB_CHUNK_SIZE;
+  struct ftdi_transfer_control *inflight[NUS_USB_INFLIGHT];
+  usize sizes[NUS_USB_INFLIGHT];
+  f64 started[NUS_USB_INFLIGHT];
+  NusStatsDir *stats = transport->stats ? &transport->stats->write : NULL;
+  usize head = 0;
+  usize count = 0;
+  usize submitted = 0;
+  usize done = 0;
+  Error err = OK;
+
+  while (!err && done < len) {
+    while (count < NUS_USB_INFLIGHT && submitted < len) {
+      usize size = MIN(block_size, len - submitted);
+      struct ftdi_transfer_control *tc =
+          ftdi_write_data_submit(ftdi, (u8 *)data + submitted, (int)size);
+      if (tc == NULL) {
+        break;
+      }
+      usize slot = (head + count) % NUS_USB_INFLIGHT;
+      inflight[slot] = tc;
+      sizes[slot] = size;
+      started[slot] = nus_stats_now();
+      submitted += size;
+      count++;
+    }
+
+    if (count == 0) {
+      usize size = MIN(block_size, len - done);
+      f64 start = nus_stats_now();
+      int amount = ftdi_write_data(ftdi, data + done, (int)size);
+      if (amount <= 0) {
+        err = ERR_NUS_USB;
+        break;
+      }
+      if (stats) {
+        nus_stats_block(stats, nus_stats_now() - start);
+      }
+      done += amount;
+      submitted = done;
+    } else {
+      int amount = ftdi_transfer_data_done(inflight[head]);
+      if (amount != (int)sizes[head]) {
+        err = ERR_NUS_USB;
+      }
+      if (stats) {
+        nus_stats_block(stats, nus_stats_now() - started[head]);
+      }
+      done += sizes[head];
+      head = (head + 1) % NUS_USB_INFLIGHT;
+      count--;
+    }
+
+    if (nuss_verbose && len > block_size) {
+      fprintf(stderr, "sent %li/%li bytes\n", done, len);
+    }
+  }
+
+  // the data has to outlive every queued transfer
+  for (; count; count--) {
+    ftdi_transfer_data_done(inflight[head]);
+    head = (head + 1) % NUS_USB_INFLIGHT;
+  }
+
+  if (err && nuss_verbose) {
+    fprintf(stderr, "send timeout!\n");
+  }
+  return err;
+}
+
+static i64 ftdi_read_(NusTransport *transport, u8 *data, usize len) {
+  return ftdi_read_data(transport->ctx, data, (int)len);
+}
+
+static Error ftdi_close_(NusTransport *transport) {
+  struct ftdi_context *ftdi = transport->ctx;
+  if (ftdi_usb_close(ftdi) < 0) {
+    fprintf(stderr, "ftdi close failed: %s\n", ftdi_get_error_string(ftdi));
+    ftdi_free(ftdi);
+    return ERR_NUS_USB;
+  }
+  ftdi_free(ftdi);
+
+  return OK;
+}
+
+#else
+
+static Error ftdi_open_(NusTransport *transport) {
+  fprintf(stderr,
+          "Nus usb is disabled. Recompile with the feature turned on!\n");
+
+  return ERR_NUS_USB;
+}
+
+static Error ftdi_write_(NusTransport *transport, const u8 *data, usize len) {
+  return ERR_NUS_USB;
+}
+
+static i64 ftdi_read_(NusTransport *transport, u8 *data, usize len) {
+  return -1;
+}
+
+static Error ftdi_close_(NusTransport *transport) { return ERR_NUS_USB; }
+
+#endif
+
+const NusTransportOps nus_transport_ftdi = {"ftdi", ftdi_open_, ftdi_write_,
+                                            ftdi_read_, ftdi_close_};
+
+#ifdef TEST
+
+void test_nus_transport_init(void **state) {
+  NusTransport t;
+  assert_int_equal(OK, nus_transport_init(&t, NULL));
+  assert_ptr_equal(&nus_transport_ftdi, t.ops);
+  assert_int_equal(OK, nus_transport_init(&t, "ftdi"));
+  assert_ptr_equal(&nus_transport_ftdi, t.ops);
+
+  assert_int_equal(OK, nus_transport_init(&t, "emu"));
+  assert_ptr_equal(&nus_transport_emu, t.ops);
+  assert_int_equal(0, t.bandwidth);
+  assert_int_equal(0, t.latency_us);
+
+  assert_int_equal(OK, nus_transport_init(&t, "emu:8000000:125"));
+  assert_int_equal(8000000, t.bandwidth);
+  assert_int_equal(125, t.latency_us);
+  assert_int_equal(OK, nus_transport_init(&t, "emu:0x100000"));
+  assert_int_equal(0x100000, t.bandwidth);
+  assert_int_equal(0, t.latency_us);
+
+  assert_int_equal(ERR_TRANSPORT, nus_transport_init(&t, "emulator"));
+  assert_int_equal(ERR_TRANSPORT, nus_transport_init(&t, "emu:"));
+  assert_int_equal(ERR_TRANSPORT, nus_transport_init(&t, "emu:1:2:3"));
+  assert_int_equal(ERR_TRANSPORT, nus_transport_init(&t, "serial"));
+}
+
+#endif
@@ -1,5 +1,8 @@
 #include "nususb.h"
 #include "cfg.h"
+#include "nusheader.h"
+#include "nusmanifest.h"
+#include "session.h"
 #include "error.h"
 #include "macros.h"
 #include <stdio.h>
@@ -7,32 +10,41 @@
 #include <time.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 #include <unistd.h>
 
-#ifndef NO_NUSUSB
-
-#include <libftdi1/ftdi.h>
-
-#define NUS_USB_VENDOR 0x0403
-#define NUS_USB_DEVICE 0x6001
-#define NUS_USB_READ_TIMEOUT 5000
-#define NUS_USB_WRITE_TIMEOUT 5000
-#define BUFFER_SIZE 1024
-#define NUS_BAUD 9600
-#define NUS_USB_BUF_LEN 512
+// bytes requested by a single read command, a multiple of NUS_USB_BUF_LEN
+#define NUS_USB_READ_BLOCK 0x10000
+// read commands queued ahead of the region that is arriving
+#define NUS_USB_READ_AHEAD 1
+// seconds without any data before a read times out
+#define NUS_USB_READ_TIMEOUT 2
+// first and longest pause between polls of a cart that is busy, in us
+#define NUS_USB_BACKOFF_MIN 250
+#define NUS_USB_BACKOFF_MAX 20000
+// test commands sent to a cart that answers with garbage
+#define NUS_USB_READY_TRIES 3
+// bytes read back from every block a delta load skips
+#define NUS_USB_SAMPLE 512
+// samples requested ahead of the one that is arriving
+#define NUS_USB_SAMPLE_AHEAD 8
+// regions a streaming read holds while they are written
+#define NUS_USB_STREAM_SLOTS 32
 
 #define NUS_ROM_BASE_ADDRESS 0x10000000
 #define NUS_RAM_BASE_ADDRESS 0x80000000
 
-u8 write_buffer[NUS_USB_BUF_LEN];
-u8 read_buffer[NUS_USB_BUF_LEN];
+static NusStats usb_stats_;
 
-void command_setup(char cmd, u32 address, u32 len, u32 argument) {
-  memcpy(write_buffer, "cmdW", 5);
-  write_buffer[0] = 'c';
-  write_buffer[1] = 'm';
-  write_buffer[2] = 'd';
-  write_buffer[3] = cmd;
+NusStats *nus_usb_stats(void) { return &usb_stats_; }
+
+static void command_setup_(NusUsb *usb, char cmd, u32 address, u32 len,
+                           u32 argument) {
+  memset(usb->cmd, 0, NUS_USB_BUF_LEN);
+  usb->cmd[0] = 'c';
+  usb->cmd[1] = 'm';
+  usb->cmd[2] = 'd';
+  usb->cmd[3] = cmd;
 
   if (nuss_verbose) {
     fprintf(stderr, "sending command '%c' to address 0x%x len %d arg %d\n", cmd,
@@ -42,286 +54,914 @@ void command_setup(char cmd, u32 address, u32 len, u32 argument) {
   // convert to big endian (network) byte order
   address = htonl(address);
   if (len != 0) {
-    len = htonl(MAX(len, NUS_USB_BUF_LEN) /
-                0x200); // take buffer size into account
+    // the cart counts in whole blocks
+    len = htonl((len + NUS_USB_BUF_LEN - 1) / NUS_USB_BUF_LEN);
   }
   argument = htonl(argument);
-  memcpy(&write_buffer[4], &address, sizeof(u32));
-  memcpy(&write_buffer[8], &len, sizeof(u32));
-  memcpy(&write_buffer[12], &argument, sizeof(u32));
+  memcpy(&usb->cmd[4], &address, sizeof(u32));
+  memcpy(&usb->cmd[8], &len, sizeof(u32));
+  memcpy(&usb->cmd[12], &argument, sizeof(u32));
 }
 
-usize command_send_(struct ftdi_context *ftdi) {
-  usize write_amount = ftdi_write_data(ftdi, write_buffer, NUS_USB_BUF_LEN);
+static Error command_send_(NusUsb *usb) {
+  Error err = nus_transport_write(&usb->transport, usb->cmd, NUS_USB_BUF_LEN);
 
   if (nuss_verbose) {
-    fprintf(stderr, "sent %li bytes\n", write_amount);
+    fprintf(stderr, "sent command: %d\n", err);
   }
 
-  return write_amount;
+  return err;
 }
 
-usize response_read(struct ftdi_context *ftdi) {
-  usize read_amount = ftdi_read_data(ftdi, read_buffer, NUS_USB_BUF_LEN);
-
-  if (nuss_verbose) {
-    fprintf(stderr, "read %li bytes\n", read_amount);
-  }
-  return read_amount;
+static void usb_pause_(u64 us) {
+  struct timespec ts = {(time_t)(us / 1000000), (long)(us % 1000000) * 1000};
+  nanosleep(&ts, NULL);
 }
 
-Error usb_test(struct ftdi_context *ftdi) {
-  // retry test
-  for (u32 i = 0; i < 3; i++) {
-    // test connection
-    command_setup('t', 0, 0, 0);
-    command_send_(ftdi);
-    response_read(ftdi);
+// reads exactly len bytes. The chip answers with empty reads while
+// the cart is still busy, those are polled again after a pause that
+// doubles every time. Only a cart that sends nothing at all
+// for NUS_USB_READ_TIMEOUT seconds times out
+static Error usb_read_block_(NusUsb *usb, u8 *dst, usize len) {
+  f64 deadline = nus_stats_now() + NUS_USB_READ_TIMEOUT;
+  u64 pause = NUS_USB_BACKOFF_MIN;
+  for (usize got = 0; got < len;) {
+    i64 amount = nus_transport_read(&usb->transport, dst + got, len - got);
+    if (amount < 0) {
+      return ERR_NUS_USB;
+    }
+    if (amount > 0) {
+      got += amount;
+      deadline = nus_stats_now() + NUS_USB_READ_TIMEOUT;
+      pause = NUS_USB_BACKOFF_MIN;
+      continue;
+    }
 
-    // test command should return k or r (r is newer)
-    if (read_buffer[3] == 'k' || read_buffer[3] == 'r') {
-      if (nuss_verbose) {
-        printf("init test: ok\n");
-      }
-      return OK;
-    } else {
-      if (nuss_verbose) {
-        fprintf(stderr, "Init test failed!\n");
-      }
+    usb_stats_.stalls++;
+    if (nus_stats_now() >= deadline) {
+      return ERR_NUS_USB;
     }
+    usb_pause_(pause);
+    pause = MIN(pause * 2, NUS_USB_BACKOFF_MAX);
   }
-  ftdi_free(ftdi);
-  return ERR_NUS_USB;
+  return OK;
 }
 
-Error usb_init(struct ftdi_context **ftdi) {
-  *ftdi = ftdi_new();
-  if (*ftdi == NULL) {
-    if (nuss_verbose) {
-      fprintf(stderr, "ftdi failed\n");
+// waits until the cart is ready for the next command.
+// The cart only answers the test command once it is done with
+// the previous one, so this returns as soon as it is
+static Error usb_ready_(NusUsb *usb) {
+  f64 start = nus_stats_now();
+  usb_stats_.handshakes++;
+
+  Error err = ERR_NUS_USB;
+  for (u32 i = 0; err && i < NUS_USB_READY_TRIES; i++) {
+    if (i) {
+      usb_stats_.retries++;
+    }
+    command_setup_(usb, 't', 0, 0, 0);
+    memset(usb->reply, 0, NUS_USB_BUF_LEN);
+    if (command_send_(usb) ||
+        usb_read_block_(usb, usb->reply, NUS_USB_BUF_LEN)) {
+      // a cart that does not answer at all will not answer a second test
+      break;
     }
-    return ERR_NUS_USB;
-  }
 
-  u32 device = ftdi_usb_open(*ftdi, NUS_USB_VENDOR, NUS_USB_DEVICE);
-  if (device < 0) {
-    ftdi_free(*ftdi);
-    if (nuss_verbose) {
-      fprintf(stderr, "unable to open ftdi device: %d (%s)\n", device,
-              ftdi_get_error_string(*ftdi));
+    // test command should return k or r (r is newer)
+    if (usb->reply[3] == 'k' || usb->reply[3] == 'r') {
+      err = OK;
     }
-    return ERR_NUS_USB;
   }
 
-  (*ftdi)->usb_read_timeout = NUS_USB_READ_TIMEOUT;
-  (*ftdi)->usb_write_timeout = NUS_USB_WRITE_TIMEOUT;
-
-  u32 baud_ok = ftdi_set_baudrate(*ftdi, NUS_BAUD);
-
-  if (baud_ok < 0) {
-    ftdi_free(*ftdi);
-    return ERR_NUS_USB;
+  if (nuss_verbose) {
+    fprintf(stderr, "ready test: %s\n", err ? "failed" : "ok");
   }
+  usb_stats_.handshake_seconds += nus_stats_now() - start;
+  return err;
+}
 
-  if ((*ftdi)->type == TYPE_R && nuss_verbose) {
-    u32 chipid = 0;
-    fprintf(stderr, "ftdi_read_chipid: %d\n",
-            ftdi_read_chipid((*ftdi), &chipid));
-    fprintf(stderr, "ftdi chipid: %X\n", chipid);
+static Error usb_boot_(NusUsb *usb) {
+  if (nuss_verbose) {
+    fprintf(stderr, "Booting...\n");
   }
 
-  memset(write_buffer, 0, NUS_USB_BUF_LEN);
-  memset(read_buffer, 0, NUS_USB_BUF_LEN);
+  // put it into pif boot mode
+  command_setup_(usb, 's', 0, 0, 1);
+  return command_send_(usb) ? ERR_NUS_USB : OK;
+}
 
-  if (usb_test(*ftdi)) {
-    return ERR_NUS_USB;
+// loads the manifest of the cart and reads back the start of the rom.
+// A power cycle or a load from somewhere else leaves something else
+// there, then the cart cannot be trusted to hold the old blocks.
+// Carts without a serial share one manifest and are never trusted
+static bool usb_delta_(NusUsb *usb, u32 addr, NusManifest *prev) {
+  if (strcmp(usb->transport.serial, NUS_TRANSPORT_SERIAL_UNKNOWN) == 0 ||
+      nus_manifest_load(prev, usb->transport.serial) || prev->addr != addr ||
+      prev->len < NUS_MANIFEST_PROBE) {
+    return FALSE;
   }
 
-  return OK;
+  u8 probe[NUS_MANIFEST_PROBE];
+  command_setup_(usb, 'R', addr, NUS_MANIFEST_PROBE, 0);
+  if (command_send_(usb) || usb_read_block_(usb, probe, NUS_MANIFEST_PROBE)) {
+    return FALSE;
+  }
+  if (nus_manifest_hash(probe, NUS_MANIFEST_PROBE) != prev->probe) {
+    if (nuss_verbose) {
+      fprintf(stderr, "The cart does not hold the last load anymore\n");
+    }
+    return FALSE;
+  }
+  return TRUE;
 }
 
-Error usb_free(struct ftdi_context *ftdi) {
-  if (ftdi_usb_close(ftdi) < 0) {
-    fprintf(stderr, "ftdi close failed: %s\n", ftdi_get_error_string(ftdi));
-    ftdi_free(ftdi);
-    return ERR_NUS_USB;
+// reads back a sample of every block that is about to be skipped.
+// The probe only covers the header and two builds of the same rom
+// share it, so a cart that was loaded from somewhere else may pass it.
+// The samples are taken at a different offset on every load
+static bool usb_clean_match_(NusUsb *usb, u32 addr, const u8 *data,
+                             const NusManifest *prev,
+                             const NusManifest *next) {
+  usize *offsets = malloc(next->count * sizeof(usize));
+  if (offsets == NULL) {
+    return FALSE;
+  }
+  u64 seed = (u64)(nus_stats_now() * 1e9);
+  usize samples = 0;
+  for (usize i = 0; i < next->count; i++) {
+    if (nus_manifest_dirty(prev, next, i)) {
+      continue;
+    }
+    usize size = MIN(NUS_MANIFEST_BLOCK, next->len - i * NUS_MANIFEST_BLOCK);
+    usize slots = MAX(size / NUS_USB_SAMPLE, 1);
+    usize slot = (usize)(((seed + i) * 0x9E3779B97F4A7C15ULL) >> 32) % slots;
+    offsets[samples++] = i * NUS_MANIFEST_BLOCK + slot * NUS_USB_SAMPLE;
   }
-  ftdi_free(ftdi);
 
-  return OK;
+  // a few samples are requested ahead. After a mismatch nothing new
+  // is requested but the samples already requested are still read,
+  // so no reply is left behind for the next command
+  bool match = TRUE;
+  usize requested = 0;
+  usize received = 0;
+  u8 sample[NUS_USB_SAMPLE];
+  while (received < requested || (match && requested < samples)) {
+    for (; match && requested < samples &&
+           requested - received <= NUS_USB_SAMPLE_AHEAD;
+         requested++) {
+      command_setup_(usb, 'R', addr + offsets[requested], NUS_USB_SAMPLE, 0);
+      if (command_send_(usb)) {
+        match = FALSE;
+        break;
+      }
+    }
+    if (received == requested) {
+      break;
+    }
+    if (usb_read_block_(usb, sample, NUS_USB_SAMPLE)) {
+      match = FALSE;
+      break;
+    }
+    usize len = MIN(NUS_USB_SAMPLE, next->len - offsets[received]);
+    if (memcmp(sample, data + offsets[received], len) != 0) {
+      match = FALSE;
+    }
+    received++;
+  }
+  free(offsets);
+
+  if (!match && nuss_verbose) {
+    fprintf(stderr, "The cart does not hold the last load anymore\n");
+  }
+  return match;
 }
 
-Error nus_usb_boot() {
-  struct ftdi_context *ftdi = NULL;
-  if (usb_init(&ftdi)) {
+// sends len bytes to addr with a single write command
+static Error usb_write_run_(NusUsb *usb, const u8 *data, usize len, u32 addr,
+                            char command) {
+  // init write
+  // The upload is offset by 496 because we do not start data transfer with
+  // this packet, but with the packet after!
+  command_setup_(usb, command, addr, len, 0);
+  if (nus_transport_write(&usb->transport, usb->cmd, 16)) {
     return ERR_NUS_USB;
   }
 
   if (nuss_verbose) {
-    fprintf(stderr, "Booting...\n");
+    fprintf(stderr, "Writing %li bytes to 0x%x...\n", len, addr);
   }
 
-  // put it into pif boot mode
-  command_setup('s', 0, 0, 1);
-  command_send_(ftdi);
-
-  // free ftdi
-  if (usb_free(ftdi)) {
-    return ERR_NUS_USB;
+  // the last block is padded, the cart waits for all blocks it was promised.
+  // Only the transfers of the payload go into the statistics
+  usize whole = len / NUS_USB_BUF_LEN * NUS_USB_BUF_LEN;
+  u8 last[NUS_USB_BUF_LEN] = {0};
+  memcpy(last, data + whole, len - whole);
+  usb->transport.stats = &usb_stats_;
+  Error err = nus_transport_write(&usb->transport, data, whole);
+  if (!err && whole != len) {
+    err = nus_transport_write(&usb->transport, last, NUS_USB_BUF_LEN);
   }
-
-  return OK;
+  usb->transport.stats = NULL;
+  return err;
 }
 
-Error nus_usb_write(Buffer *buffer, u32 addr, char command) {
-  struct ftdi_context *ftdi = NULL;
-  if (usb_init(&ftdi)) {
-    return ERR_NUS_USB;
+static Error usb_write_(NusUsb *usb, Buffer *buffer, u32 addr, char command) {
+  const char *serial = usb->transport.serial;
+
+  // padding is sent with the fill command instead of being streamed.
+  // The command works on whole blocks so the data is sent up to a block
+  // boundary. Ram writes have no fill command and send everything
+  if (command == 'W') {
+    buffer_materialize(buffer, (buffer->len + NUS_USB_BUF_LEN - 1) /
+                                   NUS_USB_BUF_LEN * NUS_USB_BUF_LEN);
+  } else {
+    buffer_materialize(buffer, (usize)-1);
   }
 
   // test size and fill if needed
   const u32 crc_area = 0x100000 + 4096;
-  if (buffer->len < crc_area && command == 'W') {
+  if (buffer_len(buffer) < crc_area && command == 'W') {
     if (nuss_verbose) {
       fprintf(stderr, "Filling rom space...\n");
     }
 
-    command_setup('c', addr, MAX(crc_area, buffer->len), 0);
-    command_send_(ftdi);
+    command_setup_(usb, 'c', addr, MAX(crc_area, buffer_len(buffer)), 0);
+    command_send_(usb);
 
-    if (usb_test(ftdi)) {
+    if (usb_ready_(usb)) {
       return ERR_NUS_USB;
     }
   }
 
-  // init write
-  // The upload is offset by 496 because we do not start data transfer with this
-  // packet, but with the packet after!
-  command_setup(command, addr, buffer->len, 0);
-  ftdi_write_data(ftdi, write_buffer, 16);
+  if (buffer->fill_len && command == 'W') {
+    if (nuss_verbose) {
+      fprintf(stderr, "Filling %li bytes of padding...\n", buffer->fill_len);
+    }
 
-  const usize block_size = 0x8000;
-  if (nuss_verbose) {
-    fprintf(stderr, "Writing %li bytes with block size %ld...\n", buffer->len,
-            block_size);
+    // the fill value is repeated in every byte of the argument
+    u32 fill_blocks =
+        (buffer->fill_len + NUS_USB_BUF_LEN - 1) / NUS_USB_BUF_LEN;
+    command_setup_(usb, 'c', addr + buffer->len, fill_blocks * NUS_USB_BUF_LEN,
+                   buffer->fill_val * 0x01010101U);
+    command_send_(usb);
+
+    if (usb_ready_(usb)) {
+      return ERR_NUS_USB;
+    }
+  }
+
+  // rom blocks the cart already holds from the last load are skipped.
+  // The rom fill above clears the whole crc area, so nothing is kept then
+  bool rom = command == 'W';
+  NusManifest prev;
+  NusManifest next;
+  nus_manifest_init(&prev);
+  nus_manifest_init(&next);
+  bool delta =
+      rom && buffer_len(buffer) >= crc_area && usb_delta_(usb, addr, &prev);
+  if (rom) {
+    // the manifest is only valid again once the load went through
+    nus_manifest_forget(serial);
+    if (nus_manifest_build(&next, addr, buffer->data, buffer->len)) {
+      delta = FALSE;
+    }
+  }
+  if (delta && !usb_clean_match_(usb, addr, buffer->data, &prev, &next)) {
+    delta = FALSE;
   }
 
   // TODO maybe verify that the rom is uploaded correcly
   // all the way! Dumping is pretty slow atm though, no fun at all!
-  u32 amount = 0;
-  for (usize sent = 0; sent < buffer->len; sent += amount) { // NOLINT
-    i32 size = MIN(block_size, buffer->len - sent);
-    amount = ftdi_write_data(ftdi, buffer->data + sent, size);
-
-    if (amount > 0 && nuss_verbose) {
-      fprintf(stderr, "sent %d bytes - %li/%li bytes\n", amount, amount + sent,
-              buffer->len);
-    } else if (amount <= 0) {
+  Error err = OK;
+  usize sent = 0;
+  f64 start = nus_stats_now();
+  if (!delta) {
+    err = usb_write_run_(usb, buffer->data, buffer->len, addr, command);
+    sent = buffer->len;
+  }
+  for (usize i = 0; delta && !err && i < next.count;) {
+    if (!nus_manifest_dirty(&prev, &next, i)) {
+      i++;
+      continue;
+    }
+    usize end = i + 1;
+    while (end < next.count && nus_manifest_dirty(&prev, &next, end)) {
+      end++;
+    }
+    usize offset = i * NUS_MANIFEST_BLOCK;
+    usize len = MIN(end * NUS_MANIFEST_BLOCK, buffer->len);
+    err = usb_write_run_(usb, buffer->data + offset, len - offset,
+                         addr + offset, command);
+    sent += len - offset;
+    i = end;
+  }
+
+  if (!err && rom && nus_manifest_save(&next, serial) && nuss_verbose) {
+    fprintf(stderr, "Unable to save the manifest of cart %s\n", serial);
+  }
+  nus_manifest_free(&next);
+  nus_manifest_free(&prev);
+  if (err) {
+    return ERR_NUS_USB;
+  }
+
+  if (delta) {
+    usb->load = (NusUsbLoad){TRUE, sent, buffer->len};
+  }
+  f64 elapsed = nus_stats_now() - start;
+  usb_stats_.write.bytes += sent;
+  usb_stats_.write.seconds += elapsed;
+  if (nuss_verbose) {
+    fprintf(stderr, "Wrote %li bytes in %.2fs (%.2f MB/s)\n", sent, elapsed,
+            (f64)sent / (elapsed > 0 ? elapsed : 1e-9) / 1e6);
+  }
+
+  // the next command has to wait until the cart stored everything
+  return usb_ready_(usb);
+}
+
+// a dump that does not match the manifest means the cart was
+// changed behind our back, the next load sends everything
+static void usb_check_manifest_(const char *serial, const Buffer *buffer,
+                                u32 addr) {
+  NusManifest manifest;
+  nus_manifest_init(&manifest);
+  if (nus_manifest_load(&manifest, serial) == OK &&
+      nus_manifest_mismatches(&manifest, addr, buffer->data, buffer->len)) {
+    if (nuss_verbose) {
+      fprintf(stderr, "The dump does not match the last load\n");
+    }
+    nus_manifest_forget(serial);
+  }
+  nus_manifest_free(&manifest);
+}
+
+// where the regions of a read go. region returns the memory the
+// next wire bytes are read into, done is called once they arrived
+typedef struct UsbSink { // NOLINT
+  u8 *(*region)(void *ctx, usize offset, usize wire);
+  Error (*done)(void *ctx, usize offset, usize size);
+  void *ctx;
+} UsbSink;
+
+// reads len bytes from addr region by region into the sink
+static Error usb_read_regions_(NusUsb *usb, const UsbSink *sink, usize len,
+                               u32 addr, char command) {
+  // every command requests a large region. The commands for the next
+  // regions are already queued while the current one is arriving,
+  // so the cart never waits for the host between regions
+  const usize block_size = NUS_USB_READ_BLOCK;
+  if (nuss_verbose) {
+    fprintf(stderr, "Reading %li bytes with block size %ld...\n", len,
+            block_size);
+  }
+
+  usize blocks = (len + block_size - 1) / block_size;
+  usize requested = 0;
+  f64 start = nus_stats_now();
+  // when the command of each queued region was sent
+  f64 sent_at[NUS_USB_READ_AHEAD + 1];
+
+  for (usize i = 0; i < blocks; i++) {
+    for (; requested < blocks && requested <= i + NUS_USB_READ_AHEAD;
+         requested++) {
+      usize offset = requested * block_size;
+      usize size = MIN(block_size, len - offset);
+      command_setup_(usb, command, addr + offset,
+                     (size + NUS_USB_BUF_LEN - 1) / NUS_USB_BUF_LEN *
+                         NUS_USB_BUF_LEN,
+                     0);
+      if (command_send_(usb)) {
+        return ERR_NUS_USB;
+      }
+      sent_at[requested % (NUS_USB_READ_AHEAD + 1)] = nus_stats_now();
+    }
+
+    usize offset = i * block_size;
+    usize size = MIN(block_size, len - offset);
+    usize wire =
+        (size + NUS_USB_BUF_LEN - 1) / NUS_USB_BUF_LEN * NUS_USB_BUF_LEN;
+    u8 *dst = sink->region(sink->ctx, offset, wire);
+    if (dst == NULL) {
+      return ERR_WRITE;
+    }
+    if (usb_read_block_(usb, dst, wire)) {
       if (nuss_verbose) {
-        fprintf(stderr, "send timeout!\n");
+        fprintf(stderr, "read timeout!\n");
       }
-      ftdi_free(ftdi);
       return ERR_NUS_USB;
     }
+    nus_stats_block(&usb_stats_.read,
+                    nus_stats_now() - sent_at[i % (NUS_USB_READ_AHEAD + 1)]);
+    Error err = sink->done(sink->ctx, offset, size);
+    if (err) {
+      return err;
+    }
+
+    if (nuss_verbose) {
+      fprintf(stderr, "read %li/%li bytes\n", offset + size, len);
+    }
+  }
+
+  f64 elapsed = nus_stats_now() - start;
+  usb_stats_.read.bytes += len;
+  usb_stats_.read.seconds += elapsed;
+  if (nuss_verbose) {
+    fprintf(stderr, "Read %li bytes in %.2fs (%.2f MB/s)\n", len, elapsed,
+            (f64)len / (elapsed > 0 ? elapsed : 1e-9) / 1e6);
+  }
+  return OK;
+}
+
+// the cart sends whole 512 byte blocks,
+// a short last region is read into scratch first
+typedef struct UsbBufferSink { // NOLINT
+  Buffer *buffer;
+  u8 scratch[NUS_USB_READ_BLOCK];
+} UsbBufferSink;
+
+static u8 *usb_buffer_region_(void *ctx, usize offset, usize wire) {
+  UsbBufferSink *sink = ctx;
+  if (offset + wire > sink->buffer->len) {
+    return sink->scratch;
+  }
+  return sink->buffer->data + offset;
+}
+
+static Error usb_buffer_done_(void *ctx, usize offset, usize size) {
+  UsbBufferSink *sink = ctx;
+  if (size % NUS_USB_BUF_LEN) {
+    memcpy(sink->buffer->data + offset, sink->scratch, size);
   }
+  return OK;
+}
 
-  // give the cart some time before continuing
-  sleep(1); // NOLINT
+static Error usb_read_(NusUsb *usb, Buffer *buffer, u32 addr, char command) {
+  buffer_materialize(buffer, (usize)-1);
+  buffer_mark_dirty(buffer, 0, buffer->len);
 
-  // free ftdi
-  if (usb_free(ftdi)) {
+  UsbBufferSink *ctx = malloc(sizeof(UsbBufferSink));
+  if (ctx == NULL) {
     return ERR_NUS_USB;
   }
+  ctx->buffer = buffer;
+  UsbSink sink = {usb_buffer_region_, usb_buffer_done_, ctx};
+  Error err = usb_read_regions_(usb, &sink, buffer->len, addr, command);
+  free(ctx);
 
+  if (!err && command == 'R') {
+    usb_check_manifest_(usb->transport.serial, buffer, addr);
+  }
+  return err;
+}
+
+// A read that goes to a file instead of a buffer.
+// The usb thread fills a ring of NUS_USB_STREAM_SLOTS regions
+// and a writer thread writes and hashes them in order,
+// so the file is written while the next regions arrive
+typedef struct UsbStream { // NOLINT
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t drained;
+
+  u8 *slots;
+  usize sizes[NUS_USB_STREAM_SLOTS];
+  // the oldest filled slot and the amount of filled slots
+  usize head;
+  usize count;
+  // set once the usb thread filled its last slot
+  bool finished;
+  Error err;
+
+  FILE *file;
+  u32 addr;
+  // bytes written so far
+  usize written;
+  NusCrcCtx crc;
+  // blocks of a dump that do not match the manifest of the cart
+  NusManifest manifest;
+  usize mismatches;
+  NusUsbDigest *digest;
+} UsbStream;
+
+// writes and hashes the next size bytes of the read
+static Error usb_stream_consume_(UsbStream *stream, const u8 *data,
+                                 usize size) {
+  if (fwrite(data, 1, size, stream->file) != size) {
+    return ERR_WRITE;
+  }
+
+  NusUsbDigest *digest = stream->digest;
+  digest->crc32 = nus_crc32(digest->crc32, data, size);
+  NusHeader header;
+  if (stream->written == 0 && nus_from_bytes(&header, data, size) == OK) {
+    digest->stored = header.crc;
+  }
+  nus_crc_update(&stream->crc, data, size);
+  stream->mismatches += nus_manifest_mismatches(
+      &stream->manifest, stream->addr + stream->written, data, size);
+  stream->written += size;
   return OK;
 }
 
-Error nus_usb_load(Buffer *buffer, u32 addr) {
-  if (addr == 0) {
-    addr = NUS_ROM_BASE_ADDRESS;
+// the bytes a session daemon streams over its socket
+static Error usb_stream_session_(void *ctx, const u8 *data, usize size) {
+  return usb_stream_consume_(ctx, data, size);
+}
+
+static void *usb_stream_writer_(void *arg) {
+  UsbStream *stream = arg;
+
+  pthread_mutex_lock(&stream->lock);
+  while (!stream->err) {
+    while (stream->count == 0 && !stream->finished) {
+      pthread_cond_wait(&stream->filled, &stream->lock);
+    }
+    if (stream->count == 0) {
+      break;
+    }
+    usize slot = stream->head;
+    pthread_mutex_unlock(&stream->lock);
+
+    Error err = usb_stream_consume_(
+        stream, stream->slots + slot * NUS_USB_READ_BLOCK, stream->sizes[slot]);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->err = err;
+    stream->head = (stream->head + 1) % NUS_USB_STREAM_SLOTS;
+    stream->count--;
+    pthread_cond_signal(&stream->drained);
   }
+  pthread_mutex_unlock(&stream->lock);
 
-  return nus_usb_write(buffer, addr, 'W');
+  return NULL;
+}
+
+// waits for a free slot. Returns NULL once the writer failed
+static u8 *usb_stream_region_(void *ctx, usize offset, usize wire) {
+  UsbStream *stream = ctx;
+  pthread_mutex_lock(&stream->lock);
+  while (stream->count == NUS_USB_STREAM_SLOTS && !stream->err) {
+    pthread_cond_wait(&stream->drained, &stream->lock);
+  }
+  usize slot = (stream->head + stream->count) % NUS_USB_STREAM_SLOTS;
+  bool failed = stream->err != OK;
+  pthread_mutex_unlock(&stream->lock);
+  return failed ? NULL : stream->slots + slot * NUS_USB_READ_BLOCK;
 }
 
-Error nus_usb_read(Buffer *buffer, u32 addr, char command) {
-  struct ftdi_context *ftdi = NULL;
-  if (usb_init(&ftdi)) {
+static Error usb_stream_done_(void *ctx, usize offset, usize size) {
+  UsbStream *stream = ctx;
+  pthread_mutex_lock(&stream->lock);
+  usize slot = (stream->head + stream->count) % NUS_USB_STREAM_SLOTS;
+  stream->sizes[slot] = size;
+  stream->count++;
+  Error err = stream->err;
+  pthread_cond_signal(&stream->filled);
+  pthread_mutex_unlock(&stream->lock);
+  return err;
+}
+
+static void usb_stream_init_(UsbStream *stream, FILE *file, u32 addr,
+                             NusUsbDigest *digest) {
+  memset(stream, 0, sizeof(UsbStream));
+  stream->file = file;
+  stream->addr = addr;
+  stream->digest = digest;
+  memset(digest, 0, sizeof(NusUsbDigest));
+  nus_crc_init(&stream->crc);
+  nus_manifest_init(&stream->manifest);
+}
+
+// the checksum and the manifest check once everything was written
+static void usb_stream_finish_(UsbStream *stream, const char *serial) {
+  stream->digest->crc_err = nus_crc_final(&stream->crc, &stream->digest->crc);
+  if (stream->mismatches) {
+    if (nuss_verbose) {
+      fprintf(stderr, "The dump does not match the last load\n");
+    }
+    nus_manifest_forget(serial);
+  }
+  nus_manifest_free(&stream->manifest);
+}
+
+static Error usb_stream_(NusUsb *usb, FILE *file, usize len, u32 addr,
+                         char command, NusUsbDigest *digest) {
+  UsbStream *stream = malloc(sizeof(UsbStream));
+  if (stream == NULL) {
     return ERR_NUS_USB;
   }
+  usb_stream_init_(stream, file, addr, digest);
+  if (command == 'R') {
+    nus_manifest_load(&stream->manifest, usb->transport.serial);
+  }
 
-  // init read
+  pthread_mutex_init(&stream->lock, NULL);
+  pthread_cond_init(&stream->filled, NULL);
+  pthread_cond_init(&stream->drained, NULL);
+
+  pthread_t writer;
+  Error err = ERR_THREAD;
+  stream->slots = malloc(NUS_USB_STREAM_SLOTS * NUS_USB_READ_BLOCK);
+  if (stream->slots &&
+      pthread_create(&writer, NULL, usb_stream_writer_, stream) == 0) {
+    UsbSink sink = {usb_stream_region_, usb_stream_done_, stream};
+    err = usb_read_regions_(usb, &sink, len, addr, command);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->finished = TRUE;
+    pthread_cond_signal(&stream->filled);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(writer, NULL);
+
+    if (!err) {
+      err = stream->err;
+    }
+  }
 
-  const usize block_size = 0x256;
-  if (nuss_verbose) {
-    fprintf(stderr, "Reading %li bytes with block size %ld...\n", buffer->len,
-            block_size);
+  if (!err) {
+    usb_stream_finish_(stream, usb->transport.serial);
+  } else {
+    nus_manifest_free(&stream->manifest);
   }
 
-  memset(buffer->data, 0, buffer->len);
+  pthread_cond_destroy(&stream->drained);
+  pthread_cond_destroy(&stream->filled);
+  pthread_mutex_destroy(&stream->lock);
+  free(stream->slots);
+  free(stream);
+  return err;
+}
 
-  u32 amount = 0;
-  for (usize read = 0; read < buffer->len; read += amount) { // NOLINT
-    i32 size = MIN(block_size, buffer->len - read);
-    command_setup(command, addr + read, size, 0);
-    command_send_(ftdi);
+Error nus_usb_open(NusUsb *usb) {
+  memset(usb, 0, sizeof(NusUsb));
+  if (nus_transport_init(&usb->transport, nuss_transport)) {
+    fprintf(stderr, "Unknown usb transport: %s\n", nuss_transport);
+    return ERR_TRANSPORT;
+  }
 
-    amount = ftdi_read_data(ftdi, buffer->data + read, size);
+  if (nus_transport_open(&usb->transport)) {
+    return ERR_NUS_USB;
+  }
 
-    if (amount > 0 && nuss_verbose) {
-      fprintf(stderr, "read %d bytes - %li/%li bytes\n", amount, amount + read,
-              buffer->len);
-    } else if (amount <= 0) {
-      if (nuss_verbose) {
-        fprintf(stderr, "read timeout!\n");
-      }
-      ftdi_free(ftdi);
+  if (usb_ready_(usb)) {
+    nus_transport_close(&usb->transport);
+    return ERR_NUS_USB;
+  }
+
+  return OK;
+}
+
+Error nus_usb_close(NusUsb *usb) {
+  return nus_transport_close(&usb->transport);
+}
+
+void nus_usb_load_fprint(FILE *file, const NusUsbLoad *load) {
+  if (load->delta) {
+    fprintf(file, "Sent %li of %li bytes, %li were unchanged\n", load->sent,
+            load->len, load->len - load->sent);
+  }
+}
+
+Error nus_usb_run(NusUsb *usb, NusUsbOp op, Buffer *buffer, u32 addr) {
+  usb->load = (NusUsbLoad){FALSE, 0, 0};
+  u32 rom = addr ? addr : NUS_ROM_BASE_ADDRESS;
+  u32 ram = addr ? addr : NUS_RAM_BASE_ADDRESS;
+  switch (op) {
+  case NUS_USB_BOOT:
+    return usb_boot_(usb);
+  case NUS_USB_LOAD:
+    return usb_write_(usb, buffer, rom, 'W');
+  case NUS_USB_DUMP:
+    return usb_read_(usb, buffer, rom, 'R');
+  case NUS_USB_RAM_WR:
+    return usb_write_(usb, buffer, ram, 'w');
+  case NUS_USB_RAM_RD:
+    return usb_read_(usb, buffer, ram, 'r');
+  case NUS_USB_LOAD_BOOT:
+    if (usb_write_(usb, buffer, rom, 'W')) {
       return ERR_NUS_USB;
     }
+    return usb_boot_(usb);
+  }
+  return ERR_NUS_USB;
+}
+
+Error nus_usb_run_file(NusUsb *usb, NusUsbOp op, FILE *file, usize len,
+                       u32 addr, NusUsbDigest *digest) {
+  NusUsbDigest unused;
+  if (digest == NULL) {
+    digest = &unused;
+  }
+  if (op == NUS_USB_DUMP) {
+    return usb_stream_(usb, file, len, addr ? addr : NUS_ROM_BASE_ADDRESS, 'R',
+                       digest);
   }
+  if (op == NUS_USB_RAM_RD) {
+    return usb_stream_(usb, file, len, addr ? addr : NUS_RAM_BASE_ADDRESS, 'r',
+                       digest);
+  }
+  return ERR_NUS_USB;
+}
 
-  // free ftdi
-  if (usb_free(ftdi)) {
+// runs a single operation. The device is opened and closed around it
+// unless a session daemon owns it
+static Error nus_usb_call_(NusUsbOp op, Buffer *buffer, u32 addr) {
+  if (nuss_session) {
+    return nus_session_request(nuss_session, op, buffer, addr);
+  }
+
+  NusUsb usb;
+  if (nus_usb_open(&usb)) {
     return ERR_NUS_USB;
   }
-  return OK;
+  Error err = nus_usb_run(&usb, op, buffer, addr);
+  nus_usb_load_fprint(stderr, &usb.load);
+  if (nus_usb_close(&usb) && !err) {
+    err = ERR_NUS_USB;
+  }
+  return err;
+}
+
+Error nus_usb_boot() { return nus_usb_call_(NUS_USB_BOOT, NULL, 0); }
+
+Error nus_usb_load(Buffer *buffer, u32 addr) {
+  return nus_usb_call_(NUS_USB_LOAD, buffer, addr);
 }
 
 Error nus_usb_dump(Buffer *buffer, u32 addr) {
-  if (addr == 0) {
-    addr = NUS_ROM_BASE_ADDRESS;
-  }
-  return nus_usb_read(buffer, addr, 'R');
+  return nus_usb_call_(NUS_USB_DUMP, buffer, addr);
 }
 
 Error nus_usb_ram_wr(Buffer *buffer, u32 addr) {
-  if (addr == 0) {
-    addr = NUS_RAM_BASE_ADDRESS;
-  }
-  return nus_usb_write(buffer, addr, 'w');
+  return nus_usb_call_(NUS_USB_RAM_WR, buffer, addr);
 }
 
 Error nus_usb_ram_rd(Buffer *buffer, u32 addr) {
-  if (addr == 0) {
-    addr = NUS_RAM_BASE_ADDRESS;
-  }
-  return nus_usb_read(buffer, addr, 'r');
+  return nus_usb_call_(NUS_USB_RAM_RD, buffer, addr);
 }
 
-#else
+Error nus_usb_load_boot(Buffer *buffer, u32 addr) {
+  return nus_usb_call_(NUS_USB_LOAD_BOOT, buffer, addr);
+}
 
-Error nus_usb_boot() {
-  fprintf(stderr,
-          "Nus usb is disabled. Recompile with the feature turned on!\n");
+// streams a dump or ram read into file
+static Error nus_usb_stream_call_(NusUsbOp op, FILE *file, usize len,
+                                  u32 addr, NusUsbDigest *digest) {
+  NusUsbDigest unused;
+  if (digest == NULL) {
+    digest = &unused;
+  }
+  if (nuss_session) {
+    // the daemon sends the regions as they arrive from the cart,
+    // they are written and hashed as they come off the socket.
+    // The daemon checks its manifest itself
+    UsbStream stream;
+    usb_stream_init_(&stream, file, addr, digest);
+    Error err = nus_session_request_stream(nuss_session, op, len, addr,
+                                           usb_stream_session_, &stream);
+    if (!err) {
+      usb_stream_finish_(&stream, NULL);
+    } else {
+      nus_manifest_free(&stream.manifest);
+    }
+    return err;
+  }
 
-  return ERR_NUS_USB;
+  NusUsb usb;
+  if (nus_usb_open(&usb)) {
+    return ERR_NUS_USB;
+  }
+  Error err = nus_usb_run_file(&usb, op, file, len, addr, digest);
+  if (nus_usb_close(&usb) && !err) {
+    err = ERR_NUS_USB;
+  }
+  return err;
+}
+
+Error nus_usb_dump_file(FILE *file, usize len, u32 addr,
+                        NusUsbDigest *digest) {
+  return nus_usb_stream_call_(NUS_USB_DUMP, file, len, addr, digest);
 }
 
-Error nus_usb_load(Buffer *buffer, u32 addr) { return nus_usb_boot(); }
+Error nus_usb_ram_rd_file(FILE *file, usize len, u32 addr,
+                          NusUsbDigest *digest) {
+  return nus_usb_stream_call_(NUS_USB_RAM_RD, file, len, addr, digest);
+}
+
+#ifdef TEST
+
+#include "nusemu.h"
 
-Error nus_usb_dump(Buffer *buffer, u32 addr) { return nus_usb_boot(); }
+void test_nus_usb_emu(void **state) {
+  char dir[] = "/tmp/nussusbXXXXXX";
+  assert_non_null(mkdtemp(dir));
+  setenv("NUSS_MANIFEST_DIR", dir, 1);
+  nus_emu_reset();
+  nus_stats_init(nus_usb_stats());
+  nuss_transport = "emu";
 
-Error nus_usb_ram_wr(Buffer *buffer, u32 addr) { return nus_usb_boot(); }
-Error nus_usb_ram_rd(Buffer *buffer, u32 addr) { return nus_usb_boot(); }
+  usize len = 0x200000;
+  Buffer rom;
+  buffer_init(&rom);
+  buffer_resize(&rom, len);
+  for (usize i = 0; i < len; i++) {
+    rom.data[i] = (u8)(i ^ (i >> 9));
+  }
+
+  // a load sends everything and dumps back the same bytes.
+  // It asks the cart whether it is ready instead of pausing, once when
+  // the device is opened and once after the write
+  assert_int_equal(OK, nus_usb_load(&rom, 0));
+  assert_int_equal(2, nus_usb_stats()->handshakes);
+  assert_int_equal(0, nus_usb_stats()->retries);
+  assert_memory_equal(rom.data, nus_emu_memory(NUS_EMU_ROM_ADDR, len), len);
+  u64 first = nus_emu_stats()->written;
+  assert_true(first > len);
+
+  Buffer dump;
+  buffer_init(&dump);
+  buffer_resize(&dump, len - 100);
+  assert_int_equal(OK, nus_usb_dump(&dump, 0));
+  assert_memory_equal(rom.data, dump.data, len - 100);
+
+  // every connection, finished load and transfer is counted
+  const NusStats *stats = nus_usb_stats();
+  assert_int_equal(3, stats->handshakes);
+  assert_int_equal(0, stats->retries);
+  assert_int_equal(len, stats->write.bytes);
+  assert_true(stats->write.blocks >= len / 0x10000);
+  assert_int_equal(len - 100, stats->read.bytes);
+  assert_int_equal(len / 0x10000, stats->read.blocks);
+
+  // a streamed dump writes the same bytes and hashes them on the way
+  FILE *file = tmpfile();
+  assert_non_null(file);
+  NusUsbDigest digest;
+  assert_int_equal(OK, nus_usb_dump_file(file, len - 100, 0, &digest));
+  assert_int_equal(len - 100, ftell(file));
+  rewind(file);
+  assert_int_equal(len - 100, fread(dump.data, 1, len - 100, file));
+  assert_memory_equal(rom.data, dump.data, len - 100);
+  fclose(file);
+  assert_int_equal(nus_crc32(0, rom.data, len - 100), digest.crc32);
+  NusCrc stored;
+  NusCrc computed;
+  nus_crc_verify(rom.data, len, &stored, &computed);
+  assert_int_equal(OK, digest.crc_err);
+  assert_int_equal(computed.crc1, digest.crc.crc1);
+  assert_int_equal(computed.crc2, digest.crc.crc2);
+  assert_int_equal(stored.crc1, digest.stored.crc1);
+
+  // the next load only sends the block that changed
+  rom.data[0x100010] ^= 0xFF;
+  u64 before = nus_emu_stats()->written;
+  assert_int_equal(OK, nus_usb_load(&rom, 0));
+  assert_memory_equal(rom.data, nus_emu_memory(NUS_EMU_ROM_ADDR, len), len);
+  assert_true(nus_emu_stats()->written - before < 0x20000);
+
+  // a cart that was loaded from somewhere else with the same header
+  // fails the samples of the blocks that would be skipped
+  memset(nus_emu_memory(NUS_EMU_ROM_ADDR + 0x180000, 0x10000), 0xAA,
+         0x10000);
+  before = nus_emu_stats()->written;
+  assert_int_equal(OK, nus_usb_load(&rom, 0));
+  assert_memory_equal(rom.data, nus_emu_memory(NUS_EMU_ROM_ADDR, len), len);
+  assert_true(nus_emu_stats()->written - before > len);
+
+  // after a power cycle everything is sent again
+  nus_emu_reset();
+  assert_int_equal(OK, nus_usb_load(&rom, 0));
+  assert_memory_equal(rom.data, nus_emu_memory(NUS_EMU_ROM_ADDR, len), len);
+  assert_true(nus_emu_stats()->written > len);
+
+  // ram goes both ways, a short last block is padded
+  // and boots are passed on
+  Buffer ram;
+  buffer_init(&ram);
+  buffer_inject(&ram, 0, rom.data, 1000);
+  assert_int_equal(OK, nus_usb_ram_wr(&ram, 0));
+  assert_int_equal(0, nus_emu_memory(NUS_EMU_RAM_ADDR, 1024)[1000]);
+  memset(ram.data, 0, 1000);
+  assert_int_equal(OK, nus_usb_ram_rd(&ram, 0));
+  assert_memory_equal(rom.data, ram.data, 1000);
+  assert_int_equal(OK, nus_usb_boot());
+  assert_int_equal(1, nus_emu_stats()->boots);
+
+  // a load and boot boots once the unchanged rom is in place
+  before = nus_emu_stats()->written;
+  assert_int_equal(OK, nus_usb_load_boot(&rom, 0));
+  assert_true(nus_emu_stats()->written - before < 0x20000);
+  assert_int_equal(2, nus_emu_stats()->boots);
+
+  buffer_free(&ram);
+  buffer_free(&dump);
+  buffer_free(&rom);
+  nus_manifest_forget("emu");
+  nuss_transport = NULL;
+  nus_emu_reset();
+  unsetenv("NUSS_MANIFEST_DIR");
+  assert_int_equal(0, rmdir(dir));
+}
 
 #endif
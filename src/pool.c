@@ -0,0 +1,197 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "macros.h"
+
+typedef struct Pool { // NOLINT
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  pthread_cond_t drained;
+
+  usize len;
+  usize next;
+  bool *done;
+  // results handed to done so far and how far jobs may run ahead of them
+  usize handed;
+  usize window;
+
+  PoolFn job;
+  void *ctx;
+} Pool;
+
+usize pool_default_threads(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) {
+    return 1;
+  }
+  return (usize)cores;
+}
+
+static void *pool_worker_(void *arg) {
+  Pool *pool = arg;
+
+  while (TRUE) {
+    pthread_mutex_lock(&pool->lock);
+    usize index = pool->next++;
+    // finished results wait in memory until done takes them,
+    // don't let them pile up faster than the caller consumes them
+    while (index < pool->len && index >= pool->handed + pool->window) {
+      pthread_cond_wait(&pool->drained, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (index >= pool->len) {
+      break;
+    }
+
+    pool->job(index, pool->ctx);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->done[index] = TRUE;
+    pthread_cond_broadcast(&pool->finished);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  return NULL;
+}
+
+Error pool_run(usize len, usize threads, PoolFn job, PoolFn done, void *ctx) {
+  if (threads > len) {
+    threads = len;
+  }
+
+  if (threads <= 1) {
+    for (usize i = 0; i < len; i++) {
+      job(i, ctx);
+      if (done) {
+        done(i, ctx);
+      }
+    }
+    return OK;
+  }
+
+  Pool pool;
+  pool.len = len;
+  pool.next = 0;
+  pool.job = job;
+  pool.ctx = ctx;
+  pool.done = calloc(len, sizeof(bool));
+  pool.handed = 0;
+  pool.window = threads * POOL_WINDOW;
+  pthread_t *workers = malloc(threads * sizeof(pthread_t));
+  if (pool.done == NULL || workers == NULL) {
+    free(pool.done);
+    free(workers);
+    return ERR_THREAD;
+  }
+
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.finished, NULL);
+  pthread_cond_init(&pool.drained, NULL);
+
+  usize started = 0;
+  for (; started < threads; started++) {
+    if (pthread_create(&workers[started], NULL, pool_worker_, &pool)) {
+      break;
+    }
+  }
+
+  Error err = OK;
+  if (started == 0) {
+    // no worker could be started, nothing is going to pick up jobs
+    err = ERR_THREAD;
+    pool.next = len;
+  }
+
+  // hand out results in order while the workers keep going
+  for (usize i = 0; i < len && !err; i++) {
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.done[i]) {
+      pthread_cond_wait(&pool.finished, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (done) {
+      done(i, ctx);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.handed = i + 1;
+    pthread_cond_broadcast(&pool.drained);
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  for (usize i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool.drained);
+  pthread_cond_destroy(&pool.finished);
+  pthread_mutex_destroy(&pool.lock);
+  free(pool.done);
+  free(workers);
+
+  return err;
+}
+
+#ifdef TEST
+
+#include "macros.h"
+
+struct PoolTest {
+  usize squares[64];
+  usize order[64];
+  usize done;
+  pthread_mutex_t lock;
+  bool ahead;
+};
+
+static void pool_test_job_(usize index, void *ctx) {
+  struct PoolTest *t = ctx;
+  // make later jobs finish first every now and then
+  if (index % 7 == 0) {
+    usleep(1000);
+  }
+  // jobs never get more than the window ahead of done
+  pthread_mutex_lock(&t->lock);
+  if (index >= t->done + 8 * POOL_WINDOW) {
+    t->ahead = TRUE;
+  }
+  pthread_mutex_unlock(&t->lock);
+  t->squares[index] = index * index;
+}
+
+static void pool_test_done_(usize index, void *ctx) {
+  struct PoolTest *t = ctx;
+  assert_int_equal(index * index, t->squares[index]);
+  pthread_mutex_lock(&t->lock);
+  t->order[t->done++] = index;
+  pthread_mutex_unlock(&t->lock);
+}
+
+void test_pool(void **state) {
+  struct PoolTest t;
+  memset(&t, 0, sizeof(t));
+  pthread_mutex_init(&t.lock, NULL);
+
+  assert_int_equal(OK, pool_run(64, 8, pool_test_job_, pool_test_done_, &t));
+  assert_int_equal(64, t.done);
+  assert_false(t.ahead);
+  for (usize i = 0; i < 64; i++) {
+    assert_int_equal(i, t.order[i]);
+  }
+
+  // single threaded runs inline
+  pthread_mutex_destroy(&t.lock);
+  memset(&t, 0, sizeof(t));
+  pthread_mutex_init(&t.lock, NULL);
+  assert_int_equal(OK, pool_run(10, 1, pool_test_job_, pool_test_done_, &t));
+  assert_int_equal(10, t.done);
+  pthread_mutex_destroy(&t.lock);
+
+  assert_true(pool_default_threads() >= 1);
+}
+
+#endif
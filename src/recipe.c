@@ -0,0 +1,80 @@
+#include "recipe.h"
+
+usize recipe_split(char *text, char **argv) {
+  usize argc = 0;
+  char *c = text;
+
+  while (*c) {
+    if (*c == '#') {
+      while (*c && *c != '\n') {
+        c++;
+      }
+    } else if (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r') {
+      c++;
+    } else {
+      char end = ' ';
+      if (*c == '"') {
+        end = '"';
+        c++;
+      }
+      if (argv) {
+        argv[argc] = c;
+      }
+      argc++;
+
+      while (*c && *c != end &&
+             (end == '"' || (*c != '\t' && *c != '\n' && *c != '\r'))) {
+        c++;
+      }
+      if (*c) {
+        if (argv) {
+          *c = '\0';
+        }
+        c++;
+      }
+    }
+  }
+
+  return argc;
+}
+
+#ifdef TEST
+
+#include <string.h>
+
+void test_recipe_split(void **state) {
+  char text[] = "--nusseth\t-o out.z64\r\n"
+                "# a comment \"with quotes\" --op 1\n"
+                "  --title \"MY ROM\" --op\t1 # trailing comment\n"
+                "\"\" --to 32768";
+  char *argv[16];
+
+  // counting leaves the text untouched
+  char copy[sizeof(text)];
+  memcpy(copy, text, sizeof(text));
+  assert_int_equal(10, recipe_split(text, NULL));
+  assert_memory_equal(copy, text, sizeof(text));
+
+  assert_int_equal(10, recipe_split(text, argv));
+  assert_string_equal("--nusseth", argv[0]);
+  assert_string_equal("-o", argv[1]);
+  assert_string_equal("out.z64", argv[2]);
+  assert_string_equal("--title", argv[3]);
+  assert_string_equal("MY ROM", argv[4]);
+  assert_string_equal("--op", argv[5]);
+  assert_string_equal("1", argv[6]);
+  assert_string_equal("", argv[7]);
+  assert_string_equal("--to", argv[8]);
+  assert_string_equal("32768", argv[9]);
+
+  // nothing but whitespace and comments
+  char empty[] = " \t\r\n# --nusseth\n#";
+  assert_int_equal(0, recipe_split(empty, argv));
+
+  // an unterminated quote runs to the end of the text
+  char open[] = "--title \"MY ROM";
+  assert_int_equal(2, recipe_split(open, argv));
+  assert_string_equal("MY ROM", argv[1]);
+}
+
+#endif
@@ -0,0 +1,487 @@
+#include "session.h"
+#include "cfg.h"
+#include "macros.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// the size of the pieces a client reads a streamed read in
+#define NUS_SESSION_PIECE 0x10000
+
+static volatile sig_atomic_t session_stop_ = 0;
+
+static void session_signal_(int sig) { session_stop_ = 1; }
+
+static Error session_read_(int fd, void *data, usize len) {
+  u8 *d = data;
+  while (len) {
+    ssize_t n = read(fd, d, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return ERR_READ;
+    }
+    d += n;
+    len -= n;
+  }
+  return OK;
+}
+
+static Error session_write_(int fd, const void *data, usize len) {
+  const u8 *d = data;
+  while (len) {
+    ssize_t n = send(fd, d, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return ERR_WRITE;
+    }
+    d += n;
+    len -= n;
+  }
+  return OK;
+}
+
+static bool session_writes_(NusUsbOp op) {
+  return op == NUS_USB_LOAD || op == NUS_USB_RAM_WR ||
+         op == NUS_USB_LOAD_BOOT;
+}
+
+static bool session_reads_(NusUsbOp op) {
+  return op == NUS_USB_DUMP || op == NUS_USB_RAM_RD;
+}
+
+static Error session_addr_(struct sockaddr_un *addr, const char *path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    return ERR_NUS_USB;
+  }
+  strcpy(addr->sun_path, path);
+  return OK;
+}
+
+// opens the device again after a failure closed it
+static Error session_open_(NusUsb *usb, bool *open) {
+  if (*open) {
+    return OK;
+  }
+  Error err = nus_usb_open(usb);
+  *open = err == OK;
+  return err;
+}
+
+// start over with a fresh connection after a failure
+static void session_reset_(NusUsb *usb, bool *open) {
+  nus_usb_close(usb);
+  *open = FALSE;
+}
+
+// runs a request that sends data or nothing to the cart
+static Error session_serve_write_(int client, NusUsb *usb, bool *open,
+                                  const NusSessionRequest *req,
+                                  Error *result) {
+  // the buffer is rebuilt with the same fill so rom writes
+  // can still send the padding with the fill command
+  Buffer buffer;
+  buffer_init(&buffer);
+  buffer_resize(&buffer, req->len);
+  NusSessionReply reply = {OK, 0, 0};
+  if (buffer.len != req->len) {
+    reply.err = ERR_READ;
+  }
+  if (session_writes_(req->op) && buffer.len &&
+      session_read_(client, buffer.data, buffer.len)) {
+    buffer_free(&buffer);
+    return ERR_READ;
+  }
+  buffer.fill_len = req->fill_len;
+  buffer.fill_val = (u8)req->fill_val;
+
+  if (!reply.err) {
+    reply.err = session_open_(usb, open);
+  }
+  if (!reply.err) {
+    reply.err = nus_usb_run(usb, req->op, &buffer, req->addr);
+    if (reply.err) {
+      session_reset_(usb, open);
+    }
+    // the daemon has no one to tell, the client reports it
+    reply.delta = usb->load.delta;
+    reply.sent = usb->load.sent;
+    reply.len = usb->load.len;
+  }
+  buffer_free(&buffer);
+
+  *result = reply.err;
+  return session_write_(client, &reply, sizeof(reply));
+}
+
+// streams a read to the client while it arrives from the cart
+// and follows it with the result
+static Error session_serve_read_(int client, NusUsb *usb, bool *open,
+                                 const NusSessionRequest *req,
+                                 Error *result) {
+  NusSessionReply reply = {session_open_(usb, open), 0, 0};
+  if (!reply.err) {
+    reply.len = req->len;
+  }
+  *result = reply.err;
+  Error err = session_write_(client, &reply, sizeof(reply));
+  if (err || reply.err) {
+    return err;
+  }
+
+  FILE *out = NULL;
+  int fd = dup(client);
+  if (fd >= 0 && (out = fdopen(fd, "w")) == NULL) {
+    close(fd);
+  }
+  reply.err = ERR_WRITE;
+  if (out) {
+    reply.err = nus_usb_run_file(usb, req->op, out, req->len, req->addr, NULL);
+    if (fclose(out) && !reply.err) {
+      reply.err = ERR_WRITE;
+    }
+  }
+
+  *result = reply.err;
+  if (reply.err) {
+    // the client cannot tell how much of the read arrived,
+    // hanging up is the only way to tell it the read failed
+    session_reset_(usb, open);
+    return ERR_WRITE;
+  }
+  reply.len = 0;
+  return session_write_(client, &reply, sizeof(reply));
+}
+
+// handles one request of a client.
+// Returns an error once the client is gone
+static Error session_serve_one_(int client, NusUsb *usb, bool *open) {
+  NusSessionRequest req;
+  if (session_read_(client, &req, sizeof(req)) ||
+      req.magic != NUS_SESSION_MAGIC || req.op > NUS_USB_LOAD_BOOT) {
+    return ERR_READ;
+  }
+
+  Error result;
+  Error err;
+  if (session_reads_(req.op)) {
+    err = session_serve_read_(client, usb, open, &req, &result);
+  } else {
+    err = session_serve_write_(client, usb, open, &req, &result);
+  }
+
+  if (nuss_verbose) {
+    fprintf(stderr, "session: op %d at 0x%x: %d\n", req.op, req.addr,
+            result);
+  }
+  // the daemon moves the bytes, so it reports the transfers of its clients
+  nus_stats_print(nus_usb_stats(), stderr, nuss_stats);
+  return err;
+}
+
+Error nus_session_serve(const char *path) {
+  struct sockaddr_un addr;
+  if (session_addr_(&addr, path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return ERR_NUS_USB;
+  }
+
+  // a socket left behind by an old daemon is replaced,
+  // anything else at path is not ours to delete
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "%s exists and is not a socket\n", path);
+      return ERR_NUS_USB;
+    }
+    unlink(path);
+  }
+
+  NusUsb usb;
+  if (nus_usb_open(&usb)) {
+    return ERR_NUS_USB;
+  }
+  bool open = TRUE;
+
+  int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server < 0 || bind(server, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(server, 4)) {
+    fprintf(stderr, "Unable to listen on %s: %s\n", path, strerror(errno));
+    if (server >= 0) {
+      close(server);
+    }
+    nus_usb_close(&usb);
+    return ERR_NUS_USB;
+  }
+
+  // no SA_RESTART so accept returns once the daemon is interrupted
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = session_signal_;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  // a client that hangs up during a read fails the write to its socket
+  // instead of taking the daemon down
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+
+  if (nuss_verbose) {
+    fprintf(stderr, "session: listening on %s\n", path);
+  }
+
+  while (!session_stop_) {
+    int client = accept(server, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    // a client may send any number of requests
+    while (!session_stop_ && session_serve_one_(client, &usb, &open) == OK) {
+    }
+    close(client);
+  }
+
+  close(server);
+  unlink(path);
+  if (open) {
+    nus_usb_close(&usb);
+  }
+  return OK;
+}
+
+static int session_connect_(const char *path) {
+  struct sockaddr_un sa;
+  if (session_addr_(&sa, path)) {
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+    fprintf(stderr, "Unable to connect to the session at %s\n", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+Error nus_session_request_stream(const char *path, NusUsbOp op, usize len,
+                                 u32 addr, NusSessionConsume consume,
+                                 void *ctx) {
+  if (!session_reads_(op)) {
+    return ERR_NUS_USB;
+  }
+  int fd = session_connect_(path);
+  if (fd < 0) {
+    return ERR_NUS_USB;
+  }
+
+  NusSessionRequest req = {NUS_SESSION_MAGIC, op, addr, 0, len, 0};
+  NusSessionReply reply;
+  Error err = session_write_(fd, &req, sizeof(req));
+  if (!err) {
+    err = session_read_(fd, &reply, sizeof(reply));
+  }
+  if (!err && reply.err) {
+    err = reply.err;
+  } else if (!err && reply.len != len) {
+    err = ERR_READ;
+  }
+
+  // only one piece of the read is held at a time
+  u8 *piece = NULL;
+  if (!err && len && (piece = malloc(NUS_SESSION_PIECE)) == NULL) {
+    err = ERR_READ;
+  }
+  for (usize offset = 0; !err && offset < len; offset += NUS_SESSION_PIECE) {
+    usize size = MIN(NUS_SESSION_PIECE, len - offset);
+    err = session_read_(fd, piece, size);
+    if (!err) {
+      err = consume(ctx, piece, size);
+    }
+  }
+  free(piece);
+
+  // the result of the read follows the bytes
+  if (!err) {
+    err = session_read_(fd, &reply, sizeof(reply));
+  }
+  if (!err && reply.err) {
+    err = reply.err;
+  }
+  if (!err) {
+    NusUsbLoad load = {reply.delta, reply.sent, reply.len};
+    nus_usb_load_fprint(stderr, &load);
+  }
+
+  close(fd);
+  return err;
+}
+
+// copies the pieces of a read into a buffer
+static Error session_copy_(void *ctx, const u8 *data, usize size) {
+  u8 **dst = ctx;
+  memcpy(*dst, data, size);
+  *dst += size;
+  return OK;
+}
+
+Error nus_session_request(const char *path, NusUsbOp op, Buffer *buffer,
+                          u32 addr) {
+  if (session_reads_(op)) {
+    // the data read from the cart replaces the buffer
+    buffer_materialize(buffer, (usize)-1);
+    u8 *dst = buffer->data;
+    Error err = nus_session_request_stream(path, op, buffer->len, addr,
+                                           session_copy_, &dst);
+    if (!err) {
+      buffer_mark_dirty(buffer, 0, buffer->len);
+    }
+    return err;
+  }
+
+  int fd = session_connect_(path);
+  if (fd < 0) {
+    return ERR_NUS_USB;
+  }
+
+  NusSessionRequest req = {NUS_SESSION_MAGIC, op, addr, 0, 0, 0};
+  if (session_writes_(op)) {
+    req.len = buffer->len;
+    req.fill_len = buffer->fill_len;
+    req.fill_val = buffer->fill_val;
+  }
+
+  NusSessionReply reply;
+  Error err = session_write_(fd, &req, sizeof(req));
+  if (!err && session_writes_(op) && buffer->len) {
+    err = session_write_(fd, buffer->data, buffer->len);
+  }
+  if (!err) {
+    err = session_read_(fd, &reply, sizeof(reply));
+  }
+  if (!err && reply.err) {
+    err = reply.err;
+  }
+  if (!err) {
+    NusUsbLoad load = {reply.delta, reply.sent, reply.len};
+    nus_usb_load_fprint(stderr, &load);
+  }
+
+  close(fd);
+  return err;
+}
+
+#ifdef TEST
+
+#include "nuscrc.h"
+#include "nusemu.h"
+#include "nusmanifest.h"
+#include <sys/wait.h>
+
+void test_nus_session_path(void **state) {
+  char path[] = "/tmp/nusssessionXXXXXX";
+  int fd = mkstemp(path);
+  assert_true(fd >= 0);
+  assert_int_equal(4, write(fd, "rom!", 4));
+  close(fd);
+
+  // a file at the socket path is left alone
+  assert_int_equal(ERR_NUS_USB, nus_session_serve(path));
+  struct stat st;
+  assert_int_equal(0, stat(path, &st));
+  assert_int_equal(4, st.st_size);
+  unlink(path);
+}
+
+void test_nus_session_stream(void **state) {
+  char dir[] = "/tmp/nusssessionXXXXXX";
+  assert_non_null(mkdtemp(dir));
+  setenv("NUSS_MANIFEST_DIR", dir, 1);
+  char path[64];
+  snprintf(path, sizeof(path), "%s/sock", dir);
+  nus_emu_reset();
+  nuss_transport = "emu";
+
+  usize len = 0x180000;
+  Buffer rom;
+  buffer_init(&rom);
+  buffer_resize(&rom, len);
+  for (usize i = 0; i < len; i++) {
+    rom.data[i] = (u8)(i ^ (i >> 11));
+  }
+  assert_int_equal(OK, nus_usb_load(&rom, 0));
+
+  // the daemon gets its own copy of the emulated cart
+  pid_t daemon = fork();
+  assert_true(daemon >= 0);
+  if (daemon == 0) {
+    _exit(nus_session_serve(path));
+  }
+  struct sockaddr_un sa;
+  assert_int_equal(OK, session_addr_(&sa, path));
+  bool listening = FALSE;
+  for (usize i = 0; i < 500 && !listening; i++) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    listening = connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0;
+    close(fd);
+    if (!listening) {
+      usleep(10000);
+    }
+  }
+  assert_true(listening);
+  nuss_session = path;
+
+  // a streamed dump comes off the socket in pieces
+  FILE *file = tmpfile();
+  assert_non_null(file);
+  NusUsbDigest digest;
+  assert_int_equal(OK, nus_usb_dump_file(file, len - 100, 0, &digest));
+  assert_int_equal(len - 100, ftell(file));
+  Buffer dump;
+  buffer_init(&dump);
+  buffer_resize(&dump, len - 100);
+  rewind(file);
+  assert_int_equal(len - 100, fread(dump.data, 1, len - 100, file));
+  fclose(file);
+  assert_memory_equal(rom.data, dump.data, len - 100);
+  assert_int_equal(nus_crc32(0, rom.data, len - 100), digest.crc32);
+
+  // and so does one into a buffer, followed by more requests
+  memset(dump.data, 0, dump.len);
+  assert_int_equal(OK, nus_usb_dump(&dump, 0));
+  assert_memory_equal(rom.data, dump.data, len - 100);
+  assert_int_equal(OK, nus_usb_boot());
+
+  nuss_session = NULL;
+  kill(daemon, SIGTERM);
+  int status;
+  assert_int_equal(daemon, waitpid(daemon, &status, 0));
+  assert_true(WIFEXITED(status));
+  assert_int_equal(OK, WEXITSTATUS(status));
+
+  buffer_free(&dump);
+  buffer_free(&rom);
+  nus_manifest_forget("emu");
+  nuss_transport = NULL;
+  nus_emu_reset();
+  unsetenv("NUSS_MANIFEST_DIR");
+  assert_int_equal(0, rmdir(dir));
+}
+
+#endif